@@ -0,0 +1,831 @@
+/**
+ * bt_hci.h
+ *
+ * Description:
+ *   Minimal raw-socket HCI layer, just what the module needs from BlueZ
+ *   without linking libbluetooth.
+ *
+ * Features:
+ *   - Kernel ABI types for HCI sockets and ioctls (`bdaddr_t`, connection lists)
+ *   - Adapter lookup by route, name (`hciN`) or address
+ *   - Synchronous HCI command/event exchange with a timeout
+ *   - Commands sent without waiting, for callers reading events themselves
+ *   - Read RSSI and Remote Name Request helpers
+ *   - Page timeout read/write, for short presence probes
+ *   - Periodic inquiry with RSSI, run by the controller on its own
+ *   - Sniff mode exit and re-entry, for RSSI samples on an active link
+ *   - Monitor channel, a read-only copy of the traffic of every adapter
+ *
+ * Requires:
+ *   - Linux with Bluetooth sockets
+ *   - POSIX 2008 interfaces (`_DEFAULT_SOURCE` or similar before any include)
+ *   - C23 Standard (Use -std=c23).
+ *
+ * Errors:
+ *   Functions return -1 and set errno, like the libbluetooth calls they replace.
+ *
+ */
+#pragma once
+
+#ifndef __STDC_VERSION__
+#error A modern C standard (like C23) is required
+#elif __STDC_VERSION__ < 202311L
+#error This code must be compiled with -std=c23
+#endif
+
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+
+#ifndef AF_BLUETOOTH
+#define AF_BLUETOOTH 31
+#endif
+#define BTPROTO_HCI 1
+
+#define SOL_HCI    0
+#define HCI_FILTER 2
+
+#define HCI_CHANNEL_RAW     0
+#define HCI_CHANNEL_MONITOR 2
+
+#define HCI_MAX_DEV        16
+#define HCI_DEV_NONE       0xFFFF
+#define HCI_MAX_EVENT_SIZE 260
+
+// Packet types, first byte on a raw socket
+#define HCI_COMMAND_PKT 0x01
+#define HCI_EVENT_PKT   0x04
+
+// Adapter flags, bit numbers in `hci_dev_info.flags`
+#define HCI_UP 0
+
+#define HCIGETDEVLIST  _IOR ('H', 210, int)
+#define HCIGETDEVINFO  _IOR ('H', 211, int)
+#define HCIGETCONNLIST _IOR ('H', 212, int)
+#define HCIGETCONNINFO _IOR ('H', 213, int)
+
+// Link types in `hci_conn_info.type`, the others carry audio
+#define ACL_LINK 0x01
+#define LE_LINK  0x80
+
+// Events
+#define EVT_INQUIRY_COMPLETE         0x01
+#define EVT_INQUIRY_RESULT           0x02
+#define EVT_CONN_COMPLETE            0x03
+#define EVT_DISCONN_COMPLETE         0x05
+#define EVT_REMOTE_NAME_REQ_COMPLETE 0x07
+#define EVT_CMD_COMPLETE             0x0E
+#define EVT_CMD_STATUS               0x0F
+#define EVT_MODE_CHANGE              0x14
+#define EVT_INQUIRY_RESULT_WITH_RSSI 0x22
+#define EVT_EXTENDED_INQUIRY_RESULT  0x2F
+#define EVT_LE_META_EVENT            0x3E
+
+// LE meta event subevents
+#define EVT_LE_CONN_COMPLETE          0x01
+#define EVT_LE_ADVERTISING_REPORT     0x02
+#define EVT_LE_ENH_CONN_COMPLETE      0x0A
+#define EVT_LE_EXT_ADVERTISING_REPORT 0x0D
+
+// Address types of LE advertising reports; random ones can be set to anything
+#define LE_PUBLIC_ADDRESS  0x00
+#define LE_PUBLIC_IDENTITY 0x02
+
+// Monitor channel packet opcodes
+#define HCI_MON_NEW_INDEX   0
+#define HCI_MON_DEL_INDEX   1
+#define HCI_MON_COMMAND_PKT 2
+#define HCI_MON_EVENT_PKT   3
+
+// Commands, as Opcode Group Field and Opcode Command Field
+#define OGF_LINK_CTL          0x01
+#define OCF_PERIODIC_INQUIRY  0x0003
+#define OCF_EXIT_PERIODIC_INQ 0x0004
+#define OCF_REMOTE_NAME_REQ   0x0019
+
+#define OGF_LINK_POLICY     0x02
+#define OCF_SNIFF_MODE      0x0003
+#define OCF_EXIT_SNIFF_MODE 0x0004
+
+// Link modes reported by the Mode Change event
+#define HCI_CM_ACTIVE 0x00
+#define HCI_CM_SNIFF  0x02
+
+// Status of a command the controller refuses in the current state
+#define HCI_COMMAND_DISALLOWED 0x0C
+
+#define OGF_HOST_CTL           0x03
+#define OCF_READ_PAGE_TIMEOUT  0x0017
+#define OCF_WRITE_PAGE_TIMEOUT 0x0018
+#define OCF_WRITE_INQUIRY_MODE 0x0045
+
+// Inquiry modes, how the controller reports what it finds
+#define BT_INQUIRY_STANDARD 0x00
+#define BT_INQUIRY_RSSI     0x01
+#define BT_INQUIRY_EXTENDED 0x02
+
+// General Inquiry Access Code, every discoverable device answers it
+#define BT_LAP_GIAC 0x9E8B33
+
+#define OGF_STATUS_PARAM 0x05
+#define OCF_READ_RSSI    0x0005
+
+//~ Wire opcode of a command
+#define BT_OPCODE(ogf, ocf) ((uint16_t)(((ocf) & 0x03ff) | ((ogf) << 10)))
+
+//~ Host to controller (little endian) byte order of a 16-bit field
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define htobs(d) ((uint16_t)(d))
+#else
+#define htobs(d) __builtin_bswap16 (d)
+#endif
+#define btohs(d) htobs (d)
+
+//~ Bluetooth device address, least significant byte first
+typedef struct {
+  uint8_t b[6];
+} __attribute__ ((packed)) bdaddr_t;
+
+struct sockaddr_hci {
+  sa_family_t hci_family;
+  unsigned short hci_dev;
+  unsigned short hci_channel;
+};
+
+//~ Which packets a raw socket receives, see `bt_send_req`
+struct hci_filter {
+  uint32_t type_mask;
+  uint32_t event_mask[2];
+  uint16_t opcode;
+};
+
+struct hci_dev_req {
+  uint16_t dev_id;
+  uint32_t dev_opt;
+};
+
+struct hci_dev_list_req {
+  uint16_t dev_num;
+  struct hci_dev_req dev_req[];
+};
+
+struct hci_dev_stats {
+  uint32_t err_rx, err_tx;
+  uint32_t cmd_tx, evt_rx;
+  uint32_t acl_tx, acl_rx;
+  uint32_t sco_tx, sco_rx;
+  uint32_t byte_rx, byte_tx;
+};
+
+struct hci_dev_info {
+  uint16_t dev_id;
+  char name[8];
+  bdaddr_t bdaddr;
+  uint32_t flags;
+  uint8_t type;
+  uint8_t features[8];
+  uint32_t pkt_type;
+  uint32_t link_policy;
+  uint32_t link_mode;
+  uint16_t acl_mtu;
+  uint16_t acl_pkts;
+  uint16_t sco_mtu;
+  uint16_t sco_pkts;
+  struct hci_dev_stats stat;
+};
+
+struct hci_conn_info {
+  uint16_t handle;
+  bdaddr_t bdaddr;
+  uint8_t type;
+  uint8_t out;
+  uint16_t state;
+  uint32_t link_mode;
+};
+
+struct hci_conn_list_req {
+  uint16_t dev_id;
+  uint16_t conn_num;
+  struct hci_conn_info conn_info[];
+};
+
+struct hci_conn_info_req {
+  bdaddr_t bdaddr;
+  uint8_t type;
+  struct hci_conn_info conn_info[];
+};
+
+typedef struct {
+  uint8_t status;
+  uint16_t handle;
+  int8_t rssi;
+} __attribute__ ((packed)) read_rssi_rp;
+#define READ_RSSI_RP_SIZE 4
+
+//~ Let `event` through a socket filter
+static inline void bt_filter_set_event (struct hci_filter *f, int event) {
+  f->event_mask[event >> 5] |= 1u << (event & 31);
+}
+
+//~ Header of every monitor channel packet, little endian, followed by `len` bytes
+typedef struct {
+  uint16_t opcode; /**< One of `HCI_MON_*` */
+  uint16_t index;  /**< Adapter id */
+  uint16_t len;
+} __attribute__ ((packed)) bt_mon_hdr_t;
+
+//~ One command and the event that answers it
+typedef struct {
+  uint16_t ogf;
+  uint16_t ocf;
+  int event;    /**< Event carrying the reply, 0 for Command Complete */
+  void *cparam; /**< Command parameters */
+  int clen;
+  void *rparam; /**< Reply parameters, truncated to `rlen` */
+  int rlen;
+} bt_request_t;
+
+//~ Compare two addresses, 0 when equal
+static inline int bt_addr_cmp (const bdaddr_t *a, const bdaddr_t *b) {
+  for (int i = 0; i < 6; i++) {
+    if (a->b[i] != b->b[i]) return a->b[i] - b->b[i];
+  }
+  return 0;
+}
+
+//~ First adapter that is up, -1 if there is none
+int bt_get_route (void);
+
+//~ Adapter id from `hciN` or its address, -1 if unknown or down
+int bt_devid (const char *str);
+
+//~ Address of an adapter that is up
+int bt_devba (int dev_id, bdaddr_t *addr);
+
+//~ Raw HCI socket bound to an adapter, close with `close`
+int bt_open_dev (int dev_id);
+
+//~ Socket receiving a copy of the HCI traffic of every adapter, needs CAP_NET_RAW
+int bt_open_monitor (void);
+
+//~ Send a command without waiting, its reply arrives as events on sockets letting them in
+int bt_send_cmd (int sock, uint16_t ogf, uint16_t ocf, const void *cparam, int clen);
+
+//~ Handle of the connection of `type` (`ACL_LINK`, `LE_LINK`) to `addr`
+//! -1 with errno ENOENT when there is none
+int bt_conn_handle (int sock, const bdaddr_t *addr, uint8_t type, uint16_t *handle);
+
+//~ Send a command and wait up to `timeout_ms` for its reply
+//! The socket filter is changed for the exchange and restored afterwards. A command
+//! rejected in its Command Status replies with just that status byte. Every socket of
+//! an adapter sees every reply: Remote Name Request, Mode Change and Read RSSI replies
+//! are matched on the address or connection handle as well as on the opcode
+int bt_send_req (int sock, bt_request_t *rq, int timeout_ms);
+
+//~ RSSI of a connection, in dBm
+int bt_read_rssi (int sock, uint16_t handle, int8_t *rssi, int timeout_ms);
+
+//~ Page timeout of the controller, in 0.625 ms slots
+int bt_read_page_timeout (int sock, uint16_t *slots, int timeout_ms);
+
+//~ Set how long the controller pages before giving up, in 0.625 ms slots (1 to 0xFFFF)
+//! Controller wide: every later connection attempt uses it until changed again
+int bt_write_page_timeout (int sock, uint16_t slots, int timeout_ms);
+
+//~ Choose how inquiry results are reported, one of `BT_INQUIRY_*`
+int bt_write_inquiry_mode (int sock, uint8_t mode, int timeout_ms);
+
+//~ Let the controller inquire on its own every `min_period` to `max_period`
+//! Units of 1.28 s, `max_period > min_period > length`, results arrive as events
+int bt_periodic_inquiry (
+    int sock, uint16_t max_period, uint16_t min_period, uint8_t length, int timeout_ms
+);
+
+//~ Stop a periodic inquiry started by `bt_periodic_inquiry`
+int bt_exit_periodic_inquiry (int sock, int timeout_ms);
+
+//~ Bring a BR/EDR link out of sniff mode, waiting for the Mode Change
+//! 1 once it is active, 0 if it was not in sniff mode, -1 with errno set on failure
+int bt_exit_sniff_mode (int sock, uint16_t handle, int timeout_ms);
+
+//~ Ask for sniff mode, anchor points every `min_interval` to `max_interval` slots
+//! Returns once the controller accepted the command, the link changes mode later
+int bt_sniff_mode (
+    int sock, uint16_t handle, uint16_t max_interval, uint16_t min_interval, int timeout_ms
+);
+
+//~ Page a device and read its name, `name` is always null terminated
+int bt_read_remote_name (
+    int sock,
+    const bdaddr_t *addr,
+    uint8_t pscan_rep_mode,
+    uint16_t clock_offset,
+    int len,
+    char *name,
+    int timeout_ms
+);
+
+#ifdef BT_HCI_IMPL
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "z3_toys.h"
+
+typedef struct {
+  uint8_t status;
+  bdaddr_t bdaddr;
+  char name[248];
+} __attribute__ ((packed)) bt__remote_name_rp;
+
+typedef struct {
+  bdaddr_t bdaddr;
+  uint8_t pscan_rep_mode;
+  uint8_t pscan_mode;
+  uint16_t clock_offset;
+} __attribute__ ((packed)) bt__remote_name_cp;
+
+static int bt__ctl_socket (void) {
+  return socket (AF_BLUETOOTH, SOCK_RAW | SOCK_CLOEXEC, BTPROTO_HCI);
+}
+
+static int bt__dev_info (int dev_id, struct hci_dev_info *info) {
+  int sock = bt__ctl_socket ();
+  if (sock < 0) return -1;
+
+  info->dev_id = dev_id;
+  int res = ioctl (sock, HCIGETDEVINFO, info);
+
+  int saved = errno;
+  close (sock);
+  errno = saved;
+  return res;
+}
+
+// Calls `match` on every adapter that is up, returns the first id it accepts
+static int bt__find_dev (bool (*match) (int dev_id, const void *arg), const void *arg) {
+  int sock = bt__ctl_socket ();
+  if (sock < 0) return -1;
+
+  alignas (struct hci_dev_list_req) char buf[
+      sizeof (struct hci_dev_list_req) + HCI_MAX_DEV * sizeof (struct hci_dev_req)
+  ];
+  struct hci_dev_list_req *list = (struct hci_dev_list_req *)buf;
+  list->dev_num = HCI_MAX_DEV;
+
+  int res = ioctl (sock, HCIGETDEVLIST, list);
+  int saved = errno;
+  close (sock);
+  if (res < 0) {
+    errno = saved;
+    return -1;
+  }
+
+  for (int i = 0; i < list->dev_num; i++) {
+    const struct hci_dev_req *dev = &list->dev_req[i];
+    if (!(dev->dev_opt & (1u << HCI_UP))) continue;
+    if (match (dev->dev_id, arg)) return dev->dev_id;
+  }
+
+  errno = ENODEV;
+  return -1;
+}
+
+static bool bt__any_dev (int dev_id, const void *arg) {
+  (void)dev_id;
+  (void)arg;
+  return true;
+}
+
+static bool bt__same_addr (int dev_id, const void *arg) {
+  bdaddr_t addr;
+  return bt_devba (dev_id, &addr) == 0 && bt_addr_cmp (&addr, arg) == 0;
+}
+
+static int64_t bt__now_ms (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Reads events until the one answering `rq` shows up
+static int bt__await_reply (int sock, bt_request_t *rq, uint16_t opcode, int timeout_ms) {
+  uint8_t buf[HCI_MAX_EVENT_SIZE];
+  int64_t deadline = bt__now_ms () + timeout_ms;
+
+  for (;;) {
+    int64_t left = deadline - bt__now_ms ();
+    if (left <= 0) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+
+    struct pollfd pfd = {.fd = sock, .events = POLLIN};
+    int ready = poll (&pfd, 1, (int)left);
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    if (ready == 0) {
+      errno = ETIMEDOUT;
+      return -1;
+    }
+
+    ssize_t n = read (sock, buf, sizeof (buf));
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      return -1;
+    }
+
+    // packet type, event code, parameter length
+    if (n < 3 || buf[0] != HCI_EVENT_PKT) continue;
+    uint8_t event = buf[1];
+    const uint8_t *param = buf + 3;
+    int plen = (int)n - 3;
+
+    if (event == EVT_CMD_STATUS) {
+      // status, free command slots, opcode
+      if (plen < 4 || (param[2] | param[3] << 8) != opcode) continue;
+
+      if (rq->event != EVT_CMD_STATUS) {
+        if (param[0] == 0) continue;  // accepted, the answer comes in `rq->event`
+
+        // rejected, every completion event starts with the same status byte
+        plen = 1;
+      }
+    } else if (event == EVT_CMD_COMPLETE) {
+      // free command slots, opcode, return parameters
+      if (plen < 3 || (param[1] | param[2] << 8) != opcode) continue;
+      param += 3;
+      plen -= 3;
+
+      // every socket of the adapter sees every Read RSSI, only the link we asked about
+      if (opcode == BT_OPCODE (OGF_STATUS_PARAM, OCF_READ_RSSI)) {
+        const uint16_t *handle = rq->cparam;
+        if (plen < 3 || (param[1] | param[2] << 8) != btohs (*handle)) continue;
+      }
+    } else if (event == EVT_REMOTE_NAME_REQ_COMPLETE && event == rq->event) {
+      // only the name of the device we asked for
+      const bt__remote_name_cp *cp = rq->cparam;
+      if (plen < 7 || memcmp (param + 1, cp->bdaddr.b, 6) != 0) continue;
+    } else if (event == EVT_MODE_CHANGE && event == rq->event) {
+      // only the link we asked about, the command starts with its handle
+      const uint16_t *handle = rq->cparam;
+      if (plen < 3 || (param[1] | param[2] << 8) != btohs (*handle)) continue;
+    } else if (event != rq->event) {
+      continue;
+    }
+
+    int copy = plen < rq->rlen ? plen : rq->rlen;
+    memcpy (rq->rparam, param, copy);
+    rq->rlen = copy;
+    return 0;
+  }
+}
+
+int bt_get_route (void) {
+  return bt__find_dev (bt__any_dev, NULL);
+}
+
+int bt_devid (const char *str) {
+  if (strncmp (str, "hci", 3) == 0 && str[3] >= '0' && str[3] <= '9') {
+    // the whole rest must be the number, `hci0junk` names no adapter; ids are 16 bit,
+    // with HCI_DEV_NONE taken to mean no adapter at all
+    char *end;
+    errno = 0;
+    long dev_id = strtol (str + 3, &end, 10);
+    if (*end || errno || dev_id >= HCI_DEV_NONE) {
+      errno = EINVAL;
+      return -1;
+    }
+    bdaddr_t addr;
+    if (bt_devba ((int)dev_id, &addr) < 0) return -1;
+    return (int)dev_id;
+  }
+
+  bdaddr_t addr;
+  if (!z3_bdaddr_parse (str, strlen (str), addr.b)) {
+    errno = EINVAL;
+    return -1;
+  }
+  return bt__find_dev (bt__same_addr, &addr);
+}
+
+int bt_devba (int dev_id, bdaddr_t *addr) {
+  struct hci_dev_info info;
+  if (bt__dev_info (dev_id, &info) < 0) return -1;
+
+  if (!(info.flags & (1u << HCI_UP))) {
+    errno = ENETDOWN;
+    return -1;
+  }
+
+  *addr = info.bdaddr;
+  return 0;
+}
+
+int bt_open_dev (int dev_id) {
+  int sock = bt__ctl_socket ();
+  if (sock < 0) return -1;
+
+  struct sockaddr_hci addr = {
+      .hci_family = AF_BLUETOOTH, .hci_dev = dev_id, .hci_channel = HCI_CHANNEL_RAW
+  };
+  if (bind (sock, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+    int saved = errno;
+    close (sock);
+    errno = saved;
+    return -1;
+  }
+
+  return sock;
+}
+
+int bt_open_monitor (void) {
+  int sock = bt__ctl_socket ();
+  if (sock < 0) return -1;
+
+  struct sockaddr_hci addr = {
+      .hci_family = AF_BLUETOOTH, .hci_dev = HCI_DEV_NONE, .hci_channel = HCI_CHANNEL_MONITOR
+  };
+  if (bind (sock, (struct sockaddr *)&addr, sizeof (addr)) < 0) {
+    int saved = errno;
+    close (sock);
+    errno = saved;
+    return -1;
+  }
+
+  return sock;
+}
+
+int bt_send_cmd (int sock, uint16_t ogf, uint16_t ocf, const void *cparam, int clen) {
+  uint16_t opcode = BT_OPCODE (ogf, ocf);
+
+  // packet type, opcode, parameter length, parameters
+  uint8_t cmd[4 + 255];
+  if (clen < 0 || clen > 255) {
+    errno = EINVAL;
+    return -1;
+  }
+  cmd[0] = HCI_COMMAND_PKT;
+  cmd[1] = opcode & 0xFF;
+  cmd[2] = opcode >> 8;
+  cmd[3] = clen;
+  if (clen) memcpy (cmd + 4, cparam, clen);
+
+  int res;
+  do {
+    res = write (sock, cmd, 4 + clen);
+  } while (res < 0 && (errno == EINTR || errno == EAGAIN));
+  return res < 0 ? -1 : 0;
+}
+
+int bt_conn_handle (int sock, const bdaddr_t *addr, uint8_t type, uint16_t *handle) {
+  alignas (struct hci_conn_info_req) char buf[
+      sizeof (struct hci_conn_info_req) + sizeof (struct hci_conn_info)
+  ];
+  struct hci_conn_info_req *req = (struct hci_conn_info_req *)buf;
+  req->bdaddr = *addr;
+  req->type = type;
+
+  if (ioctl (sock, HCIGETCONNINFO, req) < 0) return -1;
+  *handle = req->conn_info[0].handle;
+  return 0;
+}
+
+int bt_send_req (int sock, bt_request_t *rq, int timeout_ms) {
+  uint16_t opcode = BT_OPCODE (rq->ogf, rq->ocf);
+
+  struct hci_filter saved;
+  socklen_t saved_len = sizeof (saved);
+  if (getsockopt (sock, SOL_HCI, HCI_FILTER, &saved, &saved_len) < 0) return -1;
+
+  // only the events that can answer this command
+  struct hci_filter filter = {.type_mask = 1u << HCI_EVENT_PKT, .opcode = htobs (opcode)};
+  bt_filter_set_event (&filter, EVT_CMD_STATUS);
+  bt_filter_set_event (&filter, EVT_CMD_COMPLETE);
+  if (rq->event) bt_filter_set_event (&filter, rq->event);
+  if (setsockopt (sock, SOL_HCI, HCI_FILTER, &filter, sizeof (filter)) < 0) return -1;
+
+  int res = bt_send_cmd (sock, rq->ogf, rq->ocf, rq->cparam, rq->clen);
+  if (res >= 0) res = bt__await_reply (sock, rq, opcode, timeout_ms);
+
+  int err = errno;
+  setsockopt (sock, SOL_HCI, HCI_FILTER, &saved, saved_len);
+  errno = err;
+  return res < 0 ? -1 : 0;
+}
+
+int bt_read_rssi (int sock, uint16_t handle, int8_t *rssi, int timeout_ms) {
+  uint16_t cp = htobs (handle);
+  read_rssi_rp rp;
+
+  bt_request_t rq = {
+      .ogf = OGF_STATUS_PARAM,
+      .ocf = OCF_READ_RSSI,
+      .cparam = &cp,
+      .clen = sizeof (cp),
+      .rparam = &rp,
+      .rlen = READ_RSSI_RP_SIZE,
+  };
+
+  if (bt_send_req (sock, &rq, timeout_ms) < 0) return -1;
+
+  if (rq.rlen < READ_RSSI_RP_SIZE || rp.status != 0) {
+    errno = EIO;
+    return -1;
+  }
+
+  *rssi = rp.rssi;
+  return 0;
+}
+
+// Sends a command whose Command Complete carries only a status
+static int bt__status_cmd (
+    int sock, uint16_t ogf, uint16_t ocf, void *cparam, int clen, int timeout_ms
+) {
+  uint8_t status;
+
+  bt_request_t rq = {
+      .ogf = ogf,
+      .ocf = ocf,
+      .cparam = cparam,
+      .clen = clen,
+      .rparam = &status,
+      .rlen = sizeof (status),
+  };
+
+  if (bt_send_req (sock, &rq, timeout_ms) < 0) return -1;
+
+  if (rq.rlen < 1 || status != 0) {
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+int bt_read_page_timeout (int sock, uint16_t *slots, int timeout_ms) {
+  // status, timeout
+  uint8_t rp[3];
+
+  bt_request_t rq = {
+      .ogf = OGF_HOST_CTL,
+      .ocf = OCF_READ_PAGE_TIMEOUT,
+      .rparam = rp,
+      .rlen = sizeof (rp),
+  };
+
+  if (bt_send_req (sock, &rq, timeout_ms) < 0) return -1;
+
+  if (rq.rlen < (int)sizeof (rp) || rp[0] != 0) {
+    errno = EIO;
+    return -1;
+  }
+
+  *slots = rp[1] | rp[2] << 8;
+  return 0;
+}
+
+int bt_write_page_timeout (int sock, uint16_t slots, int timeout_ms) {
+  uint16_t cp = htobs (slots);
+  return bt__status_cmd (
+      sock, OGF_HOST_CTL, OCF_WRITE_PAGE_TIMEOUT, &cp, sizeof (cp), timeout_ms
+  );
+}
+
+int bt_write_inquiry_mode (int sock, uint8_t mode, int timeout_ms) {
+  return bt__status_cmd (sock, OGF_HOST_CTL, OCF_WRITE_INQUIRY_MODE, &mode, 1, timeout_ms);
+}
+
+int bt_periodic_inquiry (
+    int sock, uint16_t max_period, uint16_t min_period, uint8_t length, int timeout_ms
+) {
+  // max period, min period, LAP, length, unlimited responses
+  uint8_t cp[9] = {
+      max_period & 0xFF,
+      max_period >> 8,
+      min_period & 0xFF,
+      min_period >> 8,
+      BT_LAP_GIAC & 0xFF,
+      (BT_LAP_GIAC >> 8) & 0xFF,
+      BT_LAP_GIAC >> 16,
+      length,
+      0,
+  };
+
+  return bt__status_cmd (
+      sock, OGF_LINK_CTL, OCF_PERIODIC_INQUIRY, cp, sizeof (cp), timeout_ms
+  );
+}
+
+int bt_exit_periodic_inquiry (int sock, int timeout_ms) {
+  return bt__status_cmd (sock, OGF_LINK_CTL, OCF_EXIT_PERIODIC_INQ, NULL, 0, timeout_ms);
+}
+
+int bt_exit_sniff_mode (int sock, uint16_t handle, int timeout_ms) {
+  uint16_t cp = htobs (handle);
+  // status, handle, current mode, interval
+  uint8_t rp[6];
+
+  bt_request_t rq = {
+      .ogf = OGF_LINK_POLICY,
+      .ocf = OCF_EXIT_SNIFF_MODE,
+      .event = EVT_MODE_CHANGE,
+      .cparam = &cp,
+      .clen = sizeof (cp),
+      .rparam = rp,
+      .rlen = sizeof (rp),
+  };
+
+  if (bt_send_req (sock, &rq, timeout_ms) < 0) return -1;
+
+  // already active (or on hold), nothing to exit
+  if (rq.rlen >= 1 && rp[0] == HCI_COMMAND_DISALLOWED) return 0;
+
+  if (rq.rlen < 4 || rp[0] != 0 || rp[3] != HCI_CM_ACTIVE) {
+    errno = EIO;
+    return -1;
+  }
+
+  return 1;
+}
+
+int bt_sniff_mode (
+    int sock, uint16_t handle, uint16_t max_interval, uint16_t min_interval, int timeout_ms
+) {
+  // handle, max interval, min interval, attempt, timeout; the last two as the kernel does
+  uint16_t cp[5] = {
+      htobs (handle), htobs (max_interval), htobs (min_interval), htobs (4), htobs (1)
+  };
+  uint8_t status;
+
+  bt_request_t rq = {
+      .ogf = OGF_LINK_POLICY,
+      .ocf = OCF_SNIFF_MODE,
+      .event = EVT_CMD_STATUS,
+      .cparam = cp,
+      .clen = sizeof (cp),
+      .rparam = &status,
+      .rlen = sizeof (status),
+  };
+
+  if (bt_send_req (sock, &rq, timeout_ms) < 0) return -1;
+
+  if (rq.rlen < 1 || status != 0) {
+    errno = EIO;
+    return -1;
+  }
+
+  return 0;
+}
+
+int bt_read_remote_name (
+    int sock,
+    const bdaddr_t *addr,
+    uint8_t pscan_rep_mode,
+    uint16_t clock_offset,
+    int len,
+    char *name,
+    int timeout_ms
+) {
+  bt__remote_name_cp cp = {
+      .bdaddr = *addr,
+      .pscan_rep_mode = pscan_rep_mode,
+      .clock_offset = htobs (clock_offset),
+  };
+  bt__remote_name_rp rp;
+
+  bt_request_t rq = {
+      .ogf = OGF_LINK_CTL,
+      .ocf = OCF_REMOTE_NAME_REQ,
+      .event = EVT_REMOTE_NAME_REQ_COMPLETE,
+      .cparam = &cp,
+      .clen = sizeof (cp),
+      .rparam = &rp,
+      .rlen = sizeof (rp),
+  };
+
+  if (bt_send_req (sock, &rq, timeout_ms) < 0) return -1;
+
+  if (rq.rlen < 1 || rp.status != 0) {
+    errno = EIO;
+    return -1;
+  }
+
+  // the name is null terminated only when shorter than 248 bytes
+  int name_len = rq.rlen - (int)offsetof (bt__remote_name_rp, name);
+  if (name_len > len - 1) name_len = len - 1;
+  if (name_len < 0) name_len = 0;
+  memcpy (name, rp.name, name_len);
+  name[name_len] = '\0';
+  return 0;
+}
+
+#endif // BT_HCI_IMPL
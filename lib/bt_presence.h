@@ -0,0 +1,219 @@
+/**
+ * bt_presence.h
+ *
+ * Description:
+ *   Table of the last sighting of each configured device, written by
+ *   pam_bluetoothd and read by the module before it sends any radio command.
+ *
+ * Features:
+ *   - One file holding a bdaddr-keyed z3 map, published with rename(2)
+ *   - Sightings packed in 64 bits, written and read atomically without locks
+ *   - Reader checks the file belongs to root before trusting it
+ *
+ * Requires:
+ *   - z3_toys.h (Z3Map)
+ *   - bt_hci.h (bdaddr_t)
+ *   - C23 Standard (Use -std=c23).
+ *
+ */
+#pragma once
+
+#ifndef __STDC_VERSION__
+#error A modern C standard (like C23) is required
+#elif __STDC_VERSION__ < 202311L
+#error This code must be compiled with -std=c23
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bt_hci.h"
+#include "z3_toys.h"
+
+//~ Where the daemon publishes the table, the directory must be root's alone
+#define BT_PRESENCE_DIR "/run/pam_bluetooth"
+#define BT_PRESENCE_FILE BT_PRESENCE_DIR "/presence"
+
+//~ What produced a sighting
+enum {
+  BT_SEEN_NONE = 0,        /**< Never seen since the table was created */
+  BT_SEEN_INQUIRY = 1,     /**< Inquiry result with RSSI */
+  BT_SEEN_MONITOR = 2,     /**< Traffic of other software, on the monitor channel */
+  BT_SEEN_PROBE = 3,       /**< Read RSSI of pam_bluetoothd on a connection */
+  BT_SEEN_ADVERTISING = 4, /**< LE advertising report, anyone can send one for any address */
+};
+
+//~ Last time a device was seen
+typedef struct {
+  uint64_t at_ms; /**< `bt_presence_now_ms` of the sighting */
+  int8_t rssi;    /**< dBm */
+  uint8_t source; /**< One of `BT_SEEN_*` */
+} bt_sighting_t;
+
+//~ Mapping of a presence file
+typedef struct {
+  Z3Map map;   /**< Keys are bdaddr, values one packed `_Atomic uint64_t` */
+  void *mem;   /**< Start of the mapping */
+  size_t size; /**< Bytes mapped */
+} bt_presence_t;
+
+//~ Milliseconds on the boot clock, shared by every process and counting suspend
+uint64_t bt_presence_now_ms (void);
+
+//~ Create the table for `n` devices at `path` (through a temporary file and rename)
+//! Mapped read-write for `bt_presence_record`, -1 with errno set on failure
+int bt_presence_create (bt_presence_t *table, const char *path, const bdaddr_t *devs, size_t n);
+
+//~ Store a sighting, ignored for devices the table was not created with (writer only)
+//! `BT_SEEN_ADVERTISING` never replaces a sighting of another source
+void bt_presence_record (
+    bt_presence_t *table, const bdaddr_t *addr, int8_t rssi, uint8_t source
+);
+
+//~ Map an existing table read-only
+//! -1 with errno set if missing, malformed, or writable by anyone but root
+int bt_presence_open (bt_presence_t *table, const char *path);
+
+//~ Last sighting of `addr`, false if the table does not hold it or it was never seen
+bool bt_presence_lookup (const bt_presence_t *table, const bdaddr_t *addr, bt_sighting_t *out);
+
+//~ Unmap a table from `bt_presence_create` or `bt_presence_open`
+void bt_presence_close (bt_presence_t *table);
+
+#ifdef BT_PRESENCE_IMPL
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// time (48 bits) | rssi | source, one atomic word per device
+static uint64_t bt__sighting_pack (uint64_t at_ms, int8_t rssi, uint8_t source) {
+  return at_ms << 16 | (uint64_t)(uint8_t)rssi << 8 | source;
+}
+
+uint64_t bt_presence_now_ms (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_BOOTTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int bt_presence_create (
+    bt_presence_t *table, const char *path, const bdaddr_t *devs, size_t n
+) {
+  // twice the devices keeps probes short
+  size_t size = z3_map_bytes (n * 2, 6, sizeof (uint64_t));
+  if (size == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  char tmp[256];
+  if (snprintf (tmp, sizeof (tmp), "%s.new", path) >= (int)sizeof (tmp)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+
+  // a leftover of a crash, a link planted there is removed, not followed
+  if (unlink (tmp) < 0 && errno != ENOENT) return -1;
+  int fd = open (tmp, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0644);
+  if (fd < 0) return -1;
+
+  void *mem = MAP_FAILED;
+  if (ftruncate (fd, size) == 0) {
+    mem = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+
+  int saved = errno;
+  close (fd);
+  if (mem == MAP_FAILED) {
+    unlink (tmp);
+    errno = saved;
+    return -1;
+  }
+
+  z3_bdmap_init (&table->map, mem, size, n * 2, sizeof (uint64_t));
+  for (size_t i = 0; i < n; i++) z3_map_put (&table->map, devs[i].b);
+
+  // readers only ever see a complete table
+  if (rename (tmp, path) < 0) {
+    saved = errno;
+    munmap (mem, size);
+    unlink (tmp);
+    errno = saved;
+    return -1;
+  }
+
+  table->mem = mem;
+  table->size = size;
+  return 0;
+}
+
+void bt_presence_record (
+    bt_presence_t *table, const bdaddr_t *addr, int8_t rssi, uint8_t source
+) {
+  _Atomic uint64_t *slot = z3_map_get (&table->map, addr->b);
+  if (!slot) return;
+
+  // the module ignores advertising, it must not hide a sighting the module can use
+  if (source == BT_SEEN_ADVERTISING) {
+    uint8_t old = atomic_load_explicit (slot, memory_order_relaxed) & 0xFF;
+    if (old != BT_SEEN_NONE && old != BT_SEEN_ADVERTISING) return;
+  }
+
+  uint64_t packed = bt__sighting_pack (bt_presence_now_ms (), rssi, source);
+  atomic_store_explicit (slot, packed, memory_order_relaxed);
+}
+
+int bt_presence_open (bt_presence_t *table, const char *path) {
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+
+  // a table anyone else could write would let them unlock the session
+  struct stat st;
+  if (fstat (fd, &st) < 0 || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+      !S_ISREG (st.st_mode)) {
+    close (fd);
+    errno = EPERM;
+    return -1;
+  }
+
+  void *mem = mmap (NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close (fd);
+  if (mem == MAP_FAILED) return -1;
+
+  if (!z3_map_view (&table->map, mem, st.st_size) || table->map.hdr->key_size != 6 ||
+      table->map.hdr->val_size != sizeof (uint64_t)) {
+    munmap (mem, st.st_size);
+    errno = EINVAL;
+    return -1;
+  }
+
+  table->mem = mem;
+  table->size = st.st_size;
+  return 0;
+}
+
+bool bt_presence_lookup (const bt_presence_t *table, const bdaddr_t *addr, bt_sighting_t *out) {
+  _Atomic uint64_t *slot = z3_map_get (&table->map, addr->b);
+  if (!slot) return false;
+
+  uint64_t packed = atomic_load_explicit (slot, memory_order_relaxed);
+  if ((packed & 0xFF) == BT_SEEN_NONE) return false;
+
+  *out = (bt_sighting_t){
+      .at_ms = packed >> 16, .rssi = (int8_t)(packed >> 8), .source = packed & 0xFF
+  };
+  return true;
+}
+
+void bt_presence_close (bt_presence_t *table) {
+  if (table->mem) munmap (table->mem, table->size);
+  table->mem = NULL;
+}
+
+#endif // BT_PRESENCE_IMPL
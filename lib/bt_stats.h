@@ -0,0 +1,636 @@
+/**
+ * bt_stats.h
+ *
+ * Description:
+ *   What past auths learned about each device, kept across reboots: recent
+ *   RSSI distribution, how often each probe found the device, and how long
+ *   the probes took. Created by pam_bluetoothd (or `make install`), written by
+ *   the module of root callers, read by anyone for diagnostics.
+ *
+ * Features:
+ *   - One file holding a z3 map keyed by adapter and device, sized by pam_bluetoothd
+ *   - Rolling windows: the last `BT_STATS_WINDOW` to `2 * BT_STATS_WINDOW` probes
+ *   - Counters and histograms updated with atomics, readers take no lock
+ *   - Writers of several processes serialized with flock(2)
+ *   - Shadow runs: agreement and latency of a candidate configuration, and the
+ *     auths it sat out
+ *
+ * Requires:
+ *   - z3_toys.h (Z3Map, Z3Hist)
+ *   - bt_hci.h (bdaddr_t)
+ *   - C23 Standard (Use -std=c23).
+ *   - _GNU_SOURCE where the implementation is included (mkostemp)
+ *
+ */
+#pragma once
+
+#ifndef __STDC_VERSION__
+#error A modern C standard (like C23) is required
+#elif __STDC_VERSION__ < 202311L
+#error This code must be compiled with -std=c23
+#endif
+
+#include <stdalign.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "bt_hci.h"
+#include "z3_toys.h"
+
+//~ Where the module keeps its statistics
+#define BT_STATS_DIR  "/var/lib/pam_bluetooth"
+#define BT_STATS_FILE BT_STATS_DIR "/stats"
+
+//~ Fewest map slots of a file, 7/8 of them (14 adapter and device pairs) usable
+//! `bt_stats_prepare` doubles them until the pairs it is asked for fit; a writer that
+//! finds the file full drops the probes of new pairs
+#define BT_STATS_SLOTS 16
+
+//~ Probes per window, the distributions cover the current and the previous one
+//! An auth records one to three probes, so a window spans 22 to 64 auths
+#define BT_STATS_WINDOW 64
+
+//~ `rssi` of a probe that got no RSSI value
+#define BT_STATS_NO_RSSI 127
+
+//~ Histogram shapes: RSSI as -dBm, exact from 0 to 127; latency in us, ~12% up to 33 s
+#define BT_STATS_RSSI_BYTES    Z3_HIST_BYTES (6, 7)
+#define BT_STATS_LATENCY_BYTES Z3_HIST_BYTES (3, 25)
+
+//~ Ways the module looks for a device
+enum {
+  BT_PROBE_TABLE = 0,     /**< Sighting in the pam_bluetoothd presence table */
+  BT_PROBE_CONNECTED = 1, /**< Read RSSI on an existing connection */
+  BT_PROBE_PAGE = 2,      /**< Remote Name Request, paging the device */
+  BT_PROBE_KINDS = 3,
+};
+
+//~ Sides of a shadow run
+enum {
+  BT_SHADOW_REAL = 0,      /**< Configuration that decided the auth */
+  BT_SHADOW_CANDIDATE = 1, /**< Configuration evaluated alongside, without effect */
+};
+
+//~ Value of one adapter and device pair in the file
+typedef struct {
+  _Atomic uint64_t updated_s;  /**< Wall clock of the last record */
+  _Atomic uint32_t window;     /**< Window being recorded, 0 or 1 */
+  _Atomic uint32_t window_len; /**< Probes recorded in it */
+  _Atomic uint64_t attempts[BT_PROBE_KINDS];
+  _Atomic uint64_t found[BT_PROBE_KINDS]; /**< Device there and strong enough */
+  _Atomic uint32_t window_attempts[2][BT_PROBE_KINDS]; /**< `attempts` of each window */
+  _Atomic uint32_t window_found[2][BT_PROBE_KINDS];
+  alignas (8) unsigned char rssi[2][BT_STATS_RSSI_BYTES];
+  alignas (8) unsigned char latency[BT_PROBE_KINDS][2][BT_STATS_LATENCY_BYTES];
+  _Atomic uint64_t shadow_runs;
+  _Atomic uint64_t shadow_agreed;
+  _Atomic uint64_t shadow_candidate_only; /**< Candidate found the device, real did not */
+  _Atomic uint64_t shadow_expired;        /**< Candidate ran out of its time budget */
+  _Atomic uint64_t shadow_skipped;        /**< Auths without a run, see `bt_stats_skip_shadow` */
+  _Atomic int64_t shadow_delta_us;        /**< Sum of candidate minus real latency */
+  alignas (8) unsigned char shadow_latency[2][2][BT_STATS_LATENCY_BYTES]; /**< Per side */
+} bt_stats_entry_t;
+
+//~ Mapping of a statistics file
+typedef struct {
+  Z3Map map;   /**< Keys are adapter then device address, values `bt_stats_entry_t` */
+  void *mem;   /**< Start of the mapping */
+  size_t size; /**< Bytes mapped */
+  int fd;      /**< Kept open by writers for flock, -1 for readers */
+  const char *path; /**< As given to `bt_stats_open`, writers reopen it once replaced */
+} bt_stats_t;
+
+//~ Both windows of a pair, summed up
+typedef struct {
+  uint64_t updated_s;
+  uint64_t attempts[BT_PROBE_KINDS];
+  uint64_t found[BT_PROBE_KINDS];
+  uint64_t recent_attempts[BT_PROBE_KINDS]; /**< Both windows only */
+  uint64_t recent_found[BT_PROBE_KINDS];
+  uint64_t rssi_samples;
+  int rssi_p10; /**< dBm, weakest tenth of the samples */
+  int rssi_p50;
+  int rssi_p90;
+  uint64_t latency_p50_us[BT_PROBE_KINDS];
+  uint64_t latency_p99_us[BT_PROBE_KINDS];
+  uint64_t shadow_runs;
+  uint64_t shadow_agreed;
+  uint64_t shadow_candidate_only;
+  uint64_t shadow_expired;
+  uint64_t shadow_skipped;
+  int64_t shadow_delta_mean_us; /**< Candidate minus real, negative when faster */
+  uint64_t shadow_p50_us[2];    /**< Indexed by `BT_SHADOW_*` */
+  uint64_t shadow_p99_us[2];
+} bt_stats_summary_t;
+
+//~ Make the statistics file at `path` ready for `pairs` adapter and device pairs
+//! Creates it if missing, replaces a file of another layout (history is lost) and moves
+//! a file too small to a larger one; writers mapping it follow. Run by pam_bluetoothd,
+//! never by the module. -1 with errno set on failure.
+int bt_stats_prepare (const char *path, size_t pairs);
+
+//~ Map the statistics file made by `bt_stats_prepare`, `path` must outlive `stats`
+//! -1 with errno set if it is missing, of another layout (EINVAL), or writable by
+//! anyone but root
+int bt_stats_open (bt_stats_t *stats, const char *path, bool writable);
+
+//~ Add one probe of `device` through `adapter`, silently dropped if the file is full
+void bt_stats_record (
+    bt_stats_t *stats,
+    const bdaddr_t *adapter,
+    const bdaddr_t *device,
+    int probe,
+    bool found,
+    int8_t rssi,
+    uint64_t latency_us
+);
+
+//~ Add one auth also decided by a candidate configuration, see `BT_SHADOW_*`
+//! `expired` when the candidate gave up for lack of time, its answer counts as is
+void bt_stats_record_shadow (
+    bt_stats_t *stats,
+    const bdaddr_t *adapter,
+    const bdaddr_t *device,
+    const bool found[2],
+    const uint64_t latency_us[2],
+    bool expired
+);
+
+//~ Add one auth the candidate configuration did not decide again
+//! The real probes paged and left a link up, any candidate would find the device over it
+void bt_stats_skip_shadow (bt_stats_t *stats, const bdaddr_t *adapter, const bdaddr_t *device);
+
+//~ Summary of a pair, false if it was never recorded
+bool bt_stats_summary (
+    const bt_stats_t *stats,
+    const bdaddr_t *adapter,
+    const bdaddr_t *device,
+    bt_stats_summary_t *out
+);
+
+//~ Iterate pairs, start with `*it = 0`, false when there are no more
+bool bt_stats_next (
+    const bt_stats_t *stats, size_t *it, bdaddr_t *adapter, bdaddr_t *device,
+    bt_stats_summary_t *out
+);
+
+//~ Unmap a file from `bt_stats_open`
+void bt_stats_close (bt_stats_t *stats);
+
+#ifdef BT_STATS_IMPL
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+// adapter then device, 12 bytes
+static void bt__stats_key (uint8_t key[12], const bdaddr_t *adapter, const bdaddr_t *device) {
+  memcpy (key, adapter->b, 6);
+  memcpy (key + 6, device->b, 6);
+}
+
+// Temporary file next to `path` with a map of `slots`, holding the pairs of `src` if
+// not NULL. Returns the open descriptor and its name in `tmp`, or -1 with errno set.
+static int bt__stats_tmp (const char *path, char tmp[256], size_t slots, const Z3Map *src) {
+  size_t size = z3_map_bytes (slots, 12, sizeof (bt_stats_entry_t));
+  if (size == 0) {
+    errno = EFBIG;
+    return -1;
+  }
+
+  // a name of its own, threads of one host may create or grow the file at once
+  if (snprintf (tmp, 256, "%s.XXXXXX", path) >= 256) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  int fd = mkostemp (tmp, O_CLOEXEC);
+  if (fd < 0) return -1;
+
+  void *mem = MAP_FAILED;
+  // readable by anyone, as `bt_stats_open` of a reader expects
+  if (fchmod (fd, 0644) == 0 && ftruncate (fd, size) == 0) {
+    mem = mmap (NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  }
+
+  bool filled = false;
+  if (mem != MAP_FAILED) {
+    Z3Map map;
+    filled = z3_map_init (&map, mem, size, slots, 12, sizeof (bt_stats_entry_t)) &&
+             (!src || z3_map_rehash (&map, src));
+    munmap (mem, size);
+    if (!filled) errno = ENOSPC;
+  }
+
+  if (!filled) {
+    int saved = errno;
+    close (fd);
+    unlink (tmp);
+    errno = saved;
+    return -1;
+  }
+  return fd;
+}
+
+// Fresh file of `slots` at `path`, published with link(2) so a concurrent creator wins
+// cleanly, or with rename(2) over a file that cannot be used
+static int bt__stats_create (const char *path, bool replace, size_t slots) {
+  char tmp[256];
+  int fd = bt__stats_tmp (path, tmp, slots, NULL);
+  if (fd < 0) return -1;
+
+  int res;
+  if (replace) {
+    res = rename (tmp, path);
+  } else {
+    res = link (tmp, path) == 0 || errno == EEXIST ? 0 : -1;
+  }
+
+  int saved = errno;
+  close (fd);
+  unlink (tmp);
+  errno = saved;
+  return res;
+}
+
+// Map an open file, taking ownership of `fd`
+static int bt__stats_map (bt_stats_t *stats, int fd, bool writable) {
+  // history may one day move thresholds, only root gets to write it
+  struct stat st;
+  if (fstat (fd, &st) < 0 || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH)) ||
+      !S_ISREG (st.st_mode)) {
+    close (fd);
+    errno = EPERM;
+    return -1;
+  }
+
+  int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+  void *mem = mmap (NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+  if (mem == MAP_FAILED) {
+    int saved = errno;
+    close (fd);
+    errno = saved;
+    return -1;
+  }
+
+  bool valid = writable ? z3_map_attach (&stats->map, mem, st.st_size)
+                        : z3_map_view (&stats->map, mem, st.st_size);
+  if (!valid || stats->map.hdr->key_size != 12 ||
+      stats->map.hdr->val_size != sizeof (bt_stats_entry_t)) {
+    munmap (mem, st.st_size);
+    close (fd);
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (!writable) {
+    close (fd);
+    fd = -1;
+  }
+
+  stats->mem = mem;
+  stats->size = st.st_size;
+  stats->fd = fd;
+  return 0;
+}
+
+int bt_stats_open (bt_stats_t *stats, const char *path, bool writable) {
+  stats->path = path;
+  int fd = open (path, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+  if (fd < 0) return -1;
+
+  return bt__stats_map (stats, fd, writable);
+}
+
+// Window `w` of every histogram of a pair, emptied
+static void bt__stats_reset_window (bt_stats_entry_t *entry, uint32_t w) {
+  for (int k = 0; k < BT_PROBE_KINDS; k++) {
+    atomic_store_explicit (&entry->window_attempts[w][k], 0, memory_order_relaxed);
+    atomic_store_explicit (&entry->window_found[w][k], 0, memory_order_relaxed);
+  }
+  z3_hist_init (entry->rssi[w], BT_STATS_RSSI_BYTES, 6, 7);
+  for (int k = 0; k < BT_PROBE_KINDS; k++) {
+    z3_hist_init (entry->latency[k][w], BT_STATS_LATENCY_BYTES, 3, 25);
+  }
+  for (int side = 0; side < 2; side++) {
+    z3_hist_init (entry->shadow_latency[side][w], BT_STATS_LATENCY_BYTES, 3, 25);
+  }
+}
+
+// Swap the mapping for the file now at `stats->path`, the old one kept on failure
+static int bt__stats_reopen (bt_stats_t *stats) {
+  int fd = open (stats->path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) return -1;
+
+  bt_stats_t fresh = {.path = stats->path};
+  if (bt__stats_map (&fresh, fd, true) < 0) return -1;
+
+  bt_stats_close (stats);
+  *stats = fresh;
+  return 0;
+}
+
+// Move every pair to a file of `slots`, taking its place at `stats->path`
+// Called with the file locked, and returns with the new one locked instead
+static int bt__stats_grow (bt_stats_t *stats, size_t slots) {
+  char tmp[256];
+  int fd = bt__stats_tmp (stats->path, tmp, slots, &stats->map);
+  if (fd < 0) return -1;
+
+  // locked before it is published, so no writer gets in between
+  if (flock (fd, LOCK_EX) < 0 || rename (tmp, stats->path) < 0) {
+    int saved = errno;
+    close (fd);
+    unlink (tmp);
+    errno = saved;
+    return -1;
+  }
+
+  bt_stats_t grown = {.path = stats->path};
+  if (bt__stats_map (&grown, fd, true) < 0) return -1;
+
+  // writers waiting for the old file find it unlinked and follow
+  bt_stats_close (stats);
+  *stats = grown;
+  return 0;
+}
+
+// Fewest slots, doubled from BT_STATS_SLOTS, of which `pairs` are usable
+static size_t bt__stats_slots (size_t pairs) {
+  size_t slots = BT_STATS_SLOTS;
+  while (slots - slots / 8 < pairs && slots <= SIZE_MAX / 2) slots *= 2;
+  return slots;
+}
+
+int bt_stats_prepare (const char *path, size_t pairs) {
+  int fd = open (path, O_RDWR | O_CLOEXEC);
+  if (fd < 0 && errno == ENOENT) return bt__stats_create (path, false, bt__stats_slots (pairs));
+  if (fd < 0) return -1;
+
+  bt_stats_t stats = {.path = path};
+  if (bt__stats_map (&stats, fd, true) < 0) {
+    // left behind by a version with another layout
+    if (errno != EINVAL) return -1;
+    return bt__stats_create (path, true, bt__stats_slots (pairs));
+  }
+
+  // auths may be recording, they follow once the file is replaced
+  int res = flock (stats.fd, LOCK_EX);
+  if (res == 0) {
+    // pairs recorded so far are kept, whatever was asked for
+    size_t len = stats.map.hdr->len;
+    size_t slots = bt__stats_slots (pairs > len ? pairs : len);
+    if (slots > stats.map.hdr->cap) res = bt__stats_grow (&stats, slots);
+    flock (stats.fd, LOCK_UN);
+  }
+
+  int saved = errno;
+  bt_stats_close (&stats);
+  errno = saved;
+  return res;
+}
+
+// Entry of a pair with the file locked, added if new; NULL and unlocked if the file is
+// full, only pam_bluetoothd makes it larger. Unlock with `flock (stats->fd, LOCK_UN)`.
+static bt_stats_entry_t *bt__stats_lock_entry (
+    bt_stats_t *stats, const bdaddr_t *adapter, const bdaddr_t *device
+) {
+  uint8_t key[12];
+  bt__stats_key (key, adapter, device);
+
+  // auths of other sessions may record at the same time
+  for (;;) {
+    if (flock (stats->fd, LOCK_EX) < 0) return NULL;
+
+    // grown or replaced by another writer since it was mapped
+    struct stat st;
+    if (fstat (stats->fd, &st) < 0 || st.st_nlink > 0) break;
+    flock (stats->fd, LOCK_UN);
+    if (bt__stats_reopen (stats) < 0) return NULL;
+  }
+
+  bt_stats_entry_t *entry = z3_map_get (&stats->map, key);
+  if (!entry) {
+    entry = z3_map_put (&stats->map, key);
+    if (entry) {
+      bt__stats_reset_window (entry, 0);
+      bt__stats_reset_window (entry, 1);
+    }
+  }
+
+  if (!entry) flock (stats->fd, LOCK_UN);
+  return entry;
+}
+
+void bt_stats_record (
+    bt_stats_t *stats,
+    const bdaddr_t *adapter,
+    const bdaddr_t *device,
+    int probe,
+    bool found,
+    int8_t rssi,
+    uint64_t latency_us
+) {
+  if (!stats->mem || stats->fd < 0 || probe < 0 || probe >= BT_PROBE_KINDS) return;
+
+  bt_stats_entry_t *entry = bt__stats_lock_entry (stats, adapter, device);
+  if (!entry) return;
+
+  // the older window starts over once the current one is full
+  uint32_t w = atomic_load_explicit (&entry->window, memory_order_relaxed);
+  if (atomic_load_explicit (&entry->window_len, memory_order_relaxed) >= BT_STATS_WINDOW) {
+    w ^= 1;
+    bt__stats_reset_window (entry, w);
+    atomic_store_explicit (&entry->window, w, memory_order_release);
+    atomic_store_explicit (&entry->window_len, 0, memory_order_relaxed);
+  }
+
+  atomic_fetch_add_explicit (&entry->attempts[probe], 1, memory_order_relaxed);
+  atomic_fetch_add_explicit (&entry->window_attempts[w][probe], 1, memory_order_relaxed);
+  if (found) {
+    atomic_fetch_add_explicit (&entry->found[probe], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit (&entry->window_found[w][probe], 1, memory_order_relaxed);
+  }
+
+  if (rssi != BT_STATS_NO_RSSI) {
+    int weak = rssi > 0 ? 0 : -rssi;
+    z3_hist_record ((Z3Hist *)entry->rssi[w], weak > 127 ? 127 : weak);
+  }
+  z3_hist_record ((Z3Hist *)entry->latency[probe][w], latency_us);
+
+  atomic_fetch_add_explicit (&entry->window_len, 1, memory_order_relaxed);
+  atomic_store_explicit (&entry->updated_s, time (NULL), memory_order_relaxed);
+
+  flock (stats->fd, LOCK_UN);
+}
+
+void bt_stats_record_shadow (
+    bt_stats_t *stats,
+    const bdaddr_t *adapter,
+    const bdaddr_t *device,
+    const bool found[2],
+    const uint64_t latency_us[2],
+    bool expired
+) {
+  if (!stats->mem || stats->fd < 0) return;
+
+  bt_stats_entry_t *entry = bt__stats_lock_entry (stats, adapter, device);
+  if (!entry) return;
+
+  // windows are turned by the probes of the same auth
+  uint32_t w = atomic_load_explicit (&entry->window, memory_order_relaxed);
+
+  atomic_fetch_add_explicit (&entry->shadow_runs, 1, memory_order_relaxed);
+  if (found[BT_SHADOW_REAL] == found[BT_SHADOW_CANDIDATE]) {
+    atomic_fetch_add_explicit (&entry->shadow_agreed, 1, memory_order_relaxed);
+  } else if (found[BT_SHADOW_CANDIDATE]) {
+    atomic_fetch_add_explicit (&entry->shadow_candidate_only, 1, memory_order_relaxed);
+  }
+  if (expired) atomic_fetch_add_explicit (&entry->shadow_expired, 1, memory_order_relaxed);
+
+  int64_t delta = (int64_t)(latency_us[BT_SHADOW_CANDIDATE] - latency_us[BT_SHADOW_REAL]);
+  atomic_fetch_add_explicit (&entry->shadow_delta_us, delta, memory_order_relaxed);
+  for (int side = 0; side < 2; side++) {
+    z3_hist_record ((Z3Hist *)entry->shadow_latency[side][w], latency_us[side]);
+  }
+
+  atomic_store_explicit (&entry->updated_s, time (NULL), memory_order_relaxed);
+  flock (stats->fd, LOCK_UN);
+}
+
+void bt_stats_skip_shadow (bt_stats_t *stats, const bdaddr_t *adapter, const bdaddr_t *device) {
+  if (!stats->mem || stats->fd < 0) return;
+
+  bt_stats_entry_t *entry = bt__stats_lock_entry (stats, adapter, device);
+  if (!entry) return;
+
+  atomic_fetch_add_explicit (&entry->shadow_skipped, 1, memory_order_relaxed);
+  atomic_store_explicit (&entry->updated_s, time (NULL), memory_order_relaxed);
+  flock (stats->fd, LOCK_UN);
+}
+
+// Both windows of one histogram merged into `dst`, of the same shape and size
+static const Z3Hist *bt__stats_merge (
+    void *dst, size_t size, uint8_t precision, uint8_t max_bits, const void *w0, const void *w1
+) {
+  Z3Hist *hist = z3_hist_init (dst, size, precision, max_bits);
+  if (!hist) return NULL;
+
+  // a window being reset by a writer may be caught without its header
+  const Z3Hist *src = z3_hist_attach ((void *)w0, size);
+  if (src) z3_hist_merge (hist, src);
+  src = z3_hist_attach ((void *)w1, size);
+  if (src) z3_hist_merge (hist, src);
+  return hist;
+}
+
+static void bt__stats_summarize (const bt_stats_entry_t *entry, bt_stats_summary_t *out) {
+  *out = (bt_stats_summary_t){
+      .updated_s = atomic_load_explicit (&entry->updated_s, memory_order_relaxed)
+  };
+  for (int k = 0; k < BT_PROBE_KINDS; k++) {
+    out->attempts[k] = atomic_load_explicit (&entry->attempts[k], memory_order_relaxed);
+    out->found[k] = atomic_load_explicit (&entry->found[k], memory_order_relaxed);
+    for (int w = 0; w < 2; w++) {
+      out->recent_attempts[k] += atomic_load_explicit (
+          &entry->window_attempts[w][k], memory_order_relaxed
+      );
+      out->recent_found[k] += atomic_load_explicit (
+          &entry->window_found[w][k], memory_order_relaxed
+      );
+    }
+  }
+
+  alignas (8) unsigned char rssi_buf[BT_STATS_RSSI_BYTES];
+  const Z3Hist *rssi = bt__stats_merge (
+      rssi_buf, sizeof (rssi_buf), 6, 7, entry->rssi[0], entry->rssi[1]
+  );
+  if (rssi) {
+    // stored as -dBm, so the weak end is the high percentile
+    out->rssi_samples = atomic_load_explicit (&rssi->total, memory_order_relaxed);
+    out->rssi_p10 = -(int)z3_hist_percentile (rssi, 90);
+    out->rssi_p50 = -(int)z3_hist_percentile (rssi, 50);
+    out->rssi_p90 = -(int)z3_hist_percentile (rssi, 10);
+  }
+
+  alignas (8) unsigned char latency_buf[BT_STATS_LATENCY_BYTES];
+  for (int k = 0; k < BT_PROBE_KINDS; k++) {
+    const Z3Hist *latency = bt__stats_merge (
+        latency_buf, sizeof (latency_buf), 3, 25, entry->latency[k][0], entry->latency[k][1]
+    );
+    if (!latency) continue;
+    out->latency_p50_us[k] = z3_hist_percentile (latency, 50);
+    out->latency_p99_us[k] = z3_hist_percentile (latency, 99);
+  }
+
+  out->shadow_skipped = atomic_load_explicit (&entry->shadow_skipped, memory_order_relaxed);
+  out->shadow_runs = atomic_load_explicit (&entry->shadow_runs, memory_order_relaxed);
+  if (out->shadow_runs == 0) return;
+
+  out->shadow_agreed = atomic_load_explicit (&entry->shadow_agreed, memory_order_relaxed);
+  out->shadow_candidate_only = atomic_load_explicit (
+      &entry->shadow_candidate_only, memory_order_relaxed
+  );
+  out->shadow_expired = atomic_load_explicit (&entry->shadow_expired, memory_order_relaxed);
+  out->shadow_delta_mean_us =
+      atomic_load_explicit (&entry->shadow_delta_us, memory_order_relaxed) /
+      (int64_t)out->shadow_runs;
+
+  for (int side = 0; side < 2; side++) {
+    const Z3Hist *latency = bt__stats_merge (
+        latency_buf, sizeof (latency_buf), 3, 25, entry->shadow_latency[side][0],
+        entry->shadow_latency[side][1]
+    );
+    if (!latency) continue;
+    out->shadow_p50_us[side] = z3_hist_percentile (latency, 50);
+    out->shadow_p99_us[side] = z3_hist_percentile (latency, 99);
+  }
+}
+
+bool bt_stats_summary (
+    const bt_stats_t *stats,
+    const bdaddr_t *adapter,
+    const bdaddr_t *device,
+    bt_stats_summary_t *out
+) {
+  if (!stats->mem) return false;
+
+  uint8_t key[12];
+  bt__stats_key (key, adapter, device);
+
+  const bt_stats_entry_t *entry = z3_map_get (&stats->map, key);
+  if (!entry) return false;
+
+  bt__stats_summarize (entry, out);
+  return true;
+}
+
+bool bt_stats_next (
+    const bt_stats_t *stats, size_t *it, bdaddr_t *adapter, bdaddr_t *device,
+    bt_stats_summary_t *out
+) {
+  const void *key;
+  void *val;
+  if (!stats->mem || !z3_map_next (&stats->map, it, &key, &val)) return false;
+
+  memcpy (adapter->b, key, 6);
+  memcpy (device->b, (const uint8_t *)key + 6, 6);
+  bt__stats_summarize (val, out);
+  return true;
+}
+
+void bt_stats_close (bt_stats_t *stats) {
+  if (stats->mem) munmap (stats->mem, stats->size);
+  if (stats->fd >= 0) close (stats->fd);
+  stats->mem = NULL;
+  stats->fd = -1;
+}
+
+#endif // BT_STATS_IMPL
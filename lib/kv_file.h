@@ -0,0 +1,151 @@
+/**
+ * kv_file.h
+ *
+ * Description:
+ *   Small `key = value` files, as used by pam_bluetooth.conf and the BlueZ
+ *   device info files, read into caller memory and parsed without copies.
+ *
+ * Features:
+ *   - Whole-file read into a fixed buffer, no allocation, larger files refused
+ *   - In-place parser yielding string views, `#` comments and `[section]` lines skipped
+ *
+ * Requires:
+ *   - z3_string.h (StrView)
+ *   - C23 Standard (Use -std=c23).
+ *
+ */
+#pragma once
+
+#ifndef __STDC_VERSION__
+#error A modern C standard (like C23) is required
+#elif __STDC_VERSION__ < 202311L
+#error This code must be compiled with -std=c23
+#endif
+
+#include <stddef.h>
+
+#include "z3_string.h"
+
+//~ Cursor over a `key = value` file loaded in memory
+typedef struct {
+  char *buf;        /**< File contents, with room for one extra byte */
+  int len;          /**< Bytes of file contents */
+  int pos;          /**< Next byte to look at */
+  size_t line;      /**< Line of the last pair returned, or of the error */
+  size_t next_line; /**< Line of `pos` */
+} kv_parser_t;
+
+//~ Reads a whole small file into `buf`, up to `cap` bytes
+//! Returns the length, or -1 with errno set if it could not be opened or read, EFBIG
+//! if it holds more than `cap` bytes
+int kv_read_file (const char *path, char *buf, int cap);
+
+//~ Parser over `len` bytes of `buf`, which must have one spare byte after them
+kv_parser_t kv_parser (char *buf, int len);
+
+//~ Returns 1 if key-value pair found, 0 if end of buffer, -1 on a line without `=`
+//! Both views point into the parser buffer, `value` is also null terminated in place
+int kv_next (kv_parser_t *p, StrView *key, StrView *value);
+
+#ifdef KV_FILE_IMPL
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+int kv_read_file (const char *path, char *buf, int cap) {
+  int file = open (path, O_RDONLY | O_CLOEXEC);
+  if (file == -1) return -1;
+
+  int total = 0;
+  while (total < cap) {
+    ssize_t n = read (file, buf + total, cap - total);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      // keep the errno of the read
+      int saved = errno;
+      close (file);
+      errno = saved;
+      return -1;
+    }
+    if (n == 0) break;
+    total += n;
+  }
+
+  // a cut off file could lose the very line that matters
+  if (total == cap) {
+    char more;
+    ssize_t n;
+    while ((n = read (file, &more, 1)) < 0 && errno == EINTR) continue;
+    if (n != 0) {
+      int saved = n < 0 ? errno : EFBIG;
+      close (file);
+      errno = saved;
+      return -1;
+    }
+  }
+
+  close (file);
+  return total;
+}
+
+kv_parser_t kv_parser (char *buf, int len) {
+  return (kv_parser_t){.buf = buf, .len = len, .pos = 0, .line = 1, .next_line = 1};
+}
+
+int kv_next (kv_parser_t *p, StrView *key, StrView *value) {
+  while (p->pos < p->len) {
+    char c = p->buf[p->pos];
+
+    if (c == ' ' || c == '\t' || c == '\r') {
+      p->pos++;
+      continue;
+    }
+
+    if (c == '\n') {
+      p->pos++;
+      p->next_line++;
+      continue;
+    }
+
+    // comments, and section headers of BlueZ files
+    if (c == '#' || c == '[') {
+      while (p->pos < p->len && p->buf[p->pos] != '\n') p->pos++;
+      continue;
+    }
+
+    p->line = p->next_line;
+
+    // key
+    int start = p->pos;
+    while (p->pos < p->len && p->buf[p->pos] != '=' && p->buf[p->pos] != '\n' &&
+           p->buf[p->pos] != ' ' && p->buf[p->pos] != '\t') {
+      p->pos++;
+    }
+    *key = z3_svl (p->buf + start, p->pos - start);
+
+    // blanks before '='
+    while (p->pos < p->len && (p->buf[p->pos] == ' ' || p->buf[p->pos] == '\t')) p->pos++;
+
+    if (p->pos >= p->len || p->buf[p->pos] != '=') return -1;
+    p->pos++;
+
+    // value, without surrounding blanks and double quotes
+    start = p->pos;
+    while (p->pos < p->len && p->buf[p->pos] != '\n') p->pos++;
+    *value = z3_sv_unquote (z3_sv_trim (z3_svl (p->buf + start, p->pos - start)));
+
+    // newline, consumed before it can be overwritten below
+    if (p->pos < p->len) {
+      p->pos++;
+      p->next_line++;
+    }
+
+    // terminate over a blank, the closing quote, the newline or the spare byte
+    p->buf[value->ptr - p->buf + value->len] = '\0';
+    return 1;
+  }
+
+  return 0;
+}
+
+#endif // KV_FILE_IMPL
@@ -6,10 +6,20 @@
  *
  * Features:
  *   - Growable heap-allocated strings
- *   - String interpolation
+ *   - Short strings (up to 23 bytes) stored inline, without allocating
+ *   - Non-owning string views, with comparison, trimming and number parsing
+ *   - Single allocation concatenation of string views
+ *   - Formatted append into the reserved tail, with printf-free fast paths
+ *   - Pluggable allocators, with a bump-pointer arena
+ *   - String interpolation, with precompiled templates
  *   - String escape/unescape utilities
  *   - Scoped resource cleanup for string memory
  *
+ * Errors:
+ *   Allocation failures never exit the process, the String is released and
+ *   left with `z3_chr (&s) == NULL`. Every later operation on it is a no-op,
+ *   so a sequence of pushes can be checked once at the end.
+ *
  * Requires:
  *   - C23 Standard (Use -std=c23).
  *   - z3_toys.h
@@ -17,55 +27,197 @@
  */
 #pragma once
 
+#include <stdalign.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
-//~ Heap-allocated growable string
+//~ Allocator used by String, `ctx` is passed back on every call
+//! Must return NULL on failure, never exit the process
+typedef struct Z3Allocator {
+  void *(*alloc) (void *ctx, size_t size);
+  void *(*resize) (void *ctx, void *ptr, size_t old_size, size_t new_size);
+  void (*release) (void *ctx, void *ptr, size_t size);
+  void *ctx;
+} Z3Allocator;
+
+//~ Default allocator, backed by malloc/realloc/free
+extern const Z3Allocator z3_heap;
+
+//~ Bump-pointer arena, memory is given back all at once by `z3_arena_reset`
 typedef struct {
-  size_t max; /**< Maximum capacity */
+  Z3Allocator alloc; /**< Pass `&arena.alloc` to the `_in` constructors */
+  char *buf;         /**< Backing memory, owned by the caller */
+  size_t cap;        /**< Size of the backing memory */
+  size_t used;       /**< Bytes handed out since the last reset */
+  size_t last;       /**< Offset of the most recent allocation */
+} Z3Arena;
+
+//~ Inline buffer size of a String, including the null terminator
+#define Z3_SSO_SIZE 24
+
+//~ Growable string, short contents live inline and never allocate
+//! Read `len` and `max` directly, but always get the characters with `z3_chr`
+typedef struct {
+  size_t max; /**< Capacity: 0 if released, `Z3_SSO_SIZE` if inline */
   size_t len; /**< Current length (excluding null terminator) */
-  char *chr;  /**< Pointer to the character array */
+  union {
+    char *ptr;             /**< Allocated characters, when `max > Z3_SSO_SIZE` */
+    char sso[Z3_SSO_SIZE]; /**< Inline characters, when `max == Z3_SSO_SIZE` */
+  };
+  const Z3Allocator *alloc; /**< Allocator owning `ptr`, NULL for `z3_heap` */
 } String;
 
+//~ Non-owning view over `len` characters, not necessarily null terminated
+typedef struct {
+  const char *ptr; /**< First character */
+  size_t len;      /**< Number of characters */
+} StrView;
+
+//~ View over a string literal, without calling strlen
+#define Z3_SV(lit) ((StrView){(lit), sizeof (lit) - 1})
+
+//~ View over a C-style string
+static inline StrView z3_sv (const char *s) {
+  return (StrView){s, s ? strlen (s) : 0};
+}
+
+//~ View over the first `len` characters of `s`
+static inline StrView z3_svl (const char *s, size_t len) {
+  return (StrView){s, len};
+}
+
+//~ Whether two views hold the same characters
+bool z3_sv_eq (StrView a, StrView b);
+
+//~ Whether `v` starts with `prefix`
+bool z3_sv_starts (StrView v, StrView prefix);
+
+//~ View without leading and trailing blanks (space, tab, CR)
+StrView z3_sv_trim (StrView v);
+
+//~ View without one pair of surrounding double quotes, if present
+StrView z3_sv_unquote (StrView v);
+
+//~ Parse the whole view as a decimal integer, with an optional sign
+//! False on empty input, trailing characters or overflow, `out` is left untouched
+bool z3_sv_to_long (StrView v, long *out);
+
+//~ Character array of a String, NULL if it was released or failed to allocate
+static inline char *z3_chr (const String *str) {
+  if (str->max == 0) return NULL;
+  return str->max > Z3_SSO_SIZE ? str->ptr : (char *)str->sso;
+}
+
+//~ Whether the String contents are stored inline
+static inline bool z3_is_inline (const String *str) {
+  return str->max == Z3_SSO_SIZE;
+}
+
 //~ Print debug information about a string
-#define z3_str_dbg(s)                                                                         \
-  printf (                                                                                    \
-      #s " = String {\n  len: %zu,\n  max: %zu,\n  chr: '%s'\n}\n", (s).len, (s).max, (s).chr \
+#define z3_str_dbg(s)                                                                 \
+  printf (                                                                            \
+      #s " = String {\n  len: %zu,\n  max: %zu,\n  chr: '%s'\n}\n", (s).len, (s).max, \
+      z3_chr (&(s))                                                                   \
   );
 
+//~ Set up an arena over caller-provided memory
+void z3_arena_init (Z3Arena *arena, void *buf, size_t cap);
+
+//~ Give back every allocation made from the arena
+//! Strings still pointing into it must not be used afterwards
+void z3_arena_reset (Z3Arena *arena);
+
 //~ Create a new empty String, with at least `min` capacity
 String z3_str (size_t min);
 
+//~ Create a new empty String from `alloc`, with at least `min` capacity
+String z3_str_in (const Z3Allocator *alloc, size_t min);
+
 //~ Create a new String from a C-style string
 //! This does look for `\0` terminator
 String z3_strcpy (const char *s);
 
-//~ Create a duplicate of an existing String
+//~ Create a new String from a C-style string, using `alloc`
+String z3_strcpy_in (const Z3Allocator *alloc, const char *s);
+
+//~ Create a duplicate of an existing String, using the same allocator
 String z3_strdup (const String *str);
 
-//~ Append a single char to a String
-void z3_pushc (String *str, const char s);
+//~ Append a single char to a String, false if memory could not be allocated
+bool z3_pushc (String *str, const char s);
 
-//~ Append a C-style string to a String
-void z3_pushl (String *str, const char *s, size_t l);
+//~ Append a C-style string to a String, false if memory could not be allocated
+bool z3_pushl (String *str, const char *s, size_t l);
 
 //~ Ensure String is null terminated
 void z3_ensure0 (String *str);
 
-//~ Ensure String has enough allocated memory
-void z3_reserve (String *str, size_t additional);
+//~ Ensure String has enough allocated memory, growing to the next power of 2
+//! On failure the String is released and false is returned
+bool z3_reserve (String *str, size_t additional);
+
+//~ Ensure String has enough allocated memory, growing to exactly what is needed
+//! On failure the String is released and false is returned
+bool z3_reserve_exact (String *str, size_t additional);
+
+//~ Release unused capacity, moving the contents inline when they fit
+//! On failure the String is left untouched and false is returned
+bool z3_shrink_to_fit (String *str);
+
+//~ Concatenate `count` views into a new String from `alloc`, allocating once
+String z3_concat_in (const Z3Allocator *alloc, const StrView *parts, size_t count);
+
+//~ Concatenate views into a new String from `alloc`, allocating once
+//
+//~ Example: `z3_concat (NULL, Z3_SV ("/var/lib/"), z3_sv (dir), Z3_SV ("/info"))`
+#define z3_concat(alloc, ...)                                    \
+  z3_concat_in (                                                 \
+      (alloc), (const StrView[]){__VA_ARGS__},                   \
+      sizeof ((const StrView[]){__VA_ARGS__}) / sizeof (StrView) \
+  )
+
+//~ Append printf-style formatted text, into the tail or through a 256-byte stack buffer
+//! Allocates at most once and formats twice only past 256 bytes, false if formatting or
+//! allocation failed
+bool z3_pushf (String *str, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+//~ Append an unsigned integer in decimal, without printf
+bool z3_pushu (String *str, uint64_t value);
+
+//~ Append a signed integer in decimal, without printf
+bool z3_pushi (String *str, int64_t value);
+
+//~ Append lowercase hex digits, zero padded to at least `width`, without printf
+bool z3_pushx (String *str, uint64_t value, int width);
+
+//~ Append a signal strength as `<value> dBm`, without printf
+bool z3_pushdbm (String *str, int rssi);
+
+//~ Append a bdaddr (BlueZ byte order) as `XX:XX:XX:XX:XX:XX`, without printf
+bool z3_pushba (String *str, const uint8_t addr[6]);
 
 //~ Free the memory used by a String
 void z3_drops (String *str);
 
 //~ Escape a string, converting control characters to escape sequences
+//! Reads `input` a word at a time, `len` must not exceed the readable bytes
 String z3_escape (const char *input, size_t len);
 
+//~ Same as `z3_escape`, result is allocated from `alloc`
+String z3_escape_in (const Z3Allocator *alloc, const char *input, size_t len);
+
 //~ Unescape a string, converting escape sequences to their respective characters
+//! Reads `input` a word at a time, `len` must not exceed the readable bytes
+//! `\x` takes one or two hex digits; without one, or with a backslash ending the
+//! input, the text is kept as is. Earlier versions read past `len` on these instead.
 String z3_unescape (const char *input, size_t len);
 
+//~ Same as `z3_unescape`, result is allocated from `alloc`
+String z3_unescape_in (const Z3Allocator *alloc, const char *input, size_t len);
+
 //~ Interpolate a template string by replacing placeholders with values
 //
 //~ This function takes ctx and a template string containing placeholders in the format
@@ -74,111 +226,493 @@ String z3_unescape (const char *input, size_t len);
 //  takes the placeholder's ID (as a string) ~ and returns the replacement string.
 //
 //~ Note: The original template string is not modified. A new `String` is created with the
-//  interpolated values.
+//  interpolated values, using the allocator of the template.
 String z3_interp (
     const String *templt, bool (*filler) (String *, void *, char *, size_t), void *ctx
 );
 
+//~ Kind of a compiled template operation
+typedef enum {
+  Z3_TMPL_LIT, /**< Literal bytes, copied as is */
+  Z3_TMPL_ID,  /**< `#{id}` placeholder, given to the filler */
+} Z3TmplKind;
+
+//~ Compiled template operation, `off`/`len` index the template pool
+typedef struct {
+  uint32_t off;    /**< Start of the literal, or of the placeholder ID */
+  uint32_t len;    /**< Length of the literal, or of the placeholder ID */
+  uint32_t hash;   /**< `z3_fnv1a` of the placeholder ID, 0 for literals */
+  Z3TmplKind kind; /**< What this operation renders */
+} Z3TmplOp;
+
+//~ Template compiled once by `z3_tmpl_compile`, rendered many times
+typedef struct {
+  String pool;   /**< Literal bytes, and placeholders as `#{id}` */
+  Z3TmplOp *ops; /**< Operations in render order, NULL if compiling failed */
+  size_t count;  /**< Number of operations */
+  size_t lits;   /**< Literal bytes produced by one render */
+} Z3Template;
+
+//~ Placeholder filler for compiled templates, `hash` is `z3_fnv1a (id, len)`
+//! Return false to keep the placeholder text as is, same as `z3_interp`
+typedef bool (*Z3TmplFiller) (
+    String *out, void *ctx, const char *id, size_t len, uint32_t hash
+);
+
+//~ Compile a template for `z3_tmpl_render`, using the allocator of the template
+//! Output of rendering matches `z3_interp` on the same template and filler
+Z3Template z3_tmpl_compile (const String *templt);
+
+//~ Render a compiled template into a new String
+String z3_tmpl_render (const Z3Template *tmpl, Z3TmplFiller filler, void *ctx);
+
+//~ Free the memory used by a compiled template
+void z3_tmpl_drop (Z3Template *tmpl);
+
 #ifdef Z3_TOYS_SCOPED
 //~ Cleanup function for String (used with attribute cleanup)
 void __cleanup_String (String *s);
 
 //~ Define a String with automatic cleanup
 #define ScopedString __attribute__ ((cleanup (z3_drops))) String
+
+//~ Define a compiled template with automatic cleanup
+#define ScopedTemplate __attribute__ ((cleanup (z3_tmpl_drop))) Z3Template
 #endif  // Z3_TOYS_SCOPED
 
 #ifdef Z3_STRING_IMPL
 #include <ctype.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
 #include "z3_toys.h"
 
-void z3_reserve (String *str, size_t additional) {
-  if (!str || !str->chr) return;
+static void *z3__heap_alloc (void *ctx, size_t size) {
+  (void)ctx;
+  return malloc (size);
+}
+
+static void *z3__heap_resize (void *ctx, void *ptr, size_t old_size, size_t new_size) {
+  (void)ctx, (void)old_size;
+  return realloc (ptr, new_size);
+}
 
-  if (str->len + additional + 1 > str->max) {
-    while (str->max < str->len + additional + 1) {
-      str->max *= 2;
-    }
+static void z3__heap_release (void *ctx, void *ptr, size_t size) {
+  (void)ctx, (void)size;
+  free (ptr);
+}
+
+const Z3Allocator z3_heap = {
+    .alloc = z3__heap_alloc,
+    .resize = z3__heap_resize,
+    .release = z3__heap_release,
+    .ctx = NULL,
+};
+
+static void *z3__arena_alloc (void *ctx, size_t size) {
+  Z3Arena *arena = ctx;
+  uintptr_t base = (uintptr_t)arena->buf;
+  uintptr_t align = alignof (max_align_t);
+  size_t start = ((base + arena->used + align - 1) & ~(align - 1)) - base;
+
+  if (start > arena->cap || size > arena->cap - start) return NULL;
+
+  arena->last = start;
+  arena->used = start + size;
+  return arena->buf + start;
+}
 
-    str->chr = realloc (str->chr, str->max);
-    if (str->chr == NULL) {
-      eprintf ("String realloc: requested %zu bytes\n", str->max);
-      exit (EXIT_FAILURE);
+static void *z3__arena_resize (void *ctx, void *ptr, size_t old_size, size_t new_size) {
+  Z3Arena *arena = ctx;
+  if (!ptr) return z3__arena_alloc (ctx, new_size);
+
+  // the most recent allocation grows in place
+  if ((char *)ptr == arena->buf + arena->last) {
+    if (new_size > arena->cap - arena->last) return NULL;
+    arena->used = arena->last + new_size;
+    return ptr;
+  }
+
+  // anything else cannot give memory back, moving it would only waste more
+  if (new_size <= old_size) return ptr;
+
+  void *moved = z3__arena_alloc (ctx, new_size);
+  if (moved) memcpy (moved, ptr, old_size < new_size ? old_size : new_size);
+  return moved;
+}
+
+static void z3__arena_release (void *ctx, void *ptr, size_t size) {
+  Z3Arena *arena = ctx;
+  (void)size;
+
+  // only the top of the arena can be given back early
+  if ((char *)ptr == arena->buf + arena->last) arena->used = arena->last;
+}
+
+void z3_arena_init (Z3Arena *arena, void *buf, size_t cap) {
+  arena->alloc = (Z3Allocator){
+      .alloc = z3__arena_alloc,
+      .resize = z3__arena_resize,
+      .release = z3__arena_release,
+      .ctx = arena,
+  };
+  arena->buf = buf;
+  arena->cap = cap;
+  arena->used = 0;
+  arena->last = 0;
+}
+
+void z3_arena_reset (Z3Arena *arena) {
+  arena->used = 0;
+  arena->last = 0;
+}
+
+static inline const Z3Allocator *z3__allocator (const String *str) {
+  return str->alloc ? str->alloc : &z3_heap;
+}
+
+bool z3_sv_eq (StrView a, StrView b) {
+  return a.len == b.len && (a.len == 0 || memcmp (a.ptr, b.ptr, a.len) == 0);
+}
+
+bool z3_sv_starts (StrView v, StrView prefix) {
+  if (v.len < prefix.len) return false;
+  return prefix.len == 0 || memcmp (v.ptr, prefix.ptr, prefix.len) == 0;
+}
+
+static inline bool z3__is_blank (char c) {
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+StrView z3_sv_trim (StrView v) {
+  while (v.len > 0 && z3__is_blank (v.ptr[0])) v.ptr++, v.len--;
+  while (v.len > 0 && z3__is_blank (v.ptr[v.len - 1])) v.len--;
+  return v;
+}
+
+StrView z3_sv_unquote (StrView v) {
+  if (v.len >= 2 && v.ptr[0] == '"' && v.ptr[v.len - 1] == '"') {
+    v.ptr++;
+    v.len -= 2;
+  }
+  return v;
+}
+
+bool z3_sv_to_long (StrView v, long *out) {
+  size_t i = 0;
+  bool negative = false;
+  if (v.len > 0 && (v.ptr[0] == '-' || v.ptr[0] == '+')) {
+    negative = v.ptr[0] == '-';
+    i++;
+  }
+  if (i == v.len) return false;
+
+  // accumulate as negative, it has the larger range
+  long n = 0;
+  for (; i < v.len; i++) {
+    if (v.ptr[i] < '0' || v.ptr[i] > '9') return false;
+    int digit = v.ptr[i] - '0';
+    if (n < (LONG_MIN + digit) / 10) return false;
+    n = n * 10 - digit;
+  }
+
+  if (!negative) {
+    if (n == LONG_MIN) return false;
+    n = -n;
+  }
+  *out = n;
+  return true;
+}
+
+// Move the contents to storage of exactly `max` bytes, inline when it fits
+static bool z3__regrow (String *str, size_t max) {
+  const Z3Allocator *alloc = z3__allocator (str);
+
+  if (max <= Z3_SSO_SIZE) {
+    if (z3_is_inline (str)) return true;
+
+    // `sso` overlaps `ptr`, keep the pointer around to release it
+    char *heap = str->ptr;
+    size_t old_max = str->max;
+    memcpy (str->sso, heap, str->len + 1);
+    str->max = Z3_SSO_SIZE;
+    alloc->release (alloc->ctx, heap, old_max);
+    return true;
+  }
+
+  char *chr;
+  if (z3_is_inline (str)) {
+    // spill inline contents to the allocator
+    chr = alloc->alloc (alloc->ctx, max);
+    if (chr) memcpy (chr, str->sso, str->len + 1);
+  } else {
+    chr = alloc->resize (alloc->ctx, str->ptr, str->max, max);
+  }
+  if (chr == NULL) return false;
+
+  str->ptr = chr;
+  str->max = max;
+  return true;
+}
+
+// Bytes needed to hold `additional` more characters, 0 on overflow
+static inline size_t z3__needed (const String *str, size_t additional) {
+  if (additional > SIZE_MAX - str->len - 1) return 0;
+  return str->len + additional + 1;
+}
+
+bool z3_reserve (String *str, size_t additional) {
+  if (!str || str->max == 0) return false;
+
+  size_t need = z3__needed (str, additional);
+  if (need != 0 && need <= str->max) return true;
+
+  // past the largest power of 2, grow to exactly what is needed
+  size_t max = next_power_of2 (need);
+  if (need == 0 || !z3__regrow (str, max ? max : need)) {
+    z3_drops (str);
+    return false;
+  }
+
+  return true;
+}
+
+bool z3_reserve_exact (String *str, size_t additional) {
+  if (!str || str->max == 0) return false;
+
+  size_t need = z3__needed (str, additional);
+  if (need != 0 && need <= str->max) return true;
+
+  if (need == 0 || !z3__regrow (str, need)) {
+    z3_drops (str);
+    return false;
+  }
+
+  return true;
+}
+
+bool z3_shrink_to_fit (String *str) {
+  if (!str || str->max == 0) return false;
+  if (z3_is_inline (str) || str->len + 1 == str->max) return true;
+
+  return z3__regrow (str, str->len + 1);
+}
+
+String z3_concat_in (const Z3Allocator *alloc, const StrView *parts, size_t count) {
+  String str = {.max = Z3_SSO_SIZE, .alloc = alloc};
+  str.sso[0] = '\0';
+
+  size_t total = 0;
+  for (size_t i = 0; i < count; i++) {
+    if (parts[i].len > SIZE_MAX - total) {
+      z3_drops (&str);
+      return str;
     }
+    total += parts[i].len;
+  }
+
+  if (!z3_reserve_exact (&str, total)) return str;
+
+  char *chr = z3_chr (&str);
+  for (size_t i = 0; i < count; i++) {
+    if (parts[i].len == 0) continue;
+    memcpy (chr + str.len, parts[i].ptr, parts[i].len);
+    str.len += parts[i].len;
   }
+  chr[str.len] = '\0';
+
+  return str;
 }
 
 void z3_ensure0 (String *str) {
-  if (!str || !str->chr) return;
+  char *chr = str ? z3_chr (str) : NULL;
+  if (!chr) return;
 
-  if (str->chr[str->len] == '\0') return;
-  str->chr[str->len] = '\0';
+  if (chr[str->len] == '\0') return;
+  chr[str->len] = '\0';
 }
 
-void z3_pushc (String *str, char c) {
-  if (!str || !str->chr) return;
+bool z3_pushc (String *str, char c) {
+  if (!z3_reserve (str, 1)) return false;
 
-  z3_reserve (str, 1);
-  str->chr[str->len] = c;
+  char *chr = z3_chr (str);
+  chr[str->len] = c;
   str->len++;
-  str->chr[str->len] = '\0';
+  chr[str->len] = '\0';
+  return true;
 }
 
-void z3_pushl (String *str, const char *s, size_t l) {
-  if (!str || !str->chr || !s || l == 0) return;
+bool z3_pushl (String *str, const char *s, size_t l) {
+  if (!str || str->max == 0) return false;
+  if (!s || l == 0) return true;
 
-  z3_reserve (str, l);
-  memcpy (str->chr + str->len, s, l);
+  if (!z3_reserve (str, l)) return false;
+
+  char *chr = z3_chr (str);
+  memcpy (chr + str->len, s, l);
   str->len += l;
-  str->chr[str->len] = '\0';
+  chr[str->len] = '\0';
+  return true;
 }
 
-String z3_str (size_t min) {
+String z3_str_in (const Z3Allocator *alloc, size_t min) {
   String str = {0};
-  str.max = next_power_of2 (min);  // Initial capacity
+  str.alloc = alloc;
   str.len = 0;
-  str.chr = malloc (str.max);
-  if (str.chr) {
-    str.chr[0] = '\0';
+
+  size_t max = next_power_of2 (min);  // Initial capacity
+  if (max == 0) return str;
+  if (max <= Z3_SSO_SIZE) {
+    str.max = Z3_SSO_SIZE;
+    str.sso[0] = '\0';
+    return str;
+  }
+
+  alloc = z3__allocator (&str);
+  str.ptr = alloc->alloc (alloc->ctx, max);
+  if (str.ptr) {
+    str.ptr[0] = '\0';
+    str.max = max;
   }
   return str;
 }
 
-String z3_strcpy (const char *s) {
-  String str = {0};
-  size_t len = strlen (s) + 1;
-  str.max = ((len & (len - 1)) == 0) ? len : next_power_of2 (len);
-  str.len = len - 1;
-  str.chr = malloc (str.max);
-  if (str.chr == NULL) {
-    fprintf (stderr, "failed to allocate memory for string\n");
-    exit (EXIT_FAILURE);
-  }
-  strcpy (str.chr, s);
-  str.chr[str.len] = '\0';
+String z3_str (size_t min) {
+  return z3_str_in (NULL, min);
+}
+
+String z3_strcpy_in (const Z3Allocator *alloc, const char *s) {
+  size_t len = strlen (s);
+  String str = z3_str_in (alloc, len + 1);
+  z3_pushl (&str, s, len);
   return str;
 }
 
+String z3_strcpy (const char *s) {
+  return z3_strcpy_in (NULL, s);
+}
+
 String z3_strdup (const String *str) {
   String s = {0};
-  if (!str || !str->chr) return s;
+  if (!str || str->max == 0) return s;
+
+  s = z3_str_in (str->alloc, str->len + 1);
+  z3_pushl (&s, z3_chr (str), str->len);
+  return s;
+}
+
+bool z3_pushf (String *str, const char *fmt, ...) {
+  if (!str || str->max == 0) return false;
+
+  va_list args, retry;
+  va_start (args, fmt);
+  va_copy (retry, args);
 
-  s.max = str->max;
-  s.len = str->len;
-  s.chr = malloc (s.max);
+  // into the tail when it has the room of a log line, else on the stack first, so a short
+  // string grows once to the length formatted instead of formatting again
+  char buf[256];
+  size_t room = str->max - str->len;
+  bool direct = room >= sizeof (buf);
+  size_t size = direct ? room : sizeof (buf);
+  int n = vsnprintf (direct ? z3_chr (str) + str->len : buf, size, fmt, args);
+  va_end (args);
 
-  if (s.chr) {
-    memcpy (s.chr, str->chr, str->len);
-    s.chr[s.len] = '\0';
+  bool ok = n >= 0;
+  if (ok && (size_t)n >= size) {
+    // longer than both, grow once and format again
+    ok = z3_reserve (str, n);
+    if (ok) vsnprintf (z3_chr (str) + str->len, (size_t)n + 1, fmt, retry);
+  } else if (ok && !direct) {
+    ok = z3_reserve (str, n);
+    if (ok) memcpy (z3_chr (str) + str->len, buf, (size_t)n + 1);
   }
+  va_end (retry);
 
-  return s;
+  if (!ok) {
+    // a failed attempt may have written over the terminator
+    z3_ensure0 (str);
+    return false;
+  }
+
+  str->len += n;
+  return true;
+}
+
+// Two decimal digits of every value below 100
+static const char z3__digits2[200 + 1] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+// Write `value` in decimal ending right before `end`, returns the first digit
+static char *z3__utoa (char *end, uint64_t value) {
+  while (value >= 100) {
+    const char *pair = &z3__digits2[(value % 100) * 2];
+    value /= 100;
+    *--end = pair[1];
+    *--end = pair[0];
+  }
+  if (value >= 10) {
+    const char *pair = &z3__digits2[value * 2];
+    *--end = pair[1];
+    *--end = pair[0];
+  } else {
+    *--end = '0' + value;
+  }
+  return end;
+}
+
+bool z3_pushu (String *str, uint64_t value) {
+  char buf[20];
+  char *start = z3__utoa (buf + sizeof (buf), value);
+  return z3_pushl (str, start, buf + sizeof (buf) - start);
+}
+
+bool z3_pushi (String *str, int64_t value) {
+  char buf[21];
+  // negate as unsigned, INT64_MIN has no positive counterpart
+  uint64_t magnitude = value < 0 ? -(uint64_t)value : (uint64_t)value;
+  char *start = z3__utoa (buf + sizeof (buf), magnitude);
+  if (value < 0) *--start = '-';
+  return z3_pushl (str, start, buf + sizeof (buf) - start);
+}
+
+bool z3_pushx (String *str, uint64_t value, int width) {
+  static const char hex_digits[] = "0123456789abcdef";
+  char buf[16];
+  char *start = buf + sizeof (buf);
+
+  if (width > 16) width = 16;
+  do {
+    *--start = hex_digits[value & 0xF];
+    value >>= 4;
+  } while (value);
+  while (buf + sizeof (buf) - start < width) *--start = '0';
+
+  return z3_pushl (str, start, buf + sizeof (buf) - start);
+}
+
+bool z3_pushdbm (String *str, int rssi) {
+  return z3_pushi (str, rssi) && z3_pushl (str, " dBm", 4);
+}
+
+bool z3_pushba (String *str, const uint8_t addr[6]) {
+  if (!z3_reserve (str, Z3_BDADDR_STRLEN)) return false;
+
+  // formats straight into the tail, terminator included
+  z3_bdaddr_format (addr, z3_chr (str) + str->len);
+  str->len += Z3_BDADDR_STRLEN;
+  return true;
 }
 
 void z3_drops (String *str) {
-  if (!str || !str->chr) return;
+  if (!str || str->max == 0) return;
 
-  free (str->chr);
-  str->chr = NULL;
+  if (!z3_is_inline (str)) {
+    const Z3Allocator *alloc = z3__allocator (str);
+    alloc->release (alloc->ctx, str->ptr, str->max);
+  }
+  str->ptr = NULL;
   str->len = 0;
   str->max = 0;
 }
@@ -186,18 +720,19 @@ void z3_drops (String *str) {
 String z3_interp (
     const String *tmplt, bool (*filler) (String *, void *, char *, size_t), void *ctx
 ) {
-  String result = z3_str (32);
+  String result = z3_str_in (tmplt->alloc, 32);
+  const char *chr = z3_chr (tmplt);
 
   size_t i = 0;
 
   while (i < tmplt->len) {
-    if (tmplt->chr[i] == '\\') {
-      z3_pushc (&result, (i++, tmplt->chr[i++]));
+    if (chr[i] == '\\') {
+      z3_pushc (&result, (i++, chr[i++]));
       continue;
     }
 
-    if (!(i + 1 < tmplt->len && tmplt->chr[i] == '#' && tmplt->chr[i + 1] == '{')) {
-      z3_pushc (&result, tmplt->chr[i]);
+    if (!(i + 1 < tmplt->len && chr[i] == '#' && chr[i + 1] == '{')) {
+      z3_pushc (&result, chr[i]);
       i++;
       continue;
     }
@@ -206,30 +741,24 @@ String z3_interp (
     size_t path_end = path_start;
 
     // Find the closing '}'
-    while (path_end < tmplt->len && tmplt->chr[path_end] != '}') {
-      if (!(isalnum (tmplt->chr[path_end]) || tmplt->chr[path_end] == '_' ||
-            tmplt->chr[path_end] == '-'))
+    while (path_end < tmplt->len && chr[path_end] != '}') {
+      if (!(isalnum (chr[path_end]) || chr[path_end] == '_' ||
+            chr[path_end] == '-'))
         break;
       path_end++;
     }
-    if (tmplt->chr[path_end] != '}' || path_end >= tmplt->len) {
+    if (chr[path_end] != '}' || path_end >= tmplt->len) {
       // No closing '}' found, treat as literal text
       size_t path_len = path_end - path_start + 2;
-      char *path = malloc (path_len + 1);
-      if (path) {
-        memcpy (path, tmplt->chr + path_start - 2, path_len);
-        path[path_len] = '\0';
-        z3_pushl (&result, path, path_len);
-        free (path);
-      }
+      z3_pushl (&result, chr + path_start - 2, path_len);
       i += path_len;
       continue;
     }
     size_t path_len = path_end - path_start;
-    char *path = (char *)(tmplt->chr + path_start);
+    char *path = (char *)(chr + path_start);
 
     if (!filler (&result, ctx, path, path_len)) {
-      z3_pushl (&result, tmplt->chr + i, path_len + 3);  // push entire #{...}
+      z3_pushl (&result, chr + i, path_len + 3);  // push entire #{...}
     }
 
     // Move past the closing '}'
@@ -239,153 +768,312 @@ String z3_interp (
   return result;
 }
 
+typedef struct {
+  Z3Template *tmpl; /**< Destination, NULL while only measuring */
+  char *pool;       /**< Pool characters, when emitting */
+  size_t ops;       /**< Operations seen so far */
+  size_t used;      /**< Pool bytes seen so far */
+  size_t lits;      /**< Literal bytes seen so far */
+  bool lit_open;    /**< Last operation is a literal that can be extended */
+} z3__TmplScan;
+
+static void z3__tmpl_lit (z3__TmplScan *sc, const char *s, size_t l) {
+  if (l == 0) return;
+
+  if (!sc->lit_open) {
+    if (sc->tmpl) {
+      sc->tmpl->ops[sc->ops] = (Z3TmplOp){.off = sc->used, .len = 0, .kind = Z3_TMPL_LIT};
+    }
+    sc->ops++;
+    sc->lit_open = true;
+  }
+
+  if (sc->tmpl) {
+    memcpy (sc->pool + sc->used, s, l);
+    sc->tmpl->ops[sc->ops - 1].len += l;
+  }
+  sc->used += l;
+  sc->lits += l;
+}
+
+// `raw` points at the whole `#{id}` text
+static void z3__tmpl_id (z3__TmplScan *sc, const char *raw, size_t id_len) {
+  if (sc->tmpl) {
+    memcpy (sc->pool + sc->used, raw, id_len + 3);
+    sc->tmpl->ops[sc->ops] = (Z3TmplOp){
+        .off = sc->used + 2,
+        .len = id_len,
+        .hash = z3_fnv1a (raw + 2, id_len),
+        .kind = Z3_TMPL_ID,
+    };
+  }
+  sc->ops++;
+  sc->used += id_len + 3;
+  sc->lit_open = false;
+}
+
+// Same walk as `z3_interp`, emitting operations instead of output
+static void z3__tmpl_scan (const String *tmplt, z3__TmplScan *sc) {
+  const char *chr = z3_chr (tmplt);
+  size_t i = 0;
+
+  while (i < tmplt->len) {
+    if (chr[i] == '\\') {
+      z3__tmpl_lit (sc, chr + i + 1, 1);
+      i += 2;
+      continue;
+    }
+
+    if (!(i + 1 < tmplt->len && chr[i] == '#' && chr[i + 1] == '{')) {
+      z3__tmpl_lit (sc, chr + i, 1);
+      i++;
+      continue;
+    }
+
+    size_t path_start = i + 2;  // Skip "#{"
+    size_t path_end = path_start;
+
+    while (path_end < tmplt->len && chr[path_end] != '}') {
+      if (!(isalnum (chr[path_end]) || chr[path_end] == '_' || chr[path_end] == '-')) break;
+      path_end++;
+    }
+    if (chr[path_end] != '}' || path_end >= tmplt->len) {
+      // No closing '}' found, treat as literal text
+      size_t path_len = path_end - path_start + 2;
+      z3__tmpl_lit (sc, chr + i, path_len);
+      i += path_len;
+      continue;
+    }
+
+    z3__tmpl_id (sc, chr + i, path_end - path_start);
+    i = path_end + 1;
+  }
+}
+
+Z3Template z3_tmpl_compile (const String *templt) {
+  Z3Template tmpl = {0};
+  if (!templt || templt->max == 0 || templt->len >= UINT32_MAX) return tmpl;
+
+  // first pass only measures, so everything is allocated exactly once
+  z3__TmplScan sc = {0};
+  z3__tmpl_scan (templt, &sc);
+
+  const Z3Allocator *alloc = z3__allocator (templt);
+  tmpl.pool = z3_str_in (templt->alloc, sc.used + 1);
+  tmpl.ops = alloc->alloc (alloc->ctx, (sc.ops ? sc.ops : 1) * sizeof (Z3TmplOp));
+  tmpl.count = sc.ops;
+  if (!tmpl.ops || !z3_chr (&tmpl.pool)) {
+    z3_tmpl_drop (&tmpl);
+    return tmpl;
+  }
+
+  sc = (z3__TmplScan){.tmpl = &tmpl, .pool = z3_chr (&tmpl.pool)};
+  z3__tmpl_scan (templt, &sc);
+
+  tmpl.pool.len = sc.used;
+  z3_chr (&tmpl.pool)[sc.used] = '\0';
+  tmpl.lits = sc.lits;
+  return tmpl;
+}
+
+String z3_tmpl_render (const Z3Template *tmpl, Z3TmplFiller filler, void *ctx) {
+  String result = {0};
+  if (!tmpl || !tmpl->ops) return result;
+
+  result = z3_str_in (tmpl->pool.alloc, tmpl->lits + 1);
+  const char *pool = z3_chr (&tmpl->pool);
+
+  for (size_t i = 0; i < tmpl->count; i++) {
+    const Z3TmplOp *op = &tmpl->ops[i];
+    if (op->kind == Z3_TMPL_LIT) {
+      z3_pushl (&result, pool + op->off, op->len);
+    } else if (!filler (&result, ctx, pool + op->off, op->len, op->hash)) {
+      z3_pushl (&result, pool + op->off - 2, op->len + 3);  // push entire #{...}
+    }
+  }
+
+  return result;
+}
+
+void z3_tmpl_drop (Z3Template *tmpl) {
+  if (!tmpl) return;
+
+  if (tmpl->ops) {
+    const Z3Allocator *alloc = z3__allocator (&tmpl->pool);
+    alloc->release (alloc->ctx, tmpl->ops, (tmpl->count ? tmpl->count : 1) * sizeof (Z3TmplOp));
+  }
+  z3_drops (&tmpl->pool);
+  tmpl->ops = NULL;
+  tmpl->count = 0;
+  tmpl->lits = 0;
+}
+
+#define Z3__ONES  0x0101010101010101ULL
+#define Z3__HIGHS 0x8080808080808080ULL
+
+// Non-zero if any byte of `w` is lower than `n` (n <= 128)
+static inline uint64_t z3__has_less (uint64_t w, unsigned char n) {
+  return (w - Z3__ONES * n) & ~w & Z3__HIGHS;
+}
+
+// Non-zero if any byte of `w` equals `b`
+static inline uint64_t z3__has_byte (uint64_t w, unsigned char b) {
+  return z3__has_less (w ^ (Z3__ONES * b), 1);
+}
+
+// Whether any of the 8 bytes at `p` must be escaped (or ends the input)
+static inline bool z3__escapable8 (const char *p) {
+  uint64_t w;
+  memcpy (&w, p, sizeof (w));
+  return (z3__has_less (w, 0x20) | (w & Z3__HIGHS) | z3__has_byte (w, 0x7F) |
+          z3__has_byte (w, '\\') | z3__has_byte (w, '"') | z3__has_byte (w, '\'')) != 0;
+}
+
+// Whether any of the 8 bytes at `p` starts an escape (or ends the input)
+static inline bool z3__unescapable8 (const char *p) {
+  uint64_t w;
+  memcpy (&w, p, sizeof (w));
+  return (z3__has_less (w, 1) | z3__has_byte (w, '\\')) != 0;
+}
+
 String z3_escape (const char *input, size_t len) {
-  char hex_digits[] = "0123456789abcdef";
-  String s = z3_str (32);
-  size_t l = 0;
+  return z3_escape_in (NULL, input, len);
+}
+
+String z3_escape_in (const Z3Allocator *alloc, const char *input, size_t len) {
+  static const char hex_digits[] = "0123456789abcdef";
+  String s = {0};
+  if (len > (SIZE_MAX - 1) / 4) return s;
+
+  // worst case is every byte turning into `\xNN`
+  s = z3_str_in (alloc, len * 4 + 1);
+  char *out = z3_chr (&s);
+  if (!out) return s;
+
+  size_t n = 0, l = 0;
 
   // loop until `\0`, or until length
-  while (l < len && *input) {
-    unsigned char c = *input;
+  while (l < len) {
+    // printable runs are copied a word at a time
+    while (len - l >= 8 && !z3__escapable8 (input + l)) {
+      memcpy (out + n, input + l, 8);
+      n += 8;
+      l += 8;
+    }
+    if (l >= len) break;
+
+    unsigned char c = input[l++];
     switch (c) {
-      case '\a':
-        z3_pushl (&s, "\\a", 2);
-        break;  // Bell
-      case '\b':
-        z3_pushl (&s, "\\b", 2);
-        break;  // Backspace
-      case '\f':
-        z3_pushl (&s, "\\f", 2);
-        break;  // Formfeed
-      case '\n':
-        z3_pushl (&s, "\\n", 2);
-        break;
-      case '\r':
-        z3_pushl (&s, "\\r", 2);
-        break;
-      case '\t':
-        z3_pushl (&s, "\\t", 2);
-        break;
-      case '\v':
-        z3_pushl (&s, "\\v", 2);
-        break;  // Vertical tab
-      case '\\':
-        z3_pushl (&s, "\\\\", 2);
-        break;
-      case '\"':
-        z3_pushl (&s, "\\\"", 2);
-        break;
-      case '\'':
-        z3_pushl (&s, "\\\'", 2);
-        break;
+      case '\0': l = len; break;
+      case '\a': out[n++] = '\\', out[n++] = 'a'; break;  // Bell
+      case '\b': out[n++] = '\\', out[n++] = 'b'; break;  // Backspace
+      case '\f': out[n++] = '\\', out[n++] = 'f'; break;  // Formfeed
+      case '\n': out[n++] = '\\', out[n++] = 'n'; break;
+      case '\r': out[n++] = '\\', out[n++] = 'r'; break;
+      case '\t': out[n++] = '\\', out[n++] = 't'; break;
+      case '\v': out[n++] = '\\', out[n++] = 'v'; break;  // Vertical tab
+      case '\\': out[n++] = '\\', out[n++] = '\\'; break;
+      case '\"': out[n++] = '\\', out[n++] = '\"'; break;
+      case '\'': out[n++] = '\\', out[n++] = '\''; break;
 
       // Printable ASCII (0x20 - 0x7E), no need to escape
       default:
         if (c < 0x20 || c > 0x7E) {
           // Non-printables escaped as hex
-          z3_pushc (&s, '\\');  // Escape char
-          z3_pushc (&s, 'x');   // 'x' for hex escape
-
-          z3_pushc (&s, hex_digits[(c >> 4) & 0xF]);
-          z3_pushc (&s, hex_digits[c & 0xF]);
+          out[n++] = '\\';  // Escape char
+          out[n++] = 'x';   // 'x' for hex escape
+          out[n++] = hex_digits[(c >> 4) & 0xF];
+          out[n++] = hex_digits[c & 0xF];
         } else {
-          z3_pushc (&s, c);
+          out[n++] = c;
         }
         break;
     }
-    input++;
-    l++;
   }
-  z3_ensure0 (&s);
+
+  s.len = n;
+  out[n] = '\0';
   return s;
 }
 
+static inline unsigned char z3__hex_nibble (char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return 0;
+}
+
 String z3_unescape (const char *input, size_t len) {
-  String s = z3_str (32);
-  size_t l = 0;
+  return z3_unescape_in (NULL, input, len);
+}
+
+String z3_unescape_in (const Z3Allocator *alloc, const char *input, size_t len) {
+  String s = {0};
+  if (len > SIZE_MAX - 1) return s;
+
+  // every escape is at least as long as what it stands for
+  s = z3_str_in (alloc, len + 1);
+  char *out = z3_chr (&s);
+  if (!out) return s;
+
+  const char *end = input + len;
+  size_t n = 0;
 
   // loop until `\0`, or until length
-  while (l < len && *input) {
-    if (*input == '\\') {
+  while (input < end && *input) {
+    // plain runs are copied a word at a time
+    while (end - input >= 8 && !z3__unescapable8 (input)) {
+      memcpy (out + n, input, 8);
+      n += 8;
+      input += 8;
+    }
+    if (input >= end || !*input) break;
+
+    // a backslash that ends the input is kept as is
+    if (*input == '\\' && input + 1 < end && input[1]) {
       input++;  // Skip the backslash
 
       switch (*input) {
-        case 'a':
-          z3_pushc (&s, '\a');
-          break;
-        case 'b':
-          z3_pushc (&s, '\b');
-          break;
-        case 'f':
-          z3_pushc (&s, '\f');
-          break;
-        case 'n':
-          z3_pushc (&s, '\n');
-          break;
-        case 'r':
-          z3_pushc (&s, '\r');
-          break;
-        case 't':
-          z3_pushc (&s, '\t');
-          break;
-        case 'v':
-          z3_pushc (&s, '\v');
-          break;
-        case '\\':
-          z3_pushc (&s, '\\');
-          break;
-        case '\"':
-          z3_pushc (&s, '\"');
-          break;
-        case '\'':
-          z3_pushc (&s, '\'');
-          break;
+        case 'a':  out[n++] = '\a'; break;
+        case 'b':  out[n++] = '\b'; break;
+        case 'f':  out[n++] = '\f'; break;
+        case 'n':  out[n++] = '\n'; break;
+        case 'r':  out[n++] = '\r'; break;
+        case 't':  out[n++] = '\t'; break;
+        case 'v':  out[n++] = '\v'; break;
+        case '\\': out[n++] = '\\'; break;
+        case '\"': out[n++] = '\"'; break;
+        case '\'': out[n++] = '\''; break;
 
         case 'x': {
-          input++;  // Skip 'x'
-          if (!isxdigit (*input)) {
-            z3_pushl (&s, "\\x", 2);
-            z3_pushc (&s, *input++);
+          // without a hex digit, `\x` is kept and what follows is read as usual
+          if (input + 1 >= end || !isxdigit ((unsigned char)input[1])) {
+            out[n++] = '\\';
+            out[n++] = 'x';
             break;
           }
-          l++;
-          unsigned char byte_value = 0;
-          char c = *input++;
-
-          if (c >= '0' && c <= '9')
-            byte_value |= (c - '0');
-          else if (c >= 'a' && c <= 'f')
-            byte_value |= (c - 'a' + 10);
-          else if (c >= 'A' && c <= 'F')
-            byte_value |= (c - 'A' + 10);
-
-          c = *input;
-          byte_value <<= 4;
-
-          if (c >= '0' && c <= '9')
-            byte_value |= (c - '0');
-          else if (c >= 'a' && c <= 'f')
-            byte_value |= (c - 'a' + 10);
-          else if (c >= 'A' && c <= 'F')
-            byte_value |= (c - 'A' + 10);
-          z3_pushc (&s, byte_value);
-
+          unsigned char byte_value = z3__hex_nibble (*++input);
+          if (input + 1 < end && isxdigit ((unsigned char)input[1])) {
+            byte_value = byte_value << 4 | z3__hex_nibble (*++input);
+          }
+          out[n++] = byte_value;
           break;
         }
 
         // In case of invalid escape, just add the backslash
         default:
-          z3_pushc (&s, '\\');
-          z3_pushc (&s, *input);
+          out[n++] = '\\';
+          out[n++] = *input;
           break;
       }
     } else {
-      z3_pushc (&s, *input);
+      out[n++] = *input;
     }
     input++;
-    l++;
   }
-  z3_ensure0 (&s);
+
+  s.len = n;
+  out[n] = '\0';
   return s;
 }
 
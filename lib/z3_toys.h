@@ -8,6 +8,12 @@
  *   - Error printing macros
  *   - Warning silence utilities
  *   - Array manipulation helpers
+ *   - Cheap hashing
+ *   - Table-driven Bluetooth address (bdaddr) parsing and formatting
+ *   - Open-addressing hash map in one flat block, fast path for bdaddr keys
+ *   - Lock-free single-producer/single-consumer ring, usable in shared memory
+ *   - Log-linear (HDR style) histogram with atomic recording and compact encoding
+ *   - Intrusive lists, and a hierarchical timer wheel with O(1) arm and cancel
  *
  * Requires:
  *   - C23 Standard (Use -std=c23).
@@ -21,6 +27,9 @@
 #error This code must be compiled with -std=c23
 #endif
 
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -62,20 +71,1009 @@
             (void *)0))
 
 //~ Calculate the next power of 2 greater than or equal to n
+//! Returns 0 if the result does not fit in a size_t
 size_t next_power_of2(size_t n);
 
+//~ 32-bit FNV-1a hash of `len` bytes
+uint32_t z3_fnv1a (const void *data, size_t len);
+
+//~ Mix 64 bits into a well distributed 64-bit hash
+static inline uint64_t z3_mix64 (uint64_t x) {
+  x ^= x >> 32;
+  x *= 0xD6E8FEB86659FD93ULL;
+  x ^= x >> 32;
+  x *= 0xD6E8FEB86659FD93ULL;
+  x ^= x >> 32;
+  return x;
+}
+
+//~ Length of a formatted bdaddr, `XX:XX:XX:XX:XX:XX`
+#define Z3_BDADDR_STRLEN 17
+
+//~ Parse `XX:XX:XX:XX:XX:XX` (any hex case) into `addr`, in BlueZ byte order
+//! Strict: exactly 17 characters, colons in place, `addr` untouched on failure
+bool z3_bdaddr_parse (const char *s, size_t len, uint8_t addr[6]);
+
+//~ Format `addr` (BlueZ byte order) as uppercase `XX:XX:XX:XX:XX:XX` plus `\0`
+void z3_bdaddr_format (const uint8_t addr[6], char out[Z3_BDADDR_STRLEN + 1]);
+
+//~ Parse `n` null terminated addresses, returns how many were parsed before an invalid one
+size_t z3_bdaddr_parse_n (const char *const *strs, size_t n, uint8_t (*addrs)[6]);
+
+//~ Format `n` addresses, one `Z3_BDADDR_STRLEN + 1` slot each
+void z3_bdaddr_format_n (
+    const uint8_t (*addrs)[6], size_t n, char (*out)[Z3_BDADDR_STRLEN + 1]
+);
+
+//~ First bytes of every map image
+#define Z3_MAP_MAGIC 0x50414D33u  // "3MAP"
+
+//~ Header of a map image, followed by control bytes, keys and values
+//! Native endianness, an image is only portable between equal machines
+typedef struct {
+  uint32_t magic;    /**< `Z3_MAP_MAGIC` */
+  uint32_t key_size; /**< Bytes per key */
+  uint32_t val_size; /**< Bytes per value */
+  uint32_t reserved; /**< Zero */
+  uint64_t cap;      /**< Number of slots, a power of 2 */
+  uint64_t len;      /**< Occupied slots */
+  uint64_t dead;     /**< Deleted slots, still taking probe space */
+} Z3MapHeader;
+
+//~ Open-addressing hash map with fixed-size keys and values in flat arrays
+//
+//~ Everything lives in one block (`z3_map_bytes`) owned by the caller, so a
+//  map can sit in an arena, on the stack, or in a file mapped read-only.
+//  Keys of 6 bytes (bdaddr) take a dedicated load/hash/compare path.
+typedef struct {
+  Z3MapHeader *hdr; /**< Start of the block */
+  uint8_t *ctrl;    /**< Per slot: 0 empty, 1 deleted, 0x80 | hash tag if full */
+  uint8_t *keys;    /**< `cap * key_size` bytes */
+  uint8_t *vals;    /**< `cap * val_size` bytes, 8-byte aligned */
+  bool readonly;    /**< Set by `z3_map_view`, writes fail */
+} Z3Map;
+
+//~ Bytes of memory needed by a map with `cap` slots (rounded up to a power of 2)
+//! 0 if the size does not fit in a size_t
+size_t z3_map_bytes (size_t cap, uint32_t key_size, uint32_t val_size);
+
+//~ Create an empty map in `mem`, which must be 8-byte aligned and `z3_map_bytes` long
+//! At most 7/8 of the slots can be used, insertions fail beyond that
+bool z3_map_init (
+    Z3Map *map, void *mem, size_t mem_size, size_t cap, uint32_t key_size, uint32_t val_size
+);
+
+//~ Read-only map over an existing image (for example a mapped file), validating it
+bool z3_map_view (Z3Map *map, const void *image, size_t image_size);
+
+//~ Writable map over an existing image, validating it like `z3_map_view`
+//! Writers sharing the image must serialize among themselves
+bool z3_map_attach (Z3Map *map, void *image, size_t image_size);
+
+//~ Value stored for `key`, NULL if absent
+void *z3_map_get (const Z3Map *map, const void *key);
+
+//~ Value slot for `key`, inserted zero-filled if absent
+//! NULL if the map is full or read-only
+void *z3_map_put (Z3Map *map, const void *key);
+
+//~ Remove `key`, false if it was absent or the map is read-only
+bool z3_map_del (Z3Map *map, const void *key);
+
+//~ Copy every entry of `src` into the empty map `dst`, for example to grow it
+bool z3_map_rehash (Z3Map *dst, const Z3Map *src);
+
+//~ Iterate entries, start with `*it = 0`, false when there are no more
+bool z3_map_next (const Z3Map *map, size_t *it, const void **key, void **val);
+
+//~ Create an empty map keyed by bdaddr (BlueZ byte order)
+#define z3_bdmap_init(map, mem, mem_size, cap, val_size) \
+  z3_map_init ((map), (mem), (mem_size), (cap), 6, (val_size))
+
+//~ Cache line size assumed for padding shared indices
+#define Z3_CACHE_LINE 64
+
+//~ First bytes of every ring
+#define Z3_RING_MAGIC 0x474E5233u  // "3RNG"
+
+//~ Lock-free single-producer/single-consumer ring of fixed-size elements
+//
+//~ The ring is one block without pointers, so it works the same in process
+//  memory or in a shared mapping used by two processes. Each index sits on
+//  its own cache line next to the other side's last value seen, so pushes
+//  and pops only touch the opposite line when the ring looks full or empty.
+typedef struct {
+  alignas (Z3_CACHE_LINE) uint32_t magic; /**< `Z3_RING_MAGIC` */
+  uint32_t elem_size;                     /**< Bytes per element */
+  uint64_t cap;                           /**< Elements, a power of 2 */
+
+  alignas (Z3_CACHE_LINE) _Atomic uint64_t head; /**< Next write, owned by the producer */
+  uint64_t tail_seen;                            /**< Producer copy of `tail` */
+
+  alignas (Z3_CACHE_LINE) _Atomic uint64_t tail; /**< Next read, owned by the consumer */
+  uint64_t head_seen;                            /**< Consumer copy of `head` */
+
+  alignas (Z3_CACHE_LINE) unsigned char data[]; /**< `cap * elem_size` bytes */
+} Z3Ring;
+
+//~ Bytes of memory needed by a ring of `cap` elements (rounded up to a power of 2)
+//! 0 if the size does not fit in a size_t
+size_t z3_ring_bytes (size_t cap, uint32_t elem_size);
+
+//~ Create an empty ring in `mem`, aligned to `Z3_CACHE_LINE` and `z3_ring_bytes` long
+//! NULL on bad arguments, or if 64-bit atomics are not lock-free here
+Z3Ring *z3_ring_init (void *mem, size_t mem_size, size_t cap, uint32_t elem_size);
+
+//~ Use a ring created by `z3_ring_init`, for example by another process
+Z3Ring *z3_ring_attach (void *mem, size_t mem_size);
+
+//~ Copy `elem` into the ring, false if it is full (producer only)
+bool z3_ring_push (Z3Ring *ring, const void *elem);
+
+//~ Copy the oldest element out of the ring, false if it is empty (consumer only)
+bool z3_ring_pop (Z3Ring *ring, void *elem);
+
+//~ Elements waiting in the ring, exact only when called from one of the two sides
+size_t z3_ring_len (Z3Ring *ring);
+
+//~ First bytes of every histogram
+#define Z3_HIST_MAGIC 0x54534833u  // "3HST"
+
+//~ Log-linear histogram of unsigned 64-bit values, in one block without pointers
+//
+//~ Values below `2^precision` get a bucket each. Above that, every power of 2
+//  range is split in `2^precision` buckets, so the relative error stays under
+//  `2^-precision` (precision 7 is under 1%). Values of `max_bits` bits or
+//  more land in the last bucket. Recording is a few relaxed atomic adds, so
+//  threads or processes sharing a mapping can record into one copy.
+typedef struct {
+  uint32_t magic;            /**< `Z3_HIST_MAGIC` */
+  uint8_t precision;         /**< Sub-bucket bits, 1 to 14 */
+  uint8_t max_bits;          /**< Values tracked exactly up to `2^max_bits - 1` */
+  uint16_t reserved;         /**< Zero */
+  uint32_t buckets;          /**< Number of `counts` */
+  uint32_t reserved2;        /**< Zero */
+  _Atomic uint64_t total;    /**< Values recorded */
+  _Atomic uint64_t min;      /**< Smallest value recorded, UINT64_MAX if none */
+  _Atomic uint64_t max;      /**< Largest value recorded */
+  _Atomic uint64_t counts[]; /**< One counter per bucket */
+} Z3Hist;
+
+//~ Bytes of memory needed by a histogram of a valid shape, as a constant expression
+#define Z3_HIST_BYTES(precision, max_bits) \
+  (sizeof (Z3Hist) +                        \
+   ((size_t)((max_bits) - (precision) + 1) << (precision)) * sizeof (uint64_t))
+
+//~ Bytes of memory needed by a histogram, 0 for an invalid shape
+size_t z3_hist_bytes (uint8_t precision, uint8_t max_bits);
+
+//~ Create an empty histogram in `mem`, 8-byte aligned and `z3_hist_bytes` long
+Z3Hist *z3_hist_init (void *mem, size_t mem_size, uint8_t precision, uint8_t max_bits);
+
+//~ Use a histogram created by `z3_hist_init`, for example by another process
+Z3Hist *z3_hist_attach (void *mem, size_t mem_size);
+
+//~ Record `n` occurrences of `value`, safe from any number of threads
+void z3_hist_record_n (Z3Hist *hist, uint64_t value, uint64_t n);
+
+//~ Record one occurrence of `value`, safe from any number of threads
+static inline void z3_hist_record (Z3Hist *hist, uint64_t value) {
+  z3_hist_record_n (hist, value, 1);
+}
+
+//~ Forget every value, must not race with recorders
+void z3_hist_reset (Z3Hist *hist);
+
+//~ Add every value of `src` into `dst`, shapes may differ
+void z3_hist_merge (Z3Hist *dst, const Z3Hist *src);
+
+//~ Highest value equivalent to the `percentile` (0 to 100) of the recorded values
+//! 0 if nothing was recorded
+uint64_t z3_hist_percentile (const Z3Hist *hist, double percentile);
+
+//~ Worst case of `z3_hist_encode` for a valid shape, as a constant expression
+//! A header of 27 bytes (magic 5, shape 2, extremes 10 each), then 11 per bucket
+#define Z3_HIST_ENCODED_BYTES(precision, max_bits) \
+  (27 + ((size_t)((max_bits) - (precision) + 1) << (precision)) * 11)
+
+//~ Encode into `buf` as zero runs and counts (LEB128), returns bytes written
+//! 0 if `buf` is too small, `Z3_HIST_ENCODED_BYTES` of the shape is always enough
+size_t z3_hist_encode (const Z3Hist *hist, uint8_t *buf, size_t size);
+
+//~ Add the values of an encoded histogram into `hist`
+//! False if malformed, values decoded before the error stay added
+bool z3_hist_decode (Z3Hist *hist, const uint8_t *buf, size_t len);
+
+//~ Link of an intrusive doubly linked list, embedded in the elements
+//! A list is a head link pointing at itself when empty
+typedef struct Z3Link {
+  struct Z3Link *next;
+  struct Z3Link *prev;
+} Z3Link;
+
+//~ Make `head` an empty list
+static inline void z3_list_init (Z3Link *head) {
+  head->next = head->prev = head;
+}
+
+//~ Whether the list of `head` holds nothing
+static inline bool z3_list_empty (const Z3Link *head) {
+  return head->next == head;
+}
+
+//~ Append `link` at the end of the list of `head`
+static inline void z3_list_push (Z3Link *head, Z3Link *link) {
+  link->prev = head->prev;
+  link->next = head;
+  head->prev->next = link;
+  head->prev = link;
+}
+
+//~ Take `link` out of whatever list holds it
+static inline void z3_list_remove (Z3Link *link) {
+  link->prev->next = link->next;
+  link->next->prev = link->prev;
+  link->next = link->prev = NULL;
+}
+
+//~ Element holding `link` as its member `field`
+#define z3_container_of(link, type, field) ((type *)((char *)(link) - offsetof (type, field)))
+
+//~ Shape of a timer wheel: levels of `2^Z3_WHEEL_BITS` slots, 2^24 ticks ahead
+#define Z3_WHEEL_LEVELS 4
+#define Z3_WHEEL_BITS   6
+#define Z3_WHEEL_SLOTS  (1 << Z3_WHEEL_BITS)
+
+//~ Timer embedded in the caller's struct, zero-filled while not armed
+typedef struct {
+  Z3Link link;      /**< In a slot of the wheel while armed */
+  uint64_t expires; /**< Tick it is due at */
+  uint16_t slot;    /**< `level * Z3_WHEEL_SLOTS + index` while armed */
+} Z3Timer;
+
+//~ Hierarchical timer wheel over caller-defined ticks
+//
+//~ Slots of level `l` span `64^l` ticks. A timer sits at the level of the highest
+//  bit in which its tick differs from the current one, and moves down once time
+//  reaches its slot: it is touched at most once per level. Arming and cancelling
+//  are O(1). Advancing jumps from one occupied slot to the next with a bitmap per
+//  level, so it costs the timers due, not the ticks elapsed. Timers more than
+//  2^24 ticks ahead wait in the last level and are placed again when it turns.
+typedef struct {
+  uint64_t now;                                  /**< Nothing armed is due before it */
+  size_t count;                                  /**< Armed timers */
+  uint64_t occupied[Z3_WHEEL_LEVELS];            /**< Bit per slot holding timers */
+  Z3Link slots[Z3_WHEEL_LEVELS][Z3_WHEEL_SLOTS]; /**< List heads */
+} Z3Wheel;
+
+//~ Empty wheel starting at tick `now`
+void z3_wheel_init (Z3Wheel *wheel, uint64_t now);
+
+//~ Whether `timer` is armed in a wheel
+static inline bool z3_timer_armed (const Z3Timer *timer) {
+  return timer->link.next != NULL;
+}
+
+//~ Arm `timer` for tick `expires`, moving it if armed already; a past tick is due now
+void z3_wheel_add (Z3Wheel *wheel, Z3Timer *timer, uint64_t expires);
+
+//~ Disarm `timer`, nothing happens if it was not armed
+void z3_wheel_cancel (Z3Wheel *wheel, Z3Timer *timer);
+
+//~ Earliest tick a timer may be due at, UINT64_MAX when none is armed
+//! A lower bound: the wheel may only find out then that its timers are due later
+uint64_t z3_wheel_next (const Z3Wheel *wheel);
+
+//~ Advance to tick `now` and disarm one timer due by then, NULL once none is left
+//! Call it until NULL; timers armed meanwhile for `now` or before come out as well
+Z3Timer *z3_wheel_expire (Z3Wheel *wheel, uint64_t now);
+
 #ifdef Z3_TOYS_IMPL
 // Implementation of utility functions
 
 //~ Calculate the next power of 2 greater than or equal to n
 size_t next_power_of2(size_t n) {
-  n--;
-  n |= n >> 1;
-  n |= n >> 2;
-  n |= n >> 4;
-  n |= n >> 8;
-  n |= n >> 16;
-  return n + 1;
+  if (n <= 1) return 1;
+
+  // bits needed to hold n - 1, the result is one past its highest bit
+  int shift = (int)(sizeof (unsigned long long) * 8) - __builtin_clzll (n - 1);
+  if (shift >= (int)(sizeof (size_t) * 8)) return 0;
+  return (size_t)1 << shift;
+}
+
+//~ 32-bit FNV-1a hash of `len` bytes
+uint32_t z3_fnv1a (const void *data, size_t len) {
+  const unsigned char *p = data;
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < len; i++) {
+    hash ^= p[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Hex digit value plus one, 0 for anything that is not a hex digit
+static const uint8_t z3__hexval1[256] = {
+    ['0'] = 1,  ['1'] = 2,  ['2'] = 3,  ['3'] = 4,  ['4'] = 5,  ['5'] = 6,
+    ['6'] = 7,  ['7'] = 8,  ['8'] = 9,  ['9'] = 10, ['a'] = 11, ['b'] = 12,
+    ['c'] = 13, ['d'] = 14, ['e'] = 15, ['f'] = 16, ['A'] = 11, ['B'] = 12,
+    ['C'] = 13, ['D'] = 14, ['E'] = 15, ['F'] = 16,
+};
+
+// Uppercase hex digits of every byte value, two characters each
+static const char z3__hexpair[512 + 1] =
+    "000102030405060708090A0B0C0D0E0F101112131415161718191A1B1C1D1E1F"
+    "202122232425262728292A2B2C2D2E2F303132333435363738393A3B3C3D3E3F"
+    "404142434445464748494A4B4C4D4E4F505152535455565758595A5B5C5D5E5F"
+    "606162636465666768696A6B6C6D6E6F707172737475767778797A7B7C7D7E7F"
+    "808182838485868788898A8B8C8D8E8F909192939495969798999A9B9C9D9E9F"
+    "A0A1A2A3A4A5A6A7A8A9AAABACADAEAFB0B1B2B3B4B5B6B7B8B9BABBBCBDBEBF"
+    "C0C1C2C3C4C5C6C7C8C9CACBCCCDCECFD0D1D2D3D4D5D6D7D8D9DADBDCDDDEDF"
+    "E0E1E2E3E4E5E6E7E8E9EAEBECEDEEEFF0F1F2F3F4F5F6F7F8F9FAFBFCFDFEFF";
+
+bool z3_bdaddr_parse (const char *s, size_t len, uint8_t addr[6]) {
+  if (!s || len != Z3_BDADDR_STRLEN) return false;
+
+  uint8_t out[6];
+  unsigned bad = 0;
+  for (int i = 0; i < 6; i++) {
+    uint8_t hi = z3__hexval1[(unsigned char)s[i * 3]];
+    uint8_t lo = z3__hexval1[(unsigned char)s[i * 3 + 1]];
+    bad |= (hi == 0) | (lo == 0);
+    if (i < 5) bad |= s[i * 3 + 2] != ':';
+
+    // most significant byte is printed first, BlueZ stores it last
+    out[5 - i] = (uint8_t)(((hi - 1) << 4) | ((lo - 1) & 0xF));
+  }
+  if (bad) return false;
+
+  memcpy (addr, out, sizeof (out));
+  return true;
+}
+
+void z3_bdaddr_format (const uint8_t addr[6], char out[Z3_BDADDR_STRLEN + 1]) {
+  for (int i = 0; i < 6; i++) {
+    const char *pair = &z3__hexpair[addr[5 - i] * 2];
+    out[i * 3] = pair[0];
+    out[i * 3 + 1] = pair[1];
+    out[i * 3 + 2] = ':';
+  }
+  out[Z3_BDADDR_STRLEN] = '\0';
+}
+
+size_t z3_bdaddr_parse_n (const char *const *strs, size_t n, uint8_t (*addrs)[6]) {
+  for (size_t i = 0; i < n; i++) {
+    if (!strs[i] || !z3_bdaddr_parse (strs[i], strlen (strs[i]), addrs[i])) return i;
+  }
+  return n;
+}
+
+void z3_bdaddr_format_n (
+    const uint8_t (*addrs)[6], size_t n, char (*out)[Z3_BDADDR_STRLEN + 1]
+) {
+  for (size_t i = 0; i < n; i++) {
+    z3_bdaddr_format (addrs[i], out[i]);
+  }
+}
+
+// Round `n` up to a multiple of 8, 0 on overflow
+static inline size_t z3__align8 (size_t n) {
+  return n > SIZE_MAX - 7 ? 0 : (n + 7) & ~(size_t)7;
+}
+
+static inline size_t z3__map_keys_at (uint64_t cap) {
+  return sizeof (Z3MapHeader) + z3__align8 (cap);
+}
+
+static inline size_t z3__map_vals_at (uint64_t cap, uint32_t key_size) {
+  return z3__map_keys_at (cap) + z3__align8 (cap * key_size);
+}
+
+static inline uint64_t z3__map_hash (const Z3Map *map, const void *key) {
+  uint32_t size = map->hdr->key_size;
+  if (size == 6) {
+    uint64_t k = 0;
+    memcpy (&k, key, 6);
+    return z3_mix64 (k);
+  }
+
+  const uint8_t *p = key;
+  uint64_t h = size;
+  for (; size >= 8; size -= 8, p += 8) {
+    uint64_t k;
+    memcpy (&k, p, 8);
+    h = z3_mix64 (h ^ k);
+  }
+  if (size > 0) {
+    uint64_t k = 0;
+    memcpy (&k, p, size);
+    h = z3_mix64 (h ^ k);
+  }
+  return h;
+}
+
+static inline bool z3__map_key_eq (const Z3Map *map, size_t slot, const void *key) {
+  uint32_t size = map->hdr->key_size;
+  const uint8_t *k = map->keys + slot * size;
+  if (size == 6) {
+    uint32_t a0, b0;
+    uint16_t a1, b1;
+    memcpy (&a0, k, 4), memcpy (&a1, k + 4, 2);
+    memcpy (&b0, key, 4), memcpy (&b1, (const uint8_t *)key + 4, 2);
+    return ((a0 ^ b0) | (uint32_t)(a1 ^ b1)) == 0;
+  }
+  return memcmp (k, key, size) == 0;
+}
+
+// Slot holding `key`, or the first free slot its probe passed, or -1 if full
+static ptrdiff_t z3__map_find (const Z3Map *map, const void *key, bool *found) {
+  uint64_t mask = map->hdr->cap - 1;
+  uint64_t h = z3__map_hash (map, key);
+  uint8_t tag = 0x80 | (uint8_t)(h >> 57);
+  ptrdiff_t free_slot = -1;
+
+  *found = false;
+  for (uint64_t i = 0, slot = h & mask; i <= mask; i++, slot = (slot + 1) & mask) {
+    uint8_t c = map->ctrl[slot];
+    if (c == 0) return free_slot >= 0 ? free_slot : (ptrdiff_t)slot;
+    if (c == 1) {
+      if (free_slot < 0) free_slot = slot;
+      continue;
+    }
+    if (c == tag && z3__map_key_eq (map, slot, key)) {
+      *found = true;
+      return slot;
+    }
+  }
+
+  return free_slot;
+}
+
+static void z3__map_bind (Z3Map *map, uint8_t *base, bool readonly) {
+  map->hdr = (Z3MapHeader *)base;
+  map->ctrl = base + sizeof (Z3MapHeader);
+  map->keys = base + z3__map_keys_at (map->hdr->cap);
+  map->vals = base + z3__map_vals_at (map->hdr->cap, map->hdr->key_size);
+  map->readonly = readonly;
+}
+
+size_t z3_map_bytes (size_t cap, uint32_t key_size, uint32_t val_size) {
+  cap = next_power_of2 (cap < 8 ? 8 : cap);
+  if (cap == 0 || key_size == 0) return 0;
+  if (cap > SIZE_MAX / key_size || (val_size && cap > SIZE_MAX / val_size)) return 0;
+
+  size_t ctrl = z3__align8 (cap);
+  size_t keys = z3__align8 (cap * key_size);
+  size_t vals = cap * val_size;
+  if (!ctrl || !keys || ctrl > SIZE_MAX - sizeof (Z3MapHeader) - keys) return 0;
+
+  size_t total = sizeof (Z3MapHeader) + ctrl + keys;
+  return vals > SIZE_MAX - total ? 0 : total + vals;
+}
+
+bool z3_map_init (
+    Z3Map *map, void *mem, size_t mem_size, size_t cap, uint32_t key_size, uint32_t val_size
+) {
+  size_t need = z3_map_bytes (cap, key_size, val_size);
+  if (need == 0 || !mem || mem_size < need || ((uintptr_t)mem & 7) != 0) return false;
+
+  Z3MapHeader *hdr = mem;
+  *hdr = (Z3MapHeader){
+      .magic = Z3_MAP_MAGIC,
+      .key_size = key_size,
+      .val_size = val_size,
+      .cap = next_power_of2 (cap < 8 ? 8 : cap),
+  };
+  z3__map_bind (map, mem, false);
+  memset (map->ctrl, 0, hdr->cap);
+  return true;
+}
+
+// Header and size of an image consistent with each other
+static bool z3__map_valid (const void *image, size_t image_size) {
+  const Z3MapHeader *hdr = image;
+  if (!image || image_size < sizeof (*hdr) || ((uintptr_t)image & 7) != 0) return false;
+  if (hdr->magic != Z3_MAP_MAGIC || hdr->key_size == 0 || hdr->reserved != 0) return false;
+  if (hdr->cap < 8 || (hdr->cap & (hdr->cap - 1)) != 0) return false;
+  if ((uint64_t)(size_t)hdr->cap != hdr->cap) return false;
+  if (hdr->len + hdr->dead > hdr->cap) return false;
+
+  size_t need = z3_map_bytes (hdr->cap, hdr->key_size, hdr->val_size);
+  return need != 0 && image_size >= need;
+}
+
+bool z3_map_view (Z3Map *map, const void *image, size_t image_size) {
+  if (!z3__map_valid (image, image_size)) return false;
+
+  // the map never writes through a read-only view
+  z3__map_bind (map, (uint8_t *)image, true);
+  return true;
+}
+
+bool z3_map_attach (Z3Map *map, void *image, size_t image_size) {
+  if (!z3__map_valid (image, image_size)) return false;
+
+  z3__map_bind (map, image, false);
+  return true;
+}
+
+void *z3_map_get (const Z3Map *map, const void *key) {
+  bool found;
+  ptrdiff_t slot = z3__map_find (map, key, &found);
+  return found ? map->vals + slot * map->hdr->val_size : NULL;
+}
+
+void *z3_map_put (Z3Map *map, const void *key) {
+  if (map->readonly) return NULL;
+
+  bool found;
+  ptrdiff_t slot = z3__map_find (map, key, &found);
+  if (found) return map->vals + slot * map->hdr->val_size;
+
+  Z3MapHeader *hdr = map->hdr;
+  bool reuse = slot >= 0 && map->ctrl[slot] == 1;
+  if (slot < 0 || (!reuse && hdr->len + hdr->dead + 1 > hdr->cap - hdr->cap / 8)) return NULL;
+
+  if (reuse) hdr->dead--;
+  hdr->len++;
+  map->ctrl[slot] = 0x80 | (uint8_t)(z3__map_hash (map, key) >> 57);
+  memcpy (map->keys + slot * hdr->key_size, key, hdr->key_size);
+
+  void *val = map->vals + slot * hdr->val_size;
+  memset (val, 0, hdr->val_size);
+  return val;
+}
+
+bool z3_map_del (Z3Map *map, const void *key) {
+  if (map->readonly) return false;
+
+  bool found;
+  ptrdiff_t slot = z3__map_find (map, key, &found);
+  if (!found) return false;
+
+  map->ctrl[slot] = 1;
+  map->hdr->len--;
+  map->hdr->dead++;
+  return true;
+}
+
+bool z3_map_rehash (Z3Map *dst, const Z3Map *src) {
+  if (dst->hdr->key_size != src->hdr->key_size) return false;
+  if (dst->hdr->val_size != src->hdr->val_size) return false;
+
+  size_t it = 0;
+  const void *key;
+  void *val;
+  while (z3_map_next (src, &it, &key, &val)) {
+    void *slot = z3_map_put (dst, key);
+    if (!slot) return false;
+    memcpy (slot, val, src->hdr->val_size);
+  }
+  return true;
+}
+
+bool z3_map_next (const Z3Map *map, size_t *it, const void **key, void **val) {
+  for (; *it < map->hdr->cap; (*it)++) {
+    if (map->ctrl[*it] & 0x80) {
+      *key = map->keys + *it * map->hdr->key_size;
+      *val = map->vals + *it * map->hdr->val_size;
+      (*it)++;
+      return true;
+    }
+  }
+  return false;
+}
+
+size_t z3_ring_bytes (size_t cap, uint32_t elem_size) {
+  cap = next_power_of2 (cap < 2 ? 2 : cap);
+  if (cap == 0 || elem_size == 0 || cap > (SIZE_MAX - sizeof (Z3Ring)) / elem_size) return 0;
+  return sizeof (Z3Ring) + cap * elem_size;
+}
+
+Z3Ring *z3_ring_init (void *mem, size_t mem_size, size_t cap, uint32_t elem_size) {
+  size_t need = z3_ring_bytes (cap, elem_size);
+  if (need == 0 || !mem || mem_size < need) return NULL;
+  if (((uintptr_t)mem & (Z3_CACHE_LINE - 1)) != 0) return NULL;
+
+  Z3Ring *ring = mem;
+  // processes sharing the ring must not depend on a lock inside libatomic
+  if (!atomic_is_lock_free (&ring->head)) return NULL;
+
+  ring->magic = Z3_RING_MAGIC;
+  ring->elem_size = elem_size;
+  ring->cap = next_power_of2 (cap < 2 ? 2 : cap);
+  ring->tail_seen = 0;
+  ring->head_seen = 0;
+  atomic_init (&ring->tail, 0);
+  // published last, `z3_ring_attach` acquires it before reading the fields above
+  atomic_store_explicit (&ring->head, 0, memory_order_release);
+  return ring;
+}
+
+Z3Ring *z3_ring_attach (void *mem, size_t mem_size) {
+  Z3Ring *ring = mem;
+  if (!mem || mem_size < sizeof (Z3Ring)) return NULL;
+  if (((uintptr_t)mem & (Z3_CACHE_LINE - 1)) != 0) return NULL;
+
+  (void)atomic_load_explicit (&ring->head, memory_order_acquire);
+  if (ring->magic != Z3_RING_MAGIC || ring->cap < 2 || (ring->cap & (ring->cap - 1)) != 0) {
+    return NULL;
+  }
+
+  size_t need = z3_ring_bytes (ring->cap, ring->elem_size);
+  return need != 0 && mem_size >= need ? ring : NULL;
+}
+
+bool z3_ring_push (Z3Ring *ring, const void *elem) {
+  uint64_t head = atomic_load_explicit (&ring->head, memory_order_relaxed);
+
+  if (head - ring->tail_seen == ring->cap) {
+    ring->tail_seen = atomic_load_explicit (&ring->tail, memory_order_acquire);
+    if (head - ring->tail_seen == ring->cap) return false;
+  }
+
+  size_t slot = head & (ring->cap - 1);
+  memcpy (ring->data + slot * ring->elem_size, elem, ring->elem_size);
+  atomic_store_explicit (&ring->head, head + 1, memory_order_release);
+  return true;
+}
+
+bool z3_ring_pop (Z3Ring *ring, void *elem) {
+  uint64_t tail = atomic_load_explicit (&ring->tail, memory_order_relaxed);
+
+  if (tail == ring->head_seen) {
+    ring->head_seen = atomic_load_explicit (&ring->head, memory_order_acquire);
+    if (tail == ring->head_seen) return false;
+  }
+
+  size_t slot = tail & (ring->cap - 1);
+  memcpy (elem, ring->data + slot * ring->elem_size, ring->elem_size);
+  atomic_store_explicit (&ring->tail, tail + 1, memory_order_release);
+  return true;
+}
+
+size_t z3_ring_len (Z3Ring *ring) {
+  uint64_t tail = atomic_load_explicit (&ring->tail, memory_order_acquire);
+  uint64_t head = atomic_load_explicit (&ring->head, memory_order_acquire);
+  return head - tail;
+}
+
+size_t z3_hist_bytes (uint8_t precision, uint8_t max_bits) {
+  if (precision < 1 || precision > 14 || max_bits <= precision || max_bits > 64) return 0;
+  return Z3_HIST_BYTES (precision, max_bits);
+}
+
+// Bucket of `value`: linear below `2^precision`, log-linear above
+static inline size_t z3__hist_index (const Z3Hist *hist, uint64_t value) {
+  uint8_t p = hist->precision;
+  if (value < (1ULL << p)) return value;
+
+  int e = 63 - __builtin_clzll (value);
+  if (e >= hist->max_bits) return hist->buckets - 1;
+
+  size_t group = e - p + 1;
+  return (group << p) + ((value >> (e - p)) & ((1ULL << p) - 1));
+}
+
+// Highest value that lands in bucket `idx`
+static inline uint64_t z3__hist_upper (const Z3Hist *hist, size_t idx) {
+  uint8_t p = hist->precision;
+  size_t group = idx >> p;
+  uint64_t sub = idx & ((1ULL << p) - 1);
+  if (group == 0) return sub;
+
+  uint64_t width = 1ULL << (group - 1);
+  return ((1ULL << p) + sub) * width + (width - 1);
+}
+
+Z3Hist *z3_hist_init (void *mem, size_t mem_size, uint8_t precision, uint8_t max_bits) {
+  size_t need = z3_hist_bytes (precision, max_bits);
+  if (need == 0 || !mem || mem_size < need || ((uintptr_t)mem & 7) != 0) return NULL;
+
+  Z3Hist *hist = mem;
+  if (!atomic_is_lock_free (&hist->total)) return NULL;
+
+  hist->magic = Z3_HIST_MAGIC;
+  hist->precision = precision;
+  hist->max_bits = max_bits;
+  hist->reserved = 0;
+  hist->reserved2 = 0;
+  hist->buckets = (uint32_t)((need - sizeof (Z3Hist)) / sizeof (uint64_t));
+  z3_hist_reset (hist);
+  return hist;
+}
+
+Z3Hist *z3_hist_attach (void *mem, size_t mem_size) {
+  Z3Hist *hist = mem;
+  if (!mem || mem_size < sizeof (Z3Hist) || ((uintptr_t)mem & 7) != 0) return NULL;
+  if (hist->magic != Z3_HIST_MAGIC) return NULL;
+
+  size_t need = z3_hist_bytes (hist->precision, hist->max_bits);
+  if (need == 0 || mem_size < need) return NULL;
+  if (hist->buckets != (need - sizeof (Z3Hist)) / sizeof (uint64_t)) return NULL;
+  return hist;
+}
+
+void z3_hist_record_n (Z3Hist *hist, uint64_t value, uint64_t n) {
+  if (n == 0) return;
+
+  size_t idx = z3__hist_index (hist, value);
+  atomic_fetch_add_explicit (&hist->counts[idx], n, memory_order_relaxed);
+  atomic_fetch_add_explicit (&hist->total, n, memory_order_relaxed);
+
+  // a failed exchange reloads `seen`, retry only while still an extreme
+  uint64_t seen = atomic_load_explicit (&hist->min, memory_order_relaxed);
+  while (value < seen) {
+    if (atomic_compare_exchange_weak_explicit (
+            &hist->min, &seen, value, memory_order_relaxed, memory_order_relaxed
+        )) {
+      break;
+    }
+  }
+
+  seen = atomic_load_explicit (&hist->max, memory_order_relaxed);
+  while (value > seen) {
+    if (atomic_compare_exchange_weak_explicit (
+            &hist->max, &seen, value, memory_order_relaxed, memory_order_relaxed
+        )) {
+      break;
+    }
+  }
+}
+
+void z3_hist_reset (Z3Hist *hist) {
+  for (uint32_t i = 0; i < hist->buckets; i++) {
+    atomic_store_explicit (&hist->counts[i], 0, memory_order_relaxed);
+  }
+  atomic_store_explicit (&hist->total, 0, memory_order_relaxed);
+  atomic_store_explicit (&hist->min, UINT64_MAX, memory_order_relaxed);
+  atomic_store_explicit (&hist->max, 0, memory_order_relaxed);
+}
+
+void z3_hist_merge (Z3Hist *dst, const Z3Hist *src) {
+  for (uint32_t i = 0; i < src->buckets; i++) {
+    uint64_t n = atomic_load_explicit (&src->counts[i], memory_order_relaxed);
+    if (n == 0) continue;
+
+    // exact extremes are kept, bucket values otherwise
+    uint64_t value = z3__hist_upper (src, i);
+    uint64_t lo = atomic_load_explicit (&src->min, memory_order_relaxed);
+    uint64_t hi = atomic_load_explicit (&src->max, memory_order_relaxed);
+    if (value > hi) value = hi;
+    if (value < lo) value = lo;
+    z3_hist_record_n (dst, value, n);
+  }
+}
+
+uint64_t z3_hist_percentile (const Z3Hist *hist, double percentile) {
+  uint64_t total = atomic_load_explicit (&hist->total, memory_order_relaxed);
+  if (total == 0) return 0;
+
+  if (percentile < 0) percentile = 0;
+  if (percentile > 100) percentile = 100;
+
+  uint64_t rank = (uint64_t)(percentile / 100.0 * (double)total + 0.5);
+  if (rank == 0) rank = 1;
+
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < hist->buckets; i++) {
+    seen += atomic_load_explicit (&hist->counts[i], memory_order_relaxed);
+    if (seen >= rank) {
+      uint64_t value = z3__hist_upper (hist, i);
+      uint64_t hi = atomic_load_explicit (&hist->max, memory_order_relaxed);
+      return value < hi ? value : hi;
+    }
+  }
+
+  return atomic_load_explicit (&hist->max, memory_order_relaxed);
+}
+
+static inline size_t z3__leb128_put (uint8_t *buf, size_t size, size_t at, uint64_t v) {
+  do {
+    if (at >= size) return 0;
+    uint8_t byte = v & 0x7F;
+    v >>= 7;
+    buf[at++] = byte | (v ? 0x80 : 0);
+  } while (v);
+  return at;
+}
+
+static inline bool z3__leb128_get (const uint8_t *buf, size_t len, size_t *at, uint64_t *v) {
+  *v = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*at >= len) return false;
+    uint8_t byte = buf[(*at)++];
+    *v |= (uint64_t)(byte & 0x7F) << shift;
+    if (!(byte & 0x80)) return true;
+  }
+  return false;
+}
+
+size_t z3_hist_encode (const Z3Hist *hist, uint8_t *buf, size_t size) {
+  size_t at = 0;
+
+  // magic, shape and extremes, then (zero run, count) pairs
+  uint64_t head[] = {
+      Z3_HIST_MAGIC,
+      hist->precision,
+      hist->max_bits,
+      atomic_load_explicit (&hist->min, memory_order_relaxed),
+      atomic_load_explicit (&hist->max, memory_order_relaxed),
+  };
+  for (size_t i = 0; i < sizeof (head) / sizeof (*head); i++) {
+    if (!(at = z3__leb128_put (buf, size, at, head[i]))) return 0;
+  }
+
+  uint64_t zeros = 0;
+  for (uint32_t i = 0; i < hist->buckets; i++) {
+    uint64_t n = atomic_load_explicit (&hist->counts[i], memory_order_relaxed);
+    if (n == 0) {
+      zeros++;
+      continue;
+    }
+    if (!(at = z3__leb128_put (buf, size, at, zeros))) return 0;
+    if (!(at = z3__leb128_put (buf, size, at, n))) return 0;
+    zeros = 0;
+  }
+
+  return at;
+}
+
+bool z3_hist_decode (Z3Hist *hist, const uint8_t *buf, size_t len) {
+  size_t at = 0;
+  uint64_t magic, precision, max_bits, lo, hi;
+  if (!z3__leb128_get (buf, len, &at, &magic) || magic != Z3_HIST_MAGIC) return false;
+  if (!z3__leb128_get (buf, len, &at, &precision)) return false;
+  if (!z3__leb128_get (buf, len, &at, &max_bits)) return false;
+  if (!z3__leb128_get (buf, len, &at, &lo)) return false;
+  if (!z3__leb128_get (buf, len, &at, &hi)) return false;
+  if (precision > 14 || max_bits > 64 || !z3_hist_bytes (precision, max_bits)) return false;
+
+  // a header on the stack gives bucket values of the encoded shape
+  Z3Hist shape = {.precision = precision, .max_bits = max_bits};
+  shape.buckets = (z3_hist_bytes (precision, max_bits) - sizeof (Z3Hist)) / sizeof (uint64_t);
+
+  uint64_t idx = 0;
+  while (at < len) {
+    uint64_t zeros, n;
+    if (!z3__leb128_get (buf, len, &at, &zeros) || !z3__leb128_get (buf, len, &at, &n)) {
+      return false;
+    }
+    if (zeros >= shape.buckets - idx) return false;
+    idx += zeros;
+
+    uint64_t value = z3__hist_upper (&shape, idx);
+    if (value > hi) value = hi;
+    if (value < lo) value = lo;
+    z3_hist_record_n (hist, value, n);
+    idx++;
+  }
+
+  return true;
+}
+
+void z3_wheel_init (Z3Wheel *wheel, uint64_t now) {
+  wheel->now = now;
+  wheel->count = 0;
+  for (int l = 0; l < Z3_WHEEL_LEVELS; l++) {
+    wheel->occupied[l] = 0;
+    for (int i = 0; i < Z3_WHEEL_SLOTS; i++) z3_list_init (&wheel->slots[l][i]);
+  }
+}
+
+// Slot of an armed timer for the current tick, a past tick counting as the current one
+static void z3__wheel_place (Z3Wheel *wheel, Z3Timer *timer) {
+  uint64_t at = timer->expires > wheel->now ? timer->expires : wheel->now;
+
+  // bits shared with now pick the level, the last level takes anything further out
+  uint64_t diff = at ^ wheel->now;
+  unsigned level = diff ? (unsigned)(63 - __builtin_clzll (diff)) / Z3_WHEEL_BITS : 0;
+  if (level >= Z3_WHEEL_LEVELS) level = Z3_WHEEL_LEVELS - 1;
+
+  unsigned idx = (at >> (level * Z3_WHEEL_BITS)) & (Z3_WHEEL_SLOTS - 1);
+  z3_list_push (&wheel->slots[level][idx], &timer->link);
+  wheel->occupied[level] |= 1ULL << idx;
+  timer->slot = level * Z3_WHEEL_SLOTS + idx;
+}
+
+static void z3__wheel_unlink (Z3Wheel *wheel, Z3Timer *timer) {
+  unsigned level = timer->slot / Z3_WHEEL_SLOTS, idx = timer->slot % Z3_WHEEL_SLOTS;
+  z3_list_remove (&timer->link);
+  if (z3_list_empty (&wheel->slots[level][idx])) wheel->occupied[level] &= ~(1ULL << idx);
+  wheel->count--;
+}
+
+void z3_wheel_add (Z3Wheel *wheel, Z3Timer *timer, uint64_t expires) {
+  if (z3_timer_armed (timer)) z3__wheel_unlink (wheel, timer);
+  timer->expires = expires;
+  z3__wheel_place (wheel, timer);
+  wheel->count++;
+}
+
+void z3_wheel_cancel (Z3Wheel *wheel, Z3Timer *timer) {
+  if (z3_timer_armed (timer)) z3__wheel_unlink (wheel, timer);
+}
+
+// Start of the first occupied slot after the current tick
+static uint64_t z3__wheel_after (const Z3Wheel *wheel) {
+  uint64_t next = UINT64_MAX;
+  for (unsigned l = 0; l < Z3_WHEEL_LEVELS; l++) {
+    uint64_t bits = wheel->occupied[l];
+    if (!bits) continue;
+
+    unsigned shift = l * Z3_WHEEL_BITS;
+    unsigned cur = (wheel->now >> shift) & (Z3_WHEEL_SLOTS - 1);
+    uint64_t span = 1ULL << (shift + Z3_WHEEL_BITS);
+    uint64_t base = wheel->now & ~(span - 1);
+
+    // the current slot of each level was emptied on the way in
+    uint64_t later = cur == Z3_WHEEL_SLOTS - 1 ? 0 : bits & (~0ULL << (cur + 1));
+    uint64_t start;
+    if (later) {
+      start = base + ((uint64_t)__builtin_ctzll (later) << shift);
+    } else if (l == Z3_WHEEL_LEVELS - 1) {
+      // far timers wait for the last level to come around
+      start = base + span + ((uint64_t)__builtin_ctzll (bits) << shift);
+    } else {
+      continue;
+    }
+    if (start < next) next = start;
+  }
+  return next;
+}
+
+uint64_t z3_wheel_next (const Z3Wheel *wheel) {
+  if (wheel->count == 0) return UINT64_MAX;
+  if (wheel->occupied[0] & 1ULL << (wheel->now & (Z3_WHEEL_SLOTS - 1))) return wheel->now;
+  return z3__wheel_after (wheel);
+}
+
+// Move the timers of every slot starting at the current tick one level down or more
+static void z3__wheel_cascade (Z3Wheel *wheel) {
+  for (unsigned l = Z3_WHEEL_LEVELS - 1; l > 0; l--) {
+    unsigned shift = l * Z3_WHEEL_BITS;
+    if (wheel->now & ((1ULL << shift) - 1)) continue;
+
+    unsigned idx = (wheel->now >> shift) & (Z3_WHEEL_SLOTS - 1);
+    if (!(wheel->occupied[l] & 1ULL << idx)) continue;
+
+    // detached first, far timers may land in this very slot again
+    Z3Link *head = &wheel->slots[l][idx], moving;
+    moving.next = head->next;
+    moving.prev = head->prev;
+    moving.next->prev = moving.prev->next = &moving;
+    z3_list_init (head);
+    wheel->occupied[l] &= ~(1ULL << idx);
+
+    while (!z3_list_empty (&moving)) {
+      Z3Timer *timer = z3_container_of (moving.next, Z3Timer, link);
+      z3_list_remove (&timer->link);
+      z3__wheel_place (wheel, timer);
+    }
+  }
+}
+
+Z3Timer *z3_wheel_expire (Z3Wheel *wheel, uint64_t now) {
+  for (;;) {
+    // everything in the current slot of the first level is due
+    Z3Link *head = &wheel->slots[0][wheel->now & (Z3_WHEEL_SLOTS - 1)];
+    if (!z3_list_empty (head)) {
+      Z3Timer *timer = z3_container_of (head->next, Z3Timer, link);
+      z3__wheel_unlink (wheel, timer);
+      return timer;
+    }
+
+    if (wheel->now >= now) return NULL;
+
+    uint64_t next = wheel->count ? z3__wheel_after (wheel) : UINT64_MAX;
+    if (next > now) {
+      // no slot starts in between, the timers keep their places
+      wheel->now = now;
+      return NULL;
+    }
+    wheel->now = next;
+    z3__wheel_cascade (wheel);
+  }
 }
 
 #endif // Z3_TOYS_IMPL
@@ -1,6 +1,7 @@
-#include <bluetooth/bluetooth.h>
-#include <bluetooth/hci.h>
-#include <bluetooth/hci_lib.h>
+// POSIX interfaces (clock_gettime, ...) are hidden by a strict -std=c23, mkostemp is GNU
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
 #include <security/_pam_types.h>
 #include <security/pam_ext.h>
@@ -11,6 +12,7 @@
 #include <string.h>
 #include <sys/ioctl.h>
 #include <syslog.h>
+#include <time.h>
 #include <unistd.h>
 
 #define Z3_TOYS_SCOPED
@@ -18,142 +20,231 @@
 #define Z3_TOYS_IMPL
 #include "lib/z3_string.h"
 
+#define KV_FILE_IMPL
+#include "lib/kv_file.h"
+
+#define BT_HCI_IMPL
+#include "lib/bt_hci.h"
+
+#define BT_PRESENCE_IMPL
+#include "lib/bt_presence.h"
+
+#define BT_STATS_IMPL
+#include "lib/bt_stats.h"
+
 #define CONFIG_FILE            "/etc/pam_bluetooth.conf"
-#define SYSCALL_MAX_BYTES_READ 1024
-#define MAX_ITEM_LEN           256
+#define SYSCALL_MAX_BYTES_READ 8192
 #define MAX_DEVICES_LOOKDUP    20
+#define AUTH_ARENA_SIZE        512
+
+// Samples taken while a link is briefly out of sniff mode
+#define RSSI_BURST        3
+#define RSSI_BURST_GAP_MS 20
+// Longest sniff interval we wait out for the link to become active
+#define SNIFF_EXIT_TIMEOUT_MS 1500
+// Sniff intervals of the kernel idle timer, in 0.625 ms slots, asked for when a link
+// goes back to sniff mode: the ones it had cannot be read back (see `sample_link_rssi`)
+#define SNIFF_MAX_INTERVAL 800
+#define SNIFF_MIN_INTERVAL 80
+
+// Extra time of a shadow run unless `shadow_budget` says otherwise
+#define SHADOW_BUDGET_MS 300
+// Percent of auths running the candidate unless `shadow_rate` says otherwise
+#define SHADOW_RATE 5
+// `shadow_` keys of one config file
+#define SHADOW_KEYS_MAX 8
+
+// Share of auths trying the order that looks worse: at most this much...
+#define PROBE_EXPLORE_MAX 0.1
+// ...and PROBE_EXPLORE_SCALE / auths once there is history
+#define PROBE_EXPLORE_SCALE 10.0
 
 #define UNUSED __attribute__ ((unused))
+// entry points stay exported when building with -fvisibility=hidden
+#define PAM_VISIBLE __attribute__ ((visibility ("default")))
 
 typedef struct {
   bdaddr_t device_addr;
+  int dev_id;  // local HCI adapter, -1 for the default route
   int request_update;
   int check_trusted;
   int min_strength;
+  int page_timeout;  // ms the controller pages for while probing, 0 leaves it alone
+  int presence_max_age;  // s a pam_bluetoothd sighting stays valid, 0 ignores the daemon
+  int probe_order;       // one of PROBE_ORDER_*
+  int shadow_budget;     // ms a candidate configuration may run for, 0 runs none
+  int shadow_rate;       // percent of auths running the candidate
+  bool shadow;           // candidate of a shadow run, leaves controller settings alone
+  bool paged;            // a page of the probes was answered, its link stays up a while
+  uint64_t deadline_us;  // `monotonic_us` the probes must be done by, 0 for no limit
 } bt_config_t;
 
+// Which radio probe runs first
+enum {
+  PROBE_ORDER_AUTO = 0,  // learned from the statistics, see `choose_first_probe`
+  PROBE_ORDER_CONNECTED = 1,
+  PROBE_ORDER_PAGE = 2,
+};
+
+static uint64_t monotonic_us (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Number in [0, 1); no need for a good generator, only for not following a pattern of auths
+static double coin_flip (void) {
+  return (z3_mix64 (monotonic_us ()) >> 11) * 0x1p-53;
+}
+
+// Keys of the shadow run itself rather than of its candidate
+static bool shadow_setting (StrView key) {
+  return z3_sv_eq (key, Z3_SV ("shadow_budget")) || z3_sv_eq (key, Z3_SV ("shadow_rate"));
+}
+
+// Whether the probes of `config` used up their time
+static bool out_of_time (const bt_config_t *config) {
+  return config->deadline_us && monotonic_us () >= config->deadline_us;
+}
+
+// A wait of `ms` cut to what is left before the deadline, at least 1 ms
+// 0 stands for the controller default, it becomes the time left as well
+static int wait_ms (const bt_config_t *config, int ms) {
+  if (!config->deadline_us) return ms;
+
+  uint64_t now = monotonic_us ();
+  int left = now < config->deadline_us ? (int)((config->deadline_us - now + 999) / 1000) : 1;
+  return ms > 0 && ms < left ? ms : left;
+}
+
 #define AUTO_CLOSE __attribute__ ((cleanup (close_fd)))
 static void close_fd (int *fd) {
+  // keep the errno of whatever failed before the cleanup
+  int saved = errno;
   if (*fd >= 0) close (*fd);
+  errno = saved;
 }
 
-#define AUTO_FREE __attribute__ ((cleanup (auto_free)))
-static void auto_free (char **ptr) {
-  if (*ptr) {
-    free (*ptr);
-    *ptr = NULL;
-  }
-}
-
-// Returns 1 if key-value pair found, 0 if end of buffer, -1 on error
-static int parse_next_kv (
-    const char *fbuffer,
-    int read_res,
-    int *pos,
-    size_t *line,
-    char *key,
-    size_t *key_len,
-    char *value,
-    size_t *value_len,
-    pam_handle_t *pamh
+// Applies one `key = value` line to `config`
+// Returns 1 when set, 0 for an invalid value, -1 for an unknown key (all logged)
+static int set_config_key (
+    pam_handle_t *pamh, bt_config_t *config, StrView key, StrView value, size_t line
 ) {
-  while (*pos < read_res) {
-    if (fbuffer[*pos] == ' ') {
-      (*pos)++;
-      while (*pos < read_res && fbuffer[*pos] == ' ') (*pos)++;
-      continue;
-    }
+  long number;
 
-    if (fbuffer[*pos] == '\n') {
-      (*pos)++;
-      while (*pos < read_res && fbuffer[*pos] == '\n') {
-        (*pos)++;
-        (*line)++;
-      }
-      continue;
+  if (z3_sv_eq (key, Z3_SV ("device"))) {
+    if (!z3_bdaddr_parse (value.ptr, value.len, config->device_addr.b)) {
+      pam_syslog (pamh, LOG_ERR, "Invalid MAC address line %zu: %s", line, value.ptr);
+      return 0;
     }
-
-    if (fbuffer[*pos] == '#') {
-      (*pos)++;
-      while (*pos < read_res && fbuffer[*pos] != '\n') (*pos)++;
-      if (*pos < read_res) (*pos)++;
-      (*line)++;
-      continue;
+  } else if (z3_sv_eq (key, Z3_SV ("adapter"))) {
+    // accepts `hciN` or the adapter MAC address
+    int dev_id = bt_devid (value.ptr);
+    if (dev_id < 0) {
+      pam_syslog (pamh, LOG_ERR, "Unknown Bluetooth adapter line %zu: %s", line, value.ptr);
+      return 0;
     }
-
-    // key
-    size_t n = 0;
-    while (*pos < read_res && n < MAX_ITEM_LEN && fbuffer[*pos] != '=' &&
-           fbuffer[*pos] != '\n' && fbuffer[*pos] != ' ') {
-      key[n++] = fbuffer[(*pos)++];
+    config->dev_id = dev_id;
+  } else if (z3_sv_eq (key, Z3_SV ("request_update"))) {
+    if (!z3_sv_to_long (value, &number)) {
+      pam_syslog (pamh, LOG_ERR, "Expected a number on line %zu: %s", line, value.ptr);
+      return 0;
     }
-    key[n] = '\0';
-    *key_len = n;
-
-    // spaces before '='
-    while (*pos < read_res && fbuffer[*pos] == ' ') (*pos)++;
-
-    if (fbuffer[*pos] != '=') {
-      pam_syslog (pamh, LOG_ERR, "Expected '=' after key: %s:%zu", CONFIG_FILE, *line);
-      return -1;
+    config->request_update = number != 0;
+  } else if (z3_sv_eq (key, Z3_SV ("check_trusted"))) {
+    if (!z3_sv_to_long (value, &number)) {
+      pam_syslog (pamh, LOG_ERR, "Expected a number on line %zu: %s", line, value.ptr);
+      return 0;
     }
-    (*pos)++;
-
-    // spaces after '='
-    while (*pos < read_res && fbuffer[*pos] == ' ') (*pos)++;
-
-    // value
-    n = 0;
-    while (*pos < read_res && n < MAX_ITEM_LEN && fbuffer[*pos] != '\n') {
-      value[n++] = fbuffer[(*pos)++];
+    config->check_trusted = number != 0;
+  } else if (z3_sv_eq (key, Z3_SV ("min_strength"))) {
+    // either user wrote 0, or NaN
+    if (!z3_sv_to_long (value, &number) || number == 0 || number < -128 || number > 128) {
+      pam_syslog (
+          pamh, LOG_ERR, "Signal strength must be negative, on line %zu: %s", line, value.ptr
+      );
+      return 0;
     }
-    value[n] = '\0';
 
-    // trailing spaces from value
-    while (n > 0 && value[n - 1] == ' ') {
-      value[--n] = '\0';
+    config->min_strength = number < 0 ? number : -number;  // ensure negative
+  } else if (z3_sv_eq (key, Z3_SV ("page_timeout"))) {
+    // 0.625 ms slots on the wire, up to 0xFFFF of them
+    if (!z3_sv_to_long (value, &number) || number < 0 || number > 40959) {
+      pam_syslog (
+          pamh, LOG_ERR, "Page timeout must be 0 to 40959 ms, on line %zu: %s", line, value.ptr
+      );
+      return 0;
     }
-
-    // surrounding double quotes
-    if (n >= 2 && value[0] == '"' && value[n - 1] == '"') {
-      memmove (value, value + 1, n - 2);
-      value[n - 2] = '\0';
-      n -= 2;
+    config->page_timeout = number;
+  } else if (z3_sv_eq (key, Z3_SV ("presence_max_age"))) {
+    if (!z3_sv_to_long (value, &number) || number < 0 || number > 86400) {
+      pam_syslog (
+          pamh, LOG_ERR, "Presence age must be 0 to 86400 s, on line %zu: %s", line, value.ptr
+      );
+      return 0;
     }
-    *value_len = n;
-
-    (*pos)++;  // newline
-    return 1;
+    config->presence_max_age = number;
+  } else if (z3_sv_eq (key, Z3_SV ("probe_order"))) {
+    if (z3_sv_eq (value, Z3_SV ("auto"))) {
+      config->probe_order = PROBE_ORDER_AUTO;
+    } else if (z3_sv_eq (value, Z3_SV ("connected"))) {
+      config->probe_order = PROBE_ORDER_CONNECTED;
+    } else if (z3_sv_eq (value, Z3_SV ("page"))) {
+      config->probe_order = PROBE_ORDER_PAGE;
+    } else {
+      pam_syslog (
+          pamh, LOG_ERR, "Probe order must be auto, connected or page, on line %zu: %s", line,
+          value.ptr
+      );
+      return 0;
+    }
+  } else if (z3_sv_eq (key, Z3_SV ("shadow_budget"))) {
+    if (!z3_sv_to_long (value, &number) || number < 0 || number > 10000) {
+      pam_syslog (
+          pamh, LOG_ERR, "Shadow budget must be 0 to 10000 ms, on line %zu: %s", line, value.ptr
+      );
+      return 0;
+    }
+    config->shadow_budget = number;
+  } else if (z3_sv_eq (key, Z3_SV ("shadow_rate"))) {
+    if (!z3_sv_to_long (value, &number) || number < 0 || number > 100) {
+      pam_syslog (
+          pamh, LOG_ERR, "Shadow rate must be 0 to 100 %%, on line %zu: %s", line, value.ptr
+      );
+      return 0;
+    }
+    config->shadow_rate = number;
+  } else {
+    pam_syslog (
+        pamh, LOG_WARNING, "Unknown config key on line %zu: %.*s", line, (int)key.len, key.ptr
+    );
+    return -1;
   }
 
-  return 0;
+  return 1;
 }
 
-static int read_config (pam_handle_t *pamh, bt_config_t *config) {
-  AUTO_CLOSE int file = open (CONFIG_FILE, O_RDONLY);
-  if (file == -1) {
-    pam_syslog (pamh, LOG_ERR, "Cannot open config file: %s", CONFIG_FILE);
-    return -1;
-  }
-
-  char device_str[18] = {0};  // MAC address string + `\0`
+// Reads `config`, and into `shadow` the candidate its `shadow_` keys describe: the same
+// configuration with those keys changed. No candidate runs when `shadow_budget` or
+// `shadow_rate` is 0.
+static int read_config (
+    pam_handle_t *pamh, const char *config_file, bt_config_t *config, bt_config_t *shadow
+) {
   int found_device = 0, found_strength = 0;
+  StrView shadow_keys[SHADOW_KEYS_MAX], shadow_values[SHADOW_KEYS_MAX];
+  size_t shadow_lines[SHADOW_KEYS_MAX], shadow_count = 0;
 
-  AUTO_FREE char *fbuffer = malloc (SYSCALL_MAX_BYTES_READ);
-  if (!fbuffer) {
-    pam_syslog (pamh, LOG_ERR, "Memory allocation failed");
-    return -1;
-  }
-
-  int read_res = read (file, fbuffer, SYSCALL_MAX_BYTES_READ);
+  // spare byte lets the parser terminate the last value in place
+  char fbuffer[SYSCALL_MAX_BYTES_READ + 1];
+  int read_res = kv_read_file (config_file, fbuffer, SYSCALL_MAX_BYTES_READ);
 
   if (read_res == -1) {
-    pam_syslog (pamh, LOG_ERR, "Could not read config file: %s", CONFIG_FILE);
+    pam_syslog (pamh, LOG_ERR, "Cannot read config file %s: %m", config_file);
     return -1;
   }
 
   if (read_res == 0) {
-    pam_syslog (pamh, LOG_ERR, "Config file empty, required `device` field: %s", CONFIG_FILE);
+    pam_syslog (pamh, LOG_ERR, "Config file empty, required `device` field: %s", config_file);
     return -1;
   }
 
@@ -161,44 +252,49 @@ static int read_config (pam_handle_t *pamh, bt_config_t *config) {
   config->request_update = 0;
   // Do not scan for paired devices around this device
   config->check_trusted = 0;
-
-  int pos = 0;
-  size_t line = 0;
-  char key[MAX_ITEM_LEN], value[MAX_ITEM_LEN];
-  size_t key_len, value_len;
+  // use whatever adapter BlueZ routes to by default
+  config->dev_id = -1;
+  // keep the page timeout of the controller
+  config->page_timeout = 0;
+  // do not look at what pam_bluetoothd saw
+  config->presence_max_age = 0;
+  // let past auths decide
+  config->probe_order = PROBE_ORDER_AUTO;
+  // only spent when there are `shadow_` keys
+  config->shadow_budget = SHADOW_BUDGET_MS;
+  config->shadow_rate = SHADOW_RATE;
+  // the real decision takes as long as it takes
+  config->deadline_us = 0;
+  config->shadow = false;
+  config->paged = false;
+
+  kv_parser_t parser = kv_parser (fbuffer, read_res);
+  StrView key, value;
 
   int parse_result;
-  while ((parse_result = parse_next_kv (
-              fbuffer, read_res, &pos, &line, key, &key_len, value, &value_len, pamh
-          )) > 0) {
-    if (strncmp (key, "device", 6) == 0) {
-      strncpy (device_str, value, sizeof (device_str) - 1);
-
-      if (str2ba (device_str, &config->device_addr) != 0) {
-        pam_syslog (pamh, LOG_ERR, "Invalid MAC address line %zu: %s", line, value);
-      } else {
-        found_device = 1;
-      }
-    } else if (strncmp (key, "request_update", 14) == 0) {
-      config->request_update = abs (atoi (value));
-    } else if (strncmp (key, "check_trusted", 13) == 0) {
-      config->check_trusted = abs (atoi (value));
-    } else if (strncmp (key, "min_strength", 12) == 0) {
-      int8_t strength = -abs (atoi (value));  // ensure negative
-
-      // either user wrote 0, or NaN
-      if (strength == 0) {
-        pam_syslog (
-            pamh, LOG_ERR, "Signal strength must be negative, on line %zu: %s", line, key
-        );
+  while ((parse_result = kv_next (&parser, &key, &value)) > 0) {
+    size_t line = parser.line;
+
+    if (z3_sv_starts (key, Z3_SV ("shadow_")) && !shadow_setting (key)) {
+      // applied once the real configuration is complete
+      if (shadow_count == SHADOW_KEYS_MAX) {
+        pam_syslog (pamh, LOG_WARNING, "Too many shadow keys, ignored line %zu", line);
         continue;
       }
-
-      config->min_strength = strength;
-      found_strength = 1;
-    } else {
-      pam_syslog (pamh, LOG_WARNING, "Unknown config key on line %zu: %s", line, key);
+      shadow_keys[shadow_count] = (StrView){key.ptr + 7, key.len - 7};
+      shadow_values[shadow_count] = value;
+      shadow_lines[shadow_count++] = line;
+      continue;
     }
+
+    if (set_config_key (pamh, config, key, value, line) <= 0) continue;
+    if (z3_sv_eq (key, Z3_SV ("device"))) found_device = 1;
+    if (z3_sv_eq (key, Z3_SV ("min_strength"))) found_strength = 1;
+  }
+
+  if (parse_result < 0) {
+    pam_syslog (pamh, LOG_ERR, "Expected '=' after key: %s:%zu", config_file, parser.line);
+    return -1;
   }
 
   if (!found_device) {
@@ -211,6 +307,22 @@ static int read_config (pam_handle_t *pamh, bt_config_t *config) {
     return -1;
   }
 
+  // values stay in `fbuffer`, terminated in place
+  *shadow = *config;
+  shadow->shadow = true;
+  size_t shadow_set = 0;
+  for (size_t i = 0; i < shadow_count; i++) {
+    // another device would answer another question
+    if (z3_sv_eq (shadow_keys[i], Z3_SV ("device")) || shadow_setting (shadow_keys[i])) {
+      pam_syslog (pamh, LOG_WARNING, "Key cannot be shadowed, line %zu", shadow_lines[i]);
+      continue;
+    }
+    if (set_config_key (pamh, shadow, shadow_keys[i], shadow_values[i], shadow_lines[i]) > 0) {
+      shadow_set++;
+    }
+  }
+  if (shadow_set == 0 || config->shadow_rate == 0) config->shadow_budget = 0;
+
   pam_syslog (pamh, LOG_DEBUG, "Config loaded successfully!");
 
   return 0;
@@ -218,145 +330,254 @@ static int read_config (pam_handle_t *pamh, bt_config_t *config) {
 
 // Returns 1 if device is trusted, 0 if not trusted or file doesn't exist, -1 on error
 static int is_device_trusted (
-    pam_handle_t *pamh, const char *device_mac, const char *gadget_mac
+    pam_handle_t *pamh, const Z3Allocator *alloc, const char *device_mac, const char *gadget_mac
 ) {
-  if (getuid() != 1) {
-    pam_syslog (pamh, LOG_WARNING, "Cannot open Bluetooth info file without root, assuming untrusted");
-    return 0;
+  ScopedString infof_path = z3_concat (
+      alloc, Z3_SV ("/var/lib/bluetooth/"), z3_svl (device_mac, Z3_BDADDR_STRLEN), Z3_SV ("/"),
+      z3_svl (gadget_mac, Z3_BDADDR_STRLEN), Z3_SV ("/info")
+  );
+
+  const char *info_file = z3_chr (&infof_path);
+  if (!info_file) {
+    pam_syslog (pamh, LOG_ERR, "Memory allocation failed");
+    return -1;
   }
 
-  ScopedString infof_path = z3_str (128);
-  z3_pushl (&infof_path, "/var/lib/bluetooth/", 19);
-  z3_pushl (&infof_path, device_mac, 17);
-  z3_pushc (&infof_path, '/');
-  z3_pushl (&infof_path, gadget_mac, 17);
-  z3_pushl (&infof_path, "/info", 5);
+  // spare byte lets the parser terminate the last value in place
+  char fbuffer[SYSCALL_MAX_BYTES_READ + 1];
+  int read_res = kv_read_file (info_file, fbuffer, SYSCALL_MAX_BYTES_READ);
 
-  AUTO_CLOSE int file = open (infof_path.chr, O_RDONLY);
-  if (file == -1) {
-    pam_syslog (pamh, LOG_ERR, "Cannot open bluetooth info file: %s", infof_path.chr);
+  if (read_res == -1 && errno == EACCES) {
+    pam_syslog (
+        pamh, LOG_WARNING, "Cannot open Bluetooth info file without root, assuming untrusted"
+    );
     return 0;
   }
 
-  AUTO_FREE char *fbuffer = malloc (SYSCALL_MAX_BYTES_READ);
-  if (!fbuffer) {
-    pam_syslog (pamh, LOG_ERR, "Memory allocation failed");
-    return -1;
+  if (read_res == -1) {
+    pam_syslog (pamh, LOG_ERR, "Cannot open bluetooth info file %s: %m", info_file);
+    return 0;
   }
 
-  int read_res = read (file, fbuffer, SYSCALL_MAX_BYTES_READ);
-  if (read_res <= 0) {
-    pam_syslog (pamh, LOG_DEBUG, "Could not read bluetooth info file: %s", infof_path.chr);
+  if (read_res == 0) {
+    pam_syslog (pamh, LOG_DEBUG, "Bluetooth info file empty: %s", info_file);
     return 0;
   }
 
-  int pos = 0;
-  size_t line = 0;
-  char key[MAX_ITEM_LEN], value[MAX_ITEM_LEN];
-  size_t key_len, value_len;
+  kv_parser_t parser = kv_parser (fbuffer, read_res);
+  StrView key, value;
 
   int parse_result;
-  while ((parse_result = parse_next_kv (
-              fbuffer, read_res, &pos, &line, key, &key_len, value, &value_len, pamh
-          )) > 0) {
-    if (strncmp (key, "Trusted", 7) == 0) {
-      if (strncmp (value, "true", 4) == 0) {
-        return 1;
-      } else {
-        return 0;
-      }
+  while ((parse_result = kv_next (&parser, &key, &value)) > 0) {
+    if (z3_sv_eq (key, Z3_SV ("Trusted"))) {
+      return z3_sv_eq (value, Z3_SV ("true"));
     }
   }
 
   if (parse_result < 0) {
-    pam_syslog (pamh, LOG_ERR, "Parse error in bluetooth info file: %s", infof_path.chr);
+    pam_syslog (pamh, LOG_ERR, "Expected '=' after key: %s:%zu", info_file, parser.line);
     return -1;
   }
 
   return 0;
 }
 
-int8_t dev_get_rssi (pam_handle_t *pamh, int dev_id, uint16_t handle) {
-  AUTO_CLOSE int sock = hci_open_dev (dev_id);
+// RSSI the controller last measured on a link, 0 if it cannot be read
+int8_t dev_get_rssi (pam_handle_t *pamh, int dev_id, uint16_t handle, int timeout) {
+  AUTO_CLOSE int sock = bt_open_dev (dev_id);
   if (sock < 0) {
-    pam_syslog (pamh, LOG_ERR, "Device (handle: %d) hci_open_dev failed", handle);
-    return -1;
+    pam_syslog (pamh, LOG_ERR, "Device (handle: %d) bt_open_dev failed", handle);
+    return 0;
   }
 
   int8_t rssi;
-  int err = hci_read_rssi (sock, handle, &rssi, 1000);
+  int err = bt_read_rssi (sock, handle, &rssi, timeout);
   if (err < 0) {
-    pam_syslog (pamh, LOG_ERR, "Device (handle: %d) hci_read_rssi failed", handle);
-    return -1;
+    pam_syslog (pamh, LOG_ERR, "Device (handle: %d) bt_read_rssi failed", handle);
+    return 0;
   }
 
   return rssi;
 }
 
-int8_t get_fresh_rssi (pam_handle_t *pamh, int hci_sock, uint16_t handle) {
-  struct hci_request rq;
+int8_t get_fresh_rssi (pam_handle_t *pamh, int hci_sock, uint16_t handle, int timeout) {
   read_rssi_rp rp;
   uint16_t cmd_handle = htobs (handle);
 
-  memset (&rq, 0, sizeof (rq));
-  rq.ogf = OGF_STATUS_PARAM;
-  rq.ocf = OCF_READ_RSSI;
-  rq.cparam = &cmd_handle;
-  rq.clen = sizeof (cmd_handle);
-  rq.rparam = &rp;
-  rq.rlen = READ_RSSI_RP_SIZE;
-
-  if (hci_send_req (hci_sock, &rq, 1000) < 0) {
-    pam_syslog (pamh, LOG_ERR, "Device (handle: %d) hci_send_req failed", handle);
+  bt_request_t rq = {
+      .ogf = OGF_STATUS_PARAM,
+      .ocf = OCF_READ_RSSI,
+      .cparam = &cmd_handle,
+      .clen = sizeof (cmd_handle),
+      .rparam = &rp,
+      .rlen = READ_RSSI_RP_SIZE,
+  };
+
+  if (bt_send_req (hci_sock, &rq, timeout) < 0) {
+    pam_syslog (pamh, LOG_ERR, "Device (handle: %d) bt_send_req failed", handle);
     return 0;
   }
 
-  if (rp.status != 0) {
-    pam_syslog (pamh, LOG_ERR, "Device (handle: %d) hci_send_req status failure", handle);
+  if (rq.rlen < READ_RSSI_RP_SIZE || rp.status != 0) {
+    pam_syslog (pamh, LOG_ERR, "Device (handle: %d) bt_send_req status failure", handle);
     return 0;
   }
 
   return rp.rssi;
 }
 
+// Read RSSI on a link in sniff mode answers at the next anchor point with what was
+// measured at the last one. Such a link is made active for a short burst of samples,
+// then handed back to sniff mode. It gets the intervals of the kernel idle timer, not
+// the ones the phone negotiated: no command reads the sniff parameters of a link, and
+// the Mode Change answering Exit Sniff Mode reports active mode, with no interval. The
+// phone may ask for its own again. LE links have no sniff mode; waking a BR/EDR link
+// needs CAP_NET_RAW, without it we settle for a single sample. A shadow candidate
+// always does, the link of the user is not its to change.
+static int8_t sample_link_rssi (
+    pam_handle_t *pamh,
+    int hci_sock,
+    const struct hci_conn_info *conn,
+    const bt_config_t *config
+) {
+  int woken = 0;
+  if (conn->type == ACL_LINK && !config->shadow) {
+    int timeout = wait_ms (config, SNIFF_EXIT_TIMEOUT_MS);
+    woken = bt_exit_sniff_mode (hci_sock, conn->handle, timeout);
+    if (woken < 0) pam_syslog (pamh, LOG_DEBUG, "Cannot take link out of sniff mode: %m");
+  }
+
+  if (woken <= 0) return get_fresh_rssi (pamh, hci_sock, conn->handle, wait_ms (config, 1000));
+
+  int8_t samples[RSSI_BURST];
+  int count = 0;
+  for (int i = 0; i < RSSI_BURST; i++) {
+    // let the controller measure a few more packets
+    if (i > 0) {
+      int gap_ms = wait_ms (config, RSSI_BURST_GAP_MS);
+      nanosleep (&(struct timespec){.tv_nsec = gap_ms * 1000000L}, NULL);
+    }
+
+    int8_t rssi = get_fresh_rssi (pamh, hci_sock, conn->handle, wait_ms (config, 1000));
+    if (rssi == 0) continue;
+
+    // insertion sort, for the median
+    int j = count++;
+    for (; j > 0 && samples[j - 1] > rssi; j--) samples[j] = samples[j - 1];
+    samples[j] = rssi;
+  }
+
+  // the phone chose sniff mode to save power, it may still refuse to go back; its own
+  // intervals are lost, these are the ones the kernel asks for on an idle link
+  int restore_ms = wait_ms (config, 100);
+  if (bt_sniff_mode (
+          hci_sock, conn->handle, SNIFF_MAX_INTERVAL, SNIFF_MIN_INTERVAL, restore_ms
+      ) < 0) {
+    pam_syslog (pamh, LOG_DEBUG, "Could not put link back into sniff mode: %m");
+  }
+
+  pam_syslog (pamh, LOG_DEBUG, "Link was in sniff mode, %d samples while active", count);
+  return count ? samples[count / 2] : 0;
+}
+
+// Sets the controller page timeout for one probe
+// Returns true if the controller uses it, then `saved` is the value to restore, or 0
+// if the controller already had it
+static bool tune_page_timeout (
+    pam_handle_t *pamh, int hci_sock, int page_timeout, uint16_t *saved
+) {
+  uint16_t slots = page_timeout * 8 / 5;
+  if (slots == 0) slots = 1;
+  *saved = 0;
+
+  uint16_t current;
+  if (bt_read_page_timeout (hci_sock, &current, 100) < 0) {
+    pam_syslog (pamh, LOG_DEBUG, "Cannot read page timeout, keeping it: %m");
+    return false;
+  }
+
+  if (current == slots) return true;
+
+  // usually needs CAP_NET_ADMIN, a plain user keeps the controller default
+  if (bt_write_page_timeout (hci_sock, slots, 100) < 0) {
+    pam_syslog (pamh, LOG_DEBUG, "Cannot set page timeout, keeping it: %m");
+    return false;
+  }
+
+  *saved = current;
+  return true;
+}
+
 static bool check_paired_device_proximity (
-    pam_handle_t *pamh, int hci_sock, bdaddr_t *target_addr, int8_t min_strength
+    pam_handle_t *pamh, int hci_sock, bdaddr_t *target_addr, bt_config_t *config, int8_t *out
 ) {
   char name[248];
   int8_t rssi;
 
+  uint16_t saved_slots = 0;
+  int name_timeout = wait_ms (config, 500);
+  if (config->page_timeout > 0) {
+    int page_timeout = wait_ms (config, config->page_timeout);
+    // a candidate must not change what the real probes and other users get, it only
+    // stops waiting when its page timeout would have run out
+    bool in_effect = config->shadow
+                  || tune_page_timeout (pamh, hci_sock, page_timeout, &saved_slots);
+    // the controller gives up on its own, wait for its answer
+    if (in_effect) name_timeout = page_timeout + 100;
+  }
+
   // this establishes temporary connection
-  if (hci_read_remote_name_with_clock_offset (
-          hci_sock, target_addr, 0x02, 0, sizeof (name), name, 500
-      ) < 0) {
+  int name_res = bt_read_remote_name (
+      hci_sock, target_addr, 0x02, 0, sizeof (name), name, name_timeout
+  );
+
+  // the setting is controller wide, never leave it behind for other users
+  if (saved_slots && bt_write_page_timeout (hci_sock, saved_slots, 100) < 0) {
+    pam_syslog (pamh, LOG_WARNING, "Could not restore page timeout: %m");
+  }
+
+  if (name_res < 0) {
     pam_syslog (pamh, LOG_DEBUG, "Device not reachable or powered off");
     return false;
   }
+  config->paged = true;
 
-  if (hci_read_rssi (hci_sock, 0, &rssi, 100) == 0) {
-    char addr_str[18];
-    ba2str (target_addr, addr_str);
+  // the answer came over a link, a temporary one or a connection the device already had
+  uint16_t handle;
+  if ((bt_conn_handle (hci_sock, target_addr, ACL_LINK, &handle) == 0 ||
+       bt_conn_handle (hci_sock, target_addr, LE_LINK, &handle) == 0) &&
+      bt_read_rssi (hci_sock, handle, &rssi, 100) == 0) {
+    char addr_str[Z3_BDADDR_STRLEN + 1];
+    z3_bdaddr_format (target_addr->b, addr_str);
     pam_syslog (pamh, LOG_DEBUG, "Paired device %s nearby with RSSI: %d dBm", addr_str, rssi);
 
-    return (rssi >= min_strength);
+    *out = rssi;
+    return (rssi >= config->min_strength);
   }
 
-  // RSSI read fails but name read succeeded, consider device is nearby
-  pam_syslog (pamh, LOG_DEBUG, "Paired device nearby (no RSSI available)");
-  return true;
+  // an answer without a signal strength cannot pass `min_strength`, the connection
+  // check gets its say
+  pam_syslog (pamh, LOG_DEBUG, "Paired device answered, but no RSSI available: %m");
+  return false;
 }
 
 static bool check_paired_device (
-    pam_handle_t *pamh, bt_config_t *config, int hci_sock, char *bt_adapter_addrs
+    pam_handle_t *pamh,
+    const Z3Allocator *alloc,
+    bt_config_t *config,
+    int hci_sock,
+    char *bt_adapter_addrs,
+    bt_stats_t *stats,
+    const bdaddr_t *local_addr
 ) {
   pam_syslog (pamh, LOG_DEBUG, "Checking for nearby paired Bluetooth device...");
 
   // First check if device is trusted (if check_trusted is enabled)
   if (config->check_trusted) {
-    char addr_str[18];
-    ba2str (&config->device_addr, addr_str);
+    char addr_str[Z3_BDADDR_STRLEN + 1];
+    z3_bdaddr_format (config->device_addr.b, addr_str);
 
-    int trust_result = is_device_trusted (pamh, bt_adapter_addrs, addr_str);
+    int trust_result = is_device_trusted (pamh, alloc, bt_adapter_addrs, addr_str);
     if (trust_result < 0) {
       pam_syslog (pamh, LOG_ERR, "Error checking trust status");
       return false;
@@ -370,63 +591,71 @@ static bool check_paired_device (
     pam_syslog (pamh, LOG_DEBUG, "Device is trusted, checking proximity...");
   }
 
+  uint64_t start = monotonic_us ();
+  int8_t rssi = BT_STATS_NO_RSSI;
   bool proximity_result = check_paired_device_proximity (
-      pamh, hci_sock, &config->device_addr, config->min_strength
+      pamh, hci_sock, &config->device_addr, config, &rssi
   );
 
+  bt_stats_record (
+      stats, local_addr, &config->device_addr, BT_PROBE_PAGE, proximity_result, rssi,
+      monotonic_us () - start
+  );
   return proximity_result;
 }
 
 static int check_connected_device (
-    pam_handle_t *pamh, bt_config_t *config, int dev_id, int hci_sock
+    pam_handle_t *pamh, bt_config_t *config, int dev_id, int hci_sock, int8_t *out
 ) {
   pam_syslog (pamh, LOG_DEBUG, "Checking for connected Bluetooth devices...");
 
-  struct hci_conn_list_req *conn_list;
-  struct hci_conn_info *conn_info;
-
-  conn_list = malloc (sizeof (*conn_list) + MAX_DEVICES_LOOKDUP * sizeof (*conn_info));
-  if (!conn_list) {
-    pam_syslog (pamh, LOG_ERR, "Memory allocation failed");
-    return -1;
-  }
+  // request header followed by room for the replies, on the stack
+  alignas (struct hci_conn_list_req) char conn_buf[
+      sizeof (struct hci_conn_list_req) + MAX_DEVICES_LOOKDUP * sizeof (struct hci_conn_info)
+  ];
+  struct hci_conn_list_req *conn_list = (struct hci_conn_list_req *)conn_buf;
+  struct hci_conn_info *conn_info = conn_list->conn_info;
 
   conn_list->dev_id = dev_id;
   conn_list->conn_num = MAX_DEVICES_LOOKDUP;
-  conn_info = conn_list->conn_info;
 
   int get_con_res = ioctl (hci_sock, HCIGETCONNLIST, conn_list);
   if (get_con_res < 0) {
     pam_syslog (pamh, LOG_ERR, "Failed to get connection list");
-    free (conn_list);
     return 0;
   }
 
   pam_syslog (pamh, LOG_DEBUG, "Found %d connected devices", conn_list->conn_num);
 
   if (conn_list->conn_num == 0) {
-    free (conn_list);
     return 0;
   }
 
-
   // check each connected device
-  char addr_str[18];
+  char addr_str[Z3_BDADDR_STRLEN + 1];
   for (int i = 0; i < conn_list->conn_num; i++) {
-    ba2str (&conn_info[i].bdaddr, addr_str);
+    // audio links of the same device have no RSSI of their own
+    if (conn_info[i].type != ACL_LINK && conn_info[i].type != LE_LINK) continue;
+
+    if (bt_addr_cmp (&conn_info[i].bdaddr, &config->device_addr) == 0) {
+      z3_bdaddr_format (conn_info[i].bdaddr.b, addr_str);
 
-    if (bacmp (&conn_info[i].bdaddr, &config->device_addr) == 0) {
       int8_t rssi = (config->request_update)
-                      ? get_fresh_rssi (pamh, hci_sock, conn_info[i].handle)
-                      : dev_get_rssi (pamh, conn_list->dev_id, conn_info[i].handle);
+                      ? sample_link_rssi (pamh, hci_sock, &conn_info[i], config)
+                      : dev_get_rssi (
+                            pamh, conn_list->dev_id, conn_info[i].handle, wait_ms (config, 1000)
+                        );
 
       // Fallback to cache values
-      rssi = rssi != 0 ? rssi : dev_get_rssi (pamh, dev_id, conn_info[i].handle);
+      if (rssi == 0) {
+        rssi = dev_get_rssi (pamh, dev_id, conn_info[i].handle, wait_ms (config, 1000));
+      }
 
       pam_syslog (
           pamh, LOG_DEBUG, "Device %s found with RSSI: %d dBm (need: %d dBm)", addr_str, rssi,
           config->min_strength
       );
+      if (rssi != 0) *out = rssi;
 
       if (rssi == 0) {
         pam_syslog (pamh, LOG_WARNING, "Device signal strength is not valid, ignored");
@@ -441,15 +670,132 @@ static int check_connected_device (
     }
   }
 
-  free (conn_list);
-
   return 0;
 }
 
+// Recent enough and strong enough sighting by pam_bluetoothd, without any radio command
+// Never denies on its own: a miss only means the usual probes run
+static bool check_presence_table (pam_handle_t *pamh, bt_config_t *config, int8_t *out) {
+  bt_presence_t table;
+  if (bt_presence_open (&table, BT_PRESENCE_FILE) < 0) {
+    pam_syslog (pamh, LOG_DEBUG, "No presence table from pam_bluetoothd: %m");
+    return false;
+  }
+
+  bt_sighting_t seen;
+  bool found = bt_presence_lookup (&table, &config->device_addr, &seen);
+  bt_presence_close (&table);
+
+  if (!found) {
+    pam_syslog (pamh, LOG_DEBUG, "Device not seen by pam_bluetoothd yet");
+    return false;
+  }
+
+  // an advertisement proves nothing, any radio nearby can send one with our address
+  if (seen.source == BT_SEEN_ADVERTISING) {
+    pam_syslog (pamh, LOG_DEBUG, "Device only seen advertising, probing it");
+    return false;
+  }
+
+  uint64_t age_ms = bt_presence_now_ms () - seen.at_ms;
+  if (age_ms > (uint64_t)config->presence_max_age * 1000) {
+    unsigned long long age_s = age_ms / 1000;
+    pam_syslog (pamh, LOG_DEBUG, "Device last seen %llu s ago", age_s);
+    return false;
+  }
+
+  // only a current sighting is a sample of the signal
+  *out = seen.rssi;
+
+  if (seen.rssi < config->min_strength) {
+    pam_syslog (pamh, LOG_DEBUG, "Device seen with weak signal: %d dBm", seen.rssi);
+    return false;
+  }
+
+  pam_syslog (
+      pamh, LOG_INFO, "Device seen by pam_bluetoothd %llu ms ago with RSSI: %d dBm",
+      (unsigned long long)age_ms, seen.rssi
+  );
+  return true;
+}
+
+// Expected latency of an auth running `first` then `second`, from recent auths
+static double order_cost (const bt_stats_summary_t *sum, int first, int second) {
+  // a probe that never found the device still might, hence the +1/+2
+  double chance = (sum->recent_found[first] + 1.0) / (sum->recent_attempts[first] + 2.0);
+  return sum->latency_p50_us[first] + (1 - chance) * sum->latency_p50_us[second];
+}
+
+// Epsilon-greedy bandit over the two orders: usually the one with the lowest expected
+// latency, the other one with a probability that shrinks as history grows, so a device
+// that changes habits is noticed and the cost of looking stays bounded. Everything is
+// counted over the stats windows only, so old habits age out and the probability never
+// drops below PROBE_EXPLORE_SCALE / (2 * BT_STATS_WINDOW), the most probes they hold.
+// A probe not tried in the windows goes first once.
+// Without any history (no file, or no root caller ever recorded) it stays connected first.
+static int choose_first_probe (
+    pam_handle_t *pamh, const bt_stats_t *stats, const bdaddr_t *adapter, const bdaddr_t *device
+) {
+  bt_stats_summary_t sum;
+  if (!bt_stats_summary (stats, adapter, device, &sum)) return BT_PROBE_CONNECTED;
+  if (sum.recent_attempts[BT_PROBE_CONNECTED] == 0) return BT_PROBE_CONNECTED;
+  if (sum.recent_attempts[BT_PROBE_PAGE] == 0) return BT_PROBE_PAGE;
+
+  double connected_first = order_cost (&sum, BT_PROBE_CONNECTED, BT_PROBE_PAGE);
+  double page_first = order_cost (&sum, BT_PROBE_PAGE, BT_PROBE_CONNECTED);
+  int best = page_first < connected_first ? BT_PROBE_PAGE : BT_PROBE_CONNECTED;
+
+  double auths = sum.recent_attempts[BT_PROBE_CONNECTED] + sum.recent_attempts[BT_PROBE_PAGE];
+  double explore = PROBE_EXPLORE_SCALE / auths;
+  if (explore > PROBE_EXPLORE_MAX) explore = PROBE_EXPLORE_MAX;
+
+  bool exploring = coin_flip () < explore;
+
+  pam_syslog (
+      pamh, LOG_DEBUG, "Expected latency, connected first: %.0f us, page first: %.0f us%s",
+      connected_first, page_first, exploring ? " (trying the other)" : ""
+  );
+
+  if (!exploring) return best;
+  return best == BT_PROBE_PAGE ? BT_PROBE_CONNECTED : BT_PROBE_PAGE;
+}
+
+// Statistics of past auths, closed with `bt_stats_close`
+// The file is made, migrated and grown by pam_bluetoothd, never from inside the PAM host.
+// Only root may write it; other callers (screen lockers) still read it, so the probe
+// order they use is learned from the auths of root callers.
+static void open_stats (pam_handle_t *pamh, bt_stats_t *stats, const char *stats_file) {
+  if (bt_stats_open (stats, stats_file, true) == 0) return;
+  if (errno == EACCES && bt_stats_open (stats, stats_file, false) == 0) {
+    pam_syslog (pamh, LOG_DEBUG, "Statistics are read only for this caller");
+    return;
+  }
+
+  pam_syslog (pamh, LOG_DEBUG, "Not recording statistics: %m");
+  *stats = (bt_stats_t){.fd = -1};
+}
+
 // bluetooth device signal strength using BlueZ, unlocking if found matching
-static bool check_bluetooth_device (pam_handle_t *pamh, bt_config_t *config) {
-  // default HCI device
-  int dev_id = hci_get_route (NULL);
+static bool check_bluetooth_device (
+    pam_handle_t *pamh, const Z3Allocator *alloc, bt_config_t *config, bt_stats_t *stats
+) {
+  if (config->presence_max_age > 0) {
+    uint64_t start = monotonic_us ();
+    int8_t rssi = BT_STATS_NO_RSSI;
+    bool seen = check_presence_table (pamh, config, &rssi);
+
+    // the table is shared by every adapter, its probes are filed under none
+    if (rssi != BT_STATS_NO_RSSI) {
+      bt_stats_record (
+          stats, &(bdaddr_t){}, &config->device_addr, BT_PROBE_TABLE, seen, rssi,
+          monotonic_us () - start
+      );
+    }
+    if (seen) return true;
+  }
+
+  // configured HCI device, or the default one
+  int dev_id = config->dev_id >= 0 ? config->dev_id : bt_get_route ();
   if (dev_id < 0) {
     pam_syslog (pamh, LOG_ERR, "No Bluetooth adapter found");
     return false;
@@ -463,48 +809,127 @@ static bool check_bluetooth_device (pam_handle_t *pamh, bt_config_t *config) {
   // }
 
   bdaddr_t local_addr;
-  if (hci_devba (dev_id, &local_addr) < 0) {
+  if (bt_devba (dev_id, &local_addr) < 0) {
     pam_syslog (pamh, LOG_ERR, "Could not get local adapter address");
     return false;
   }
 
-  char bt_adapter_addrs[18];
-  int did = ba2str (&local_addr, bt_adapter_addrs);
-  // int did = ba2str (&bt_adapter.bdaddr, bt_adapter_addrs);
-
-  if (did < 0) {
-    pam_syslog (pamh, LOG_ERR, "Failed to get MAC string");
-    return false;
-  }
+  char bt_adapter_addrs[Z3_BDADDR_STRLEN + 1];
+  z3_bdaddr_format (local_addr.b, bt_adapter_addrs);
 
   pam_syslog (pamh, LOG_DEBUG, "Current listener device %s", bt_adapter_addrs);
 
   // HCI socket
-  AUTO_CLOSE int hci_sock = hci_open_dev (dev_id);
+  AUTO_CLOSE int hci_sock = bt_open_dev (dev_id);
   if (hci_sock < 0) {
     pam_syslog (pamh, LOG_ERR, "Cannot open HCI socket");
     return false;
   }
 
-  int conn_is = check_connected_device (pamh, config, dev_id, hci_sock);
-  if (conn_is == 0) return check_paired_device (pamh, config, hci_sock, bt_adapter_addrs);
+  int first = config->probe_order == PROBE_ORDER_PAGE        ? BT_PROBE_PAGE
+              : config->probe_order == PROBE_ORDER_CONNECTED ? BT_PROBE_CONNECTED
+              : choose_first_probe (pamh, stats, &local_addr, &config->device_addr);
+
+  // only the latency depends on the order: a page answered over a connection the device
+  // already had reads the RSSI of that connection, and a miss falls through to it
+  if (first == BT_PROBE_PAGE && !out_of_time (config)) {
+    pam_syslog (pamh, LOG_DEBUG, "Paging before looking at connections");
+    if (check_paired_device (
+            pamh, alloc, config, hci_sock, bt_adapter_addrs, stats, &local_addr
+        )) {
+      return true;
+    }
+  }
+
+  uint64_t start = monotonic_us ();
+  int8_t rssi = BT_STATS_NO_RSSI;
+  int conn_is = check_connected_device (pamh, config, dev_id, hci_sock, &rssi);
+
+  // not being connected counts as a miss, it is what paging first would save
+  bt_stats_record (
+      stats, &local_addr, &config->device_addr, BT_PROBE_CONNECTED, conn_is == 1, rssi,
+      monotonic_us () - start
+  );
+
+  if (conn_is == 0 && first != BT_PROBE_PAGE && !out_of_time (config)) {
+    return check_paired_device (
+        pamh, alloc, config, hci_sock, bt_adapter_addrs, stats, &local_addr
+    );
+  }
 
   return (conn_is == 1);
 }
 
-PAM_EXTERN int pam_sm_authenticate (
+// Decides the auth again with the candidate configuration, for the statistics only. It
+// delays the answer by `shadow_budget` ms at most: every wait of the candidate is cut
+// to its deadline. Only `shadow_rate` percent of auths get here, so across all auths
+// the candidate costs `shadow_budget * shadow_rate / 100` ms each at most on average. The candidate never writes controller settings nor changes a link
+// (see `bt_config_t.shadow`). It runs after the real decision, so when that paged the
+// device, the link left by the page would answer any candidate at once: such auths are
+// only counted, they say nothing about the candidate.
+static void run_shadow (
+    pam_handle_t *pamh,
+    const Z3Allocator *alloc,
+    const bt_config_t *config,
+    bt_config_t *candidate,
+    bt_stats_t *stats,
+    bool real_found,
+    uint64_t real_us
+) {
+  // filed with the probes of the real adapter
+  bdaddr_t adapter = {};
+  int dev_id = config->dev_id >= 0 ? config->dev_id : bt_get_route ();
+  if (dev_id >= 0) bt_devba (dev_id, &adapter);
+
+  if (config->paged) {
+    pam_syslog (pamh, LOG_DEBUG, "Device was paged, no shadow run this time");
+    bt_stats_skip_shadow (stats, &adapter, &config->device_addr);
+    return;
+  }
+
+  // the candidate reads the probe statistics but never adds to them
+  bt_stats_t view = *stats;
+  view.fd = -1;
+
+  uint64_t start = monotonic_us ();
+  candidate->deadline_us = start + (uint64_t)config->shadow_budget * 1000;
+  bool found = check_bluetooth_device (pamh, alloc, candidate, &view);
+  uint64_t end = monotonic_us ();
+  bool expired = end >= candidate->deadline_us;
+
+  pam_syslog (
+      pamh, found == real_found ? LOG_DEBUG : LOG_INFO,
+      "Shadow configuration %s in %llu us%s, real one %s in %llu us",
+      found ? "found" : "missed", (unsigned long long)(end - start),
+      expired ? " (out of time)" : "", real_found ? "found" : "missed",
+      (unsigned long long)real_us
+  );
+
+  bt_stats_record_shadow (
+      stats, &adapter, &config->device_addr, (const bool[2]){real_found, found},
+      (const uint64_t[2]){real_us, end - start}, expired
+  );
+}
+
+PAM_VISIBLE PAM_EXTERN int pam_sm_authenticate (
     pam_handle_t *pamh, int flags UNUSED, int argc, const char **argv
 ) {
-  bt_config_t config;
+  bt_config_t config, shadow;
   int allow_with_password = 0;
+  const char *config_file = CONFIG_FILE;
+  const char *stats_file = BT_STATS_FILE;
 
   for (int i = 0; i < argc; i++) {
     if (strcmp (argv[i], "allow_with_password") == 0) {
       allow_with_password = 1;
+    } else if (strncmp (argv[i], "config=", 7) == 0 && argv[i][7] != '\0') {
+      config_file = argv[i] + 7;
+    } else if (strncmp (argv[i], "stats=", 6) == 0 && argv[i][6] != '\0') {
+      stats_file = argv[i] + 6;
     }
   }
 
-  if (read_config (pamh, &config) != 0) {
+  if (read_config (pamh, config_file, &config, &shadow) != 0) {
     return PAM_AUTH_ERR;
   }
 
@@ -524,8 +949,32 @@ PAM_EXTERN int pam_sm_authenticate (
 
   pam_syslog (pamh, LOG_DEBUG, "Initiating Bluetooth authentication");
 
+  // scratch memory for this auth only, released when we return
+  alignas (max_align_t) char arena_buf[AUTH_ARENA_SIZE];
+  Z3Arena arena;
+  z3_arena_init (&arena, arena_buf, sizeof (arena_buf));
+
+  bt_stats_t stats;
+  open_stats (pamh, &stats, stats_file);
+
+  // drawn before any probe, so what the real probes find cannot choose the sample
+  bool sampled = config.shadow_budget > 0 && coin_flip () * 100 < config.shadow_rate;
+
   // check Bluetooth device
-  if (check_bluetooth_device (pamh, &config)) {
+  uint64_t start = monotonic_us ();
+  bool found = check_bluetooth_device (pamh, &arena.alloc, &config, &stats);
+  uint64_t real_us = monotonic_us () - start;
+
+  // the outcome is settled, the candidate only adds to the statistics; it runs here
+  // rather than in a process of its own, the caller may be threaded and holds the authtok
+  if (sampled) {
+    z3_arena_reset (&arena);
+    run_shadow (pamh, &arena.alloc, &config, &shadow, &stats, found, real_us);
+  }
+
+  bt_stats_close (&stats);
+
+  if (found) {
     pam_syslog (pamh, LOG_DEBUG, "Bluetooth authentication successful");
     return PAM_SUCCESS;
   } else {
@@ -534,7 +983,7 @@ PAM_EXTERN int pam_sm_authenticate (
   }
 }
 
-PAM_EXTERN int pam_sm_setcred (
+PAM_VISIBLE PAM_EXTERN int pam_sm_setcred (
     pam_handle_t *pamh UNUSED, int flags UNUSED, int argc UNUSED, const char **argv UNUSED
 ) {
   return PAM_SUCCESS;
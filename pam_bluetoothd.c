@@ -0,0 +1,1157 @@
+// pam_bluetoothd: background presence tracker for pam_bluetooth.so
+//
+// Keeps the controller in Periodic Inquiry Mode with RSSI reporting, so it
+// looks for discoverable devices on its own, and writes the last sighting of
+// every configured device to the presence table. The module consults that
+// table first (see `presence_max_age`) and only sends radio commands of its
+// own when the device was not seen recently enough.
+//
+// Inquiries keep the radio busy, so they are spaced out by power state: every
+// -m periods right after the lid opens, the system resumes or SIGUSR1 (send
+// it on screen lock), then twice as far apart each time nothing changed, up
+// to -M. The controller runs them on its own while the period holds; when it
+// changes, the daemon leaves periodic inquiry and enters it again with the new
+// period once the next inquiry is due. The controller leaves it while the
+// battery saver is on. Wakeups per hour and the share of time the radio spent
+// in inquiry are logged every hour.
+//
+// With -p it also listens on the monitor channel, picking RSSI values out of
+// traffic other software already causes (Read RSSI replies, inquiry results,
+// LE advertising reports); with -n it runs no inquiry. Anyone can advertise
+// any address, so advertising reports are recorded under a source of their
+// own that the module never unlocks on.
+//
+// With -r it also probes every device on its own timer: Read RSSI when it is
+// connected, a page otherwise, backing off up to -M while it stays away. The
+// timers live in a timer wheel, so thousands of devices cost only the probes
+// that are due; jitter keeps them from lining up, and at most a couple of
+// reads and -c pages are in flight so auths never queue behind the daemon.
+//
+// Usage: pam_bluetoothd [-p] [-n] [-a adapter] [-l length] [-m min] [-M max] [-b percent]
+//                       [-r seconds] [-c pages] [config ...]
+//        pam_bluetoothd -s       (print what the module recorded, see bt_stats.h)
+//        pam_bluetoothd -i [config ...]  (make the file the module records into, and exit)
+
+// mkostemp of bt_stats.h is GNU
+#define _GNU_SOURCE
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/input.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+
+#define Z3_STRING_IMPL
+#define Z3_TOYS_IMPL
+#include "lib/z3_string.h"
+
+#define KV_FILE_IMPL
+#include "lib/kv_file.h"
+
+#define BT_HCI_IMPL
+#include "lib/bt_hci.h"
+
+#define BT_PRESENCE_IMPL
+#include "lib/bt_presence.h"
+
+#define BT_STATS_IMPL
+#include "lib/bt_stats.h"
+
+#define CONFIG_FILE            "/etc/pam_bluetooth.conf"
+#define SYSCALL_MAX_BYTES_READ 8192
+#define MAX_TRACKED_DEVICES    4096
+#define MAX_MONITOR_CONNS      64
+#define MAX_DEVICES_LOOKDUP    20
+#define METRICS_PERIOD_MS      (3600 * 1000)
+// Statistics pairs of a device: an adapter or two, and the presence table
+#define STATS_PAIRS_PER_DEVICE 3
+#define LONG_BITS              (8 * sizeof (long))
+
+// Read RSSI of ours queued in the kernel at once, the rest of the host goes first
+#define PROBE_MAX_READS 2
+// Deadlines of a probe: a reply to Read RSSI, a page at the default page timeout
+#define PROBE_READ_MS 1000
+#define PROBE_PAGE_MS 7000
+// Probe intervals vary by up to 1/PROBE_JITTER either way
+#define PROBE_JITTER 8
+
+typedef struct {
+  const char *adapter;  // `hciN` or address, NULL for the default route
+  uint8_t length;       // inquiry length, 1.28 s units
+  uint16_t min_period;  // between inquiries, 1.28 s units, right after a wake up
+  uint16_t max_period;  // when nothing changes for a while
+  int battery_min;      // % below which a discharging battery pauses inquiries
+  bool inquiry;         // run periodic inquiry on the adapter
+  bool monitor;         // listen to the traffic of other software
+  int probe_period;     // s between probes of each device, 0 for none
+  int max_pages;        // pages in flight at once
+  bdaddr_t devices[MAX_TRACKED_DEVICES];
+  size_t device_count;
+} daemon_config_t;
+
+// Open connection, names the device of a Read RSSI reply seen on the monitor
+typedef struct {
+  uint16_t index;  // adapter
+  uint16_t handle;
+  bdaddr_t addr;
+  bool used;
+} monitor_conn_t;
+
+static monitor_conn_t monitor_conns[MAX_MONITOR_CONNS];
+
+// Periodic inquiry of the controller, and what it cost so far
+typedef struct {
+  uint64_t period_ms;      // from the end of one inquiry to the start of the next
+  uint64_t programmed_ms;  // period the controller runs at, 0 out of periodic inquiry
+  uint64_t min_ms;         // start to start as programmed, the controller picks between
+  uint64_t max_ms;
+  uint64_t started_ms;     // of the last inquiry, estimated unless the daemon started it
+  uint64_t next_ms;        // enter periodic inquiry then, or give up on an Inquiry Complete
+  uint64_t drift_ms;       // boot clock minus monotonic clock, grows across suspend
+  bool paused;             // battery saver
+  bool seen[MAX_TRACKED_DEVICES];  // found by the last inquiry
+  uint64_t wakeups;
+  uint64_t radio_ms;       // spent in inquiry
+  uint64_t probes;         // commands sent to probe a device
+  uint64_t metrics_ms;     // start of the current metrics period
+} scan_sched_t;
+
+// Where the probe of a device stands
+enum {
+  PROBE_IDLE = 0,  // timer armed for the next one
+  PROBE_WAITING,   // due, queued until the controller has room
+  PROBE_READING,   // Read RSSI sent, timer armed for its deadline
+  PROBE_PAGING,    // Remote Name Request sent, same
+};
+
+// Probe schedule of one tracked device
+typedef struct {
+  Z3Timer timer;
+  Z3Link queue;          // waiting or in flight
+  uint32_t interval_ms;  // until the next probe, doubled while the device stays away
+  uint16_t handle;       // connection of the Read RSSI in flight
+  uint8_t state;         // one of PROBE_*
+  bool paged;            // answered a page just now, only its RSSI is missing
+} device_probe_t;
+
+// Probes of every tracked device, `devices` parallel to `daemon_config_t`
+typedef struct {
+  Z3Wheel wheel;   // ticks are boot clock ms
+  Z3Link reads;    // waiting, connected when they became due
+  Z3Link pages;    // waiting, to be paged
+  Z3Link flight;   // sent, matched against the replies
+  int sock;        // own socket: `bt_send_req` on a shared one would eat the replies
+  uint8_t reading;
+  uint8_t paging;
+  uint64_t seed;   // of the jitter
+  device_probe_t devices[MAX_TRACKED_DEVICES];
+} prober_t;
+
+static volatile sig_atomic_t running = 1;
+static volatile sig_atomic_t kicked = 0;
+
+static void stop (int sig) {
+  (void)sig;
+  running = 0;
+}
+
+static void kick (int sig) {
+  (void)sig;
+  kicked = 1;
+}
+
+static void usage (const char *name) {
+  fprintf (
+      stderr,
+      "Usage: %s [-p] [-n] [-a adapter] [-l length] [-m min] [-M max] [-b percent] "
+      "[-r seconds] [-c pages] [config ...]\n"
+      "  -p  also listen to the traffic of other software (monitor channel)\n"
+      "  -n  no periodic inquiry (needs -p or -r)\n"
+      "  -a  adapter, hciN or its address (default: config `adapter`, or the default one)\n"
+      "  -l  inquiry length, 1.28 s units (default: 2)\n"
+      "  -m  time between inquiries after a wake up, 1.28 s units (default: 4)\n"
+      "  -M  longest time between inquiries, 1.28 s units (default: 234)\n"
+      "  -b  pause below this battery charge when unplugged, 0 never (default: 20)\n"
+      "  -r  also probe each device this often, backing off up to -M, 0 never (default: 0)\n"
+      "  -c  pages in flight at once while probing (default: 1)\n"
+      "  -s  print the statistics of past auths and exit\n"
+      "  -i  create, migrate or grow the statistics file of the module and exit\n"
+      "  config files default to " CONFIG_FILE "\n",
+      name
+  );
+}
+
+// Argument of the numeric option `opt`, checked against its field before it is narrowed
+static bool option_value (int opt, const char *arg, long min, long max, long *out) {
+  if (z3_sv_to_long (z3_sv (arg), out) && *out >= min && *out <= max) return true;
+  fprintf (stderr, "-%c must be a number from %ld to %ld, not '%s'\n", opt, min, max, arg);
+  return false;
+}
+
+static void add_device (daemon_config_t *config, const bdaddr_t *addr) {
+  for (size_t i = 0; i < config->device_count; i++) {
+    if (bt_addr_cmp (&config->devices[i], addr) == 0) return;
+  }
+
+  if (config->device_count == MAX_TRACKED_DEVICES) {
+    syslog (LOG_WARNING, "More than %d devices, ignoring the rest", MAX_TRACKED_DEVICES);
+    return;
+  }
+  config->devices[config->device_count++] = *addr;
+}
+
+// Collects `device` (and `adapter`, unless given with -a) from a module config
+static bool read_module_config (const char *path, daemon_config_t *config) {
+  static char fbuffer[SYSCALL_MAX_BYTES_READ + 1];
+  int read_res = kv_read_file (path, fbuffer, SYSCALL_MAX_BYTES_READ);
+  if (read_res < 0) {
+    syslog (LOG_ERR, "Cannot read config file %s: %m", path);
+    return false;
+  }
+
+  kv_parser_t parser = kv_parser (fbuffer, read_res);
+  StrView key, value;
+
+  int parse_result;
+  while ((parse_result = kv_next (&parser, &key, &value)) > 0) {
+    if (z3_sv_eq (key, Z3_SV ("device"))) {
+      bdaddr_t addr;
+      if (z3_bdaddr_parse (value.ptr, value.len, addr.b)) {
+        add_device (config, &addr);
+      } else {
+        syslog (LOG_ERR, "Invalid MAC address: %s:%zu", path, parser.line);
+      }
+    } else if (z3_sv_eq (key, Z3_SV ("adapter")) && !config->adapter) {
+      config->adapter = strdup (value.ptr);
+    }
+  }
+
+  if (parse_result < 0) {
+    syslog (LOG_ERR, "Expected '=' after key: %s:%zu", path, parser.line);
+    return false;
+  }
+
+  return true;
+}
+
+static void conn_add (uint16_t index, uint16_t handle, const uint8_t *addr) {
+  monitor_conn_t *free_slot = NULL;
+  for (size_t i = 0; i < MAX_MONITOR_CONNS; i++) {
+    monitor_conn_t *conn = &monitor_conns[i];
+    if (conn->used && conn->index == index && conn->handle == handle) {
+      free_slot = conn;  // handle reused, the old one was missed
+      break;
+    }
+    if (!conn->used && !free_slot) free_slot = conn;
+  }
+
+  if (!free_slot) return;
+  *free_slot = (monitor_conn_t){.index = index, .handle = handle, .used = true};
+  memcpy (free_slot->addr.b, addr, 6);
+}
+
+static void conn_del (uint16_t index, uint16_t handle) {
+  for (size_t i = 0; i < MAX_MONITOR_CONNS; i++) {
+    monitor_conn_t *conn = &monitor_conns[i];
+    if (conn->used && conn->index == index && conn->handle == handle) conn->used = false;
+  }
+}
+
+static void conn_drop_index (uint16_t index) {
+  for (size_t i = 0; i < MAX_MONITOR_CONNS; i++) {
+    if (monitor_conns[i].index == index) monitor_conns[i].used = false;
+  }
+}
+
+static const bdaddr_t *conn_find (uint16_t index, uint16_t handle) {
+  for (size_t i = 0; i < MAX_MONITOR_CONNS; i++) {
+    const monitor_conn_t *conn = &monitor_conns[i];
+    if (conn->used && conn->index == index && conn->handle == handle) return &conn->addr;
+  }
+  return NULL;
+}
+
+// Connections that were already up when the daemon started
+static void conn_seed (int hci_sock, int dev_id) {
+  alignas (struct hci_conn_list_req) char conn_buf[
+      sizeof (struct hci_conn_list_req) + MAX_DEVICES_LOOKDUP * sizeof (struct hci_conn_info)
+  ];
+  struct hci_conn_list_req *conn_list = (struct hci_conn_list_req *)conn_buf;
+  conn_list->dev_id = dev_id;
+  conn_list->conn_num = MAX_DEVICES_LOOKDUP;
+
+  if (ioctl (hci_sock, HCIGETCONNLIST, conn_list) < 0) {
+    syslog (LOG_WARNING, "Failed to get connection list: %m");
+    return;
+  }
+
+  for (int i = 0; i < conn_list->conn_num; i++) {
+    const struct hci_conn_info *info = &conn_list->conn_info[i];
+    conn_add (dev_id, info->handle, info->bdaddr.b);
+  }
+}
+
+static void record_sighting (
+    bt_presence_t *table, const uint8_t *addr, int8_t rssi, uint8_t source
+) {
+  bdaddr_t device;
+  memcpy (device.b, addr, 6);
+  bt_presence_record (table, &device, rssi, source);
+}
+
+// Advertising address that can be a configured device, a random one never is
+static bool le_public (uint8_t addr_type) {
+  return addr_type == LE_PUBLIC_ADDRESS || addr_type == LE_PUBLIC_IDENTITY;
+}
+
+// LE connections and advertising reports, the latter kept apart as BT_SEEN_ADVERTISING
+static void handle_le_meta (
+    bt_presence_t *table, uint16_t index, const uint8_t *param, size_t plen
+) {
+  if (plen < 2) return;
+  uint8_t subevent = param[0];
+
+  if (subevent == EVT_LE_CONN_COMPLETE || subevent == EVT_LE_ENH_CONN_COMPLETE) {
+    // subevent, status, handle, role, peer address type, peer address
+    if (plen >= 12 && param[1] == 0) {
+      conn_add (index, (param[2] | param[3] << 8) & 0x0FFF, param + 6);
+    }
+  } else if (subevent == EVT_LE_ADVERTISING_REPORT) {
+    // per report: event type, address type, address, data length, data, RSSI
+    const uint8_t *report = param + 2, *end = param + plen;
+    for (int i = 0; i < param[1] && report + 10 <= end; i++) {
+      size_t data_len = report[8];
+      if (report + 10 + data_len > end) break;
+
+      int8_t rssi = (int8_t)report[9 + data_len];
+      if (rssi != 127 && le_public (report[1])) {
+        record_sighting (table, report + 2, rssi, BT_SEEN_ADVERTISING);
+      }
+      report += 10 + data_len;
+    }
+  } else if (subevent == EVT_LE_EXT_ADVERTISING_REPORT) {
+    // per report: event type (2), address type, address, PHYs (2), SID, TX power, RSSI,
+    // interval (2), direct address type, direct address, data length, data
+    const uint8_t *report = param + 2, *end = param + plen;
+    for (int i = 0; i < param[1] && report + 24 <= end; i++) {
+      size_t data_len = report[23];
+      if (report + 24 + data_len > end) break;
+
+      int8_t rssi = (int8_t)report[13];
+      if (rssi != 127 && le_public (report[2])) {
+        record_sighting (table, report + 3, rssi, BT_SEEN_ADVERTISING);
+      }
+      report += 24 + data_len;
+    }
+  }
+}
+
+// Stores the RSSI of configured devices found in any event that carries one
+static void handle_event (
+    bt_presence_t *table,
+    uint16_t index,
+    uint8_t source,
+    uint8_t event,
+    const uint8_t *param,
+    size_t plen
+) {
+  if (event == EVT_INQUIRY_RESULT_WITH_RSSI) {
+    // count, then per device: address, scan modes (2), class (3), clock offset (2), RSSI
+    size_t count = plen ? param[0] : 0;
+    for (size_t i = 0; i < count && 1 + (i + 1) * 14 <= plen; i++) {
+      const uint8_t *info = param + 1 + i * 14;
+      record_sighting (table, info, (int8_t)info[13], source);
+    }
+  } else if (event == EVT_EXTENDED_INQUIRY_RESULT) {
+    // count (always 1), address, scan mode, reserved, class (3), clock offset (2), RSSI, EIR
+    if (plen >= 15) record_sighting (table, param + 1, (int8_t)param[14], source);
+  } else if (event == EVT_CONN_COMPLETE) {
+    // status, handle, address, link type, encryption
+    if (plen >= 9 && param[0] == 0) conn_add (index, param[1] | param[2] << 8, param + 3);
+  } else if (event == EVT_DISCONN_COMPLETE) {
+    // status, handle, reason
+    if (plen >= 3 && param[0] == 0) conn_del (index, param[1] | param[2] << 8);
+  } else if (event == EVT_CMD_COMPLETE) {
+    // free command slots, opcode, then Read RSSI's status, handle, RSSI
+    if (plen < 7 || (param[1] | param[2] << 8) != BT_OPCODE (OGF_STATUS_PARAM, OCF_READ_RSSI)) {
+      return;
+    }
+    const bdaddr_t *addr = conn_find (index, param[4] | param[5] << 8);
+    if (param[3] == 0 && addr) record_sighting (table, addr->b, (int8_t)param[6], source);
+  } else if (event == EVT_LE_META_EVENT) {
+    handle_le_meta (table, index, param, plen);
+  }
+}
+
+// Inquiry results of our own inquiry, 1 once it completed
+static int read_inquiry (int hci_sock, int dev_id, bt_presence_t *table) {
+  uint8_t pkt[HCI_MAX_EVENT_SIZE];
+  ssize_t n = read (hci_sock, pkt, sizeof (pkt));
+  if (n < 0) return errno == EINTR || errno == EAGAIN ? 0 : -1;
+
+  // packet type, event code, parameter length, parameters
+  if (n < 3 || pkt[0] != HCI_EVENT_PKT) return 0;
+  if (pkt[1] == EVT_INQUIRY_COMPLETE) return 1;
+
+  handle_event (table, dev_id, BT_SEEN_INQUIRY, pkt[1], pkt + 3, n - 3);
+  return 0;
+}
+
+// Everything every adapter sends and receives, only events are looked at
+static int read_monitor (int mon_sock, bt_presence_t *table) {
+  // larger ACL packets are truncated, which is fine
+  uint8_t pkt[sizeof (bt_mon_hdr_t) + HCI_MAX_EVENT_SIZE];
+  ssize_t n = read (mon_sock, pkt, sizeof (pkt));
+  if (n < 0) return errno == EINTR || errno == EAGAIN ? 0 : -1;
+  if (n < (ssize_t)sizeof (bt_mon_hdr_t)) return 0;
+
+  bt_mon_hdr_t hdr;
+  memcpy (&hdr, pkt, sizeof (hdr));
+  uint16_t opcode = btohs (hdr.opcode), index = btohs (hdr.index);
+  const uint8_t *payload = pkt + sizeof (hdr);
+  size_t len = n - sizeof (hdr);
+
+  if (opcode == HCI_MON_DEL_INDEX) {
+    conn_drop_index (index);
+  } else if (opcode == HCI_MON_EVENT_PKT && len >= 2) {
+    // event code, parameter length, parameters
+    handle_event (table, index, BT_SEEN_MONITOR, payload[0], payload + 2, len - 2);
+  }
+  return 0;
+}
+
+// Input device reporting the lid switch, -1 without one
+static int open_lid_switch (void) {
+  for (int i = 0; i < 32; i++) {
+    char path[32];
+    snprintf (path, sizeof (path), "/dev/input/event%d", i);
+    int fd = open (path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+    if (fd < 0) continue;
+
+    unsigned long switches[SW_MAX / LONG_BITS + 1] = {};
+    if (ioctl (fd, EVIOCGBIT (EV_SW, sizeof (switches)), switches) >= 0 &&
+        (switches[SW_LID / LONG_BITS] >> (SW_LID % LONG_BITS) & 1)) {
+      return fd;
+    }
+    close (fd);
+  }
+
+  return -1;
+}
+
+// True when the lid was opened
+static bool read_lid (int lid_fd) {
+  struct input_event events[8];
+  ssize_t n = read (lid_fd, events, sizeof (events));
+
+  bool opened = false;
+  for (ssize_t i = 0; i < n / (ssize_t)sizeof (*events); i++) {
+    const struct input_event *ev = &events[i];
+    if (ev->type == EV_SW && ev->code == SW_LID && ev->value == 0) opened = true;
+  }
+  return opened;
+}
+
+static bool read_sysfs (const char *path, StrView expected) {
+  char buf[64];
+  int n = kv_read_file (path, buf, sizeof (buf));
+  return n > 0 && z3_sv_starts (z3_svl (buf, n), expected);
+}
+
+// Power saver platform profile, or a discharging battery below `battery_min` %
+static bool battery_saver (int battery_min) {
+  if (read_sysfs ("/sys/firmware/acpi/platform_profile", Z3_SV ("low-power"))) return true;
+  if (battery_min <= 0) return false;
+
+  DIR *dir = opendir ("/sys/class/power_supply");
+  if (!dir) return false;
+
+  bool low = false;
+  struct dirent *entry;
+  while (!low && (entry = readdir (dir))) {
+    if (entry->d_name[0] == '.') continue;
+
+    char path[320];
+    snprintf (path, sizeof (path), "/sys/class/power_supply/%s/status", entry->d_name);
+    if (!read_sysfs (path, Z3_SV ("Discharging"))) continue;
+
+    char buf[16];
+    snprintf (path, sizeof (path), "/sys/class/power_supply/%s/capacity", entry->d_name);
+    int n = kv_read_file (path, buf, sizeof (buf));
+    long capacity;
+    low = n > 0 && z3_sv_to_long (z3_sv_trim (z3_svl (buf, n)), &capacity) &&
+          capacity < battery_min;
+  }
+
+  closedir (dir);
+  return low;
+}
+
+static uint64_t monotonic_ms (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Scan again soon, the user is probably about to authenticate
+static void sched_wake (scan_sched_t *sched, const daemon_config_t *config, uint64_t now) {
+  sched->period_ms = config->min_period * 1280;
+  if (sched->next_ms > now) sched->next_ms = now;
+}
+
+// The controller may be inquiring: the inquiry started at `started_ms`, or the next one
+// from its earliest start until the Inquiry Complete moves `started_ms` on
+static bool sched_inquiring (
+    const scan_sched_t *sched, const daemon_config_t *config, uint64_t now
+) {
+  if (!sched->programmed_ms) return false;
+  return now < sched->started_ms + config->length * 1280 ||
+         now >= sched->started_ms + sched->min_ms;
+}
+
+// Out of periodic inquiry while the battery saver is on, true if it is
+static bool sched_pause (
+    scan_sched_t *sched, const daemon_config_t *config, int hci_sock, uint64_t now
+) {
+  // sysfs is only read when an inquiry is due or just ended, never on a timer of its own
+  bool saver = battery_saver (config->battery_min);
+  if (saver != sched->paused) {
+    syslog (LOG_INFO, saver ? "Battery saver on, pausing inquiries" : "Resuming inquiries");
+    sched->paused = saver;
+  }
+  if (!saver) return false;
+
+  if (sched->programmed_ms) bt_exit_periodic_inquiry (hci_sock, 1000);
+  sched->programmed_ms = 0;
+  sched->next_ms = now + config->max_period * 1280;
+  return true;
+}
+
+// Enters periodic inquiry at the current period, the controller inquires right away.
+// Also when the last inquiry never completed: it must not stop the schedule.
+static void sched_start (
+    scan_sched_t *sched, const daemon_config_t *config, int hci_sock, uint64_t now
+) {
+  if (sched_pause (sched, config, hci_sock, now)) return;
+
+  // start to start, spread a little so it does not beat with other radios nearby
+  uint32_t min = config->length + sched->period_ms / 1280;
+  if (min > 0xE000) min = 0xE000;
+  uint32_t max = min + min / 8 + 1;
+
+  // refused when not in periodic inquiry, which is fine
+  bt_exit_periodic_inquiry (hci_sock, 1000);
+  sched->programmed_ms = 0;
+  if (bt_periodic_inquiry (hci_sock, max, min, config->length, 1000) < 0) {
+    // busy with a connection or someone else's inquiry, try again later
+    syslog (LOG_DEBUG, "Cannot start periodic inquiry: %m");
+    sched->next_ms = now + config->min_period * 1280;
+    return;
+  }
+
+  sched->programmed_ms = sched->period_ms;
+  sched->min_ms = min * 1280;
+  sched->max_ms = max * 1280;
+  sched->started_ms = now;
+  sched->next_ms = now + sched->max_ms + config->length * 1280 + 2000;
+}
+
+// Inquiry over: back off while every device stays where it was
+static void sched_done (
+    scan_sched_t *sched, const daemon_config_t *config, int hci_sock, bt_presence_t *table,
+    uint64_t now
+) {
+  // someone else's inquiry
+  if (!sched->programmed_ms) return;
+
+  // inquiries with unlimited responses take their full length
+  uint64_t length_ms = config->length * 1280;
+  uint64_t started = now - length_ms > sched->started_ms ? now - length_ms : sched->started_ms;
+
+  bool changed = false;
+  for (size_t i = 0; i < config->device_count; i++) {
+    bt_sighting_t seen;
+    bool found = bt_presence_lookup (table, &config->devices[i], &seen) &&
+                 seen.at_ms >= started;
+    changed |= found != sched->seen[i];
+    sched->seen[i] = found;
+  }
+
+  uint64_t max_ms = config->max_period * 1280;
+  sched->period_ms = changed ? config->min_period * 1280 : sched->period_ms * 2;
+  if (sched->period_ms > max_ms) sched->period_ms = max_ms;
+
+  sched->radio_ms += now - started;
+  sched->started_ms = started;
+  if (sched_pause (sched, config, hci_sock, now)) return;
+
+  if (sched->period_ms != sched->programmed_ms) {
+    // entered again at the new period once the next inquiry is due, not right away
+    bt_exit_periodic_inquiry (hci_sock, 1000);
+    sched->programmed_ms = 0;
+    sched->next_ms = now + sched->period_ms;
+  } else {
+    sched->next_ms = started + sched->max_ms + length_ms + 2000;
+  }
+}
+
+static void sched_report (scan_sched_t *sched, uint64_t now) {
+  double hours = (now - sched->metrics_ms) / 3600e3;
+  if (hours <= 0) return;
+
+  syslog (
+      LOG_INFO, "%.0f wakeups/h, radio in inquiry %.1f s/h (%.2f%%), %.0f probes/h",
+      sched->wakeups / hours, sched->radio_ms / 1e3 / hours, sched->radio_ms / (hours * 36e3),
+      sched->probes / hours
+  );
+  sched->wakeups = 0;
+  sched->radio_ms = 0;
+  sched->probes = 0;
+  sched->metrics_ms = now;
+}
+
+// `ms` give or take 1/PROBE_JITTER, so devices added together drift apart
+static uint64_t probe_jitter (prober_t *prober, uint64_t ms) {
+  uint64_t spread = ms / PROBE_JITTER;
+  return ms - spread + z3_mix64 (prober->seed++) % (2 * spread + 1);
+}
+
+// First probe of every device somewhere in the first period
+static void probe_init (
+    prober_t *prober, const daemon_config_t *config, int sock, uint64_t now
+) {
+  z3_wheel_init (&prober->wheel, now);
+  z3_list_init (&prober->reads);
+  z3_list_init (&prober->pages);
+  z3_list_init (&prober->flight);
+  prober->sock = sock;
+  prober->seed = now;
+
+  uint64_t period_ms = config->probe_period * 1000ULL;
+  for (size_t i = 0; i < config->device_count; i++) {
+    device_probe_t *dev = &prober->devices[i];
+    *dev = (device_probe_t){.interval_ms = period_ms};
+    z3_wheel_add (&prober->wheel, &dev->timer, now + z3_mix64 (prober->seed++) % period_ms);
+  }
+}
+
+// Probe over: back off while the device stays away
+static void probe_done (
+    prober_t *prober, const daemon_config_t *config, device_probe_t *dev, bool found,
+    uint64_t now
+) {
+  if (dev->state == PROBE_READING || dev->state == PROBE_PAGING) {
+    z3_list_remove (&dev->queue);
+    if (dev->state == PROBE_READING) prober->reading--;
+    if (dev->state == PROBE_PAGING) prober->paging--;
+  }
+
+  uint64_t period_ms = config->probe_period * 1000ULL, max_ms = config->max_period * 1280;
+  if (max_ms < period_ms) max_ms = period_ms;
+  dev->interval_ms = found ? period_ms : dev->interval_ms * 2;
+  if (dev->interval_ms > max_ms) dev->interval_ms = max_ms;
+
+  dev->state = PROBE_IDLE;
+  dev->paged = false;
+  z3_wheel_add (&prober->wheel, &dev->timer, now + probe_jitter (prober, dev->interval_ms));
+}
+
+// Sends the probe of a due device, or queues it until the controller has room
+static void probe_start (
+    prober_t *prober, const daemon_config_t *config, scan_sched_t *sched, device_probe_t *dev,
+    uint64_t now
+) {
+  const bdaddr_t *addr = &config->devices[dev - prober->devices];
+  dev->state = PROBE_WAITING;
+
+  uint16_t handle;
+  if (bt_conn_handle (prober->sock, addr, ACL_LINK, &handle) == 0 ||
+      bt_conn_handle (prober->sock, addr, LE_LINK, &handle) == 0) {
+    if (prober->reading >= PROBE_MAX_READS) {
+      z3_list_push (&prober->reads, &dev->queue);
+      return;
+    }
+
+    uint16_t cp = htobs (handle);
+    if (bt_send_cmd (prober->sock, OGF_STATUS_PARAM, OCF_READ_RSSI, &cp, sizeof (cp)) < 0) {
+      probe_done (prober, config, dev, false, now);
+      return;
+    }
+    dev->state = PROBE_READING;
+    dev->handle = handle;
+    prober->reading++;
+  } else if (dev->paged) {
+    // the link of its page is gone already, present all the same
+    probe_done (prober, config, dev, true, now);
+    return;
+  } else {
+    // the radio pages one device at a time, and not while it inquires
+    if (sched_inquiring (sched, config, now) || prober->paging >= config->max_pages) {
+      z3_list_push (&prober->pages, &dev->queue);
+      return;
+    }
+
+    // address, page scan repetition mode R2, reserved, clock offset
+    uint8_t cp[10] = {[6] = 0x02};
+    memcpy (cp, addr->b, 6);
+    if (bt_send_cmd (prober->sock, OGF_LINK_CTL, OCF_REMOTE_NAME_REQ, cp, sizeof (cp)) < 0) {
+      probe_done (prober, config, dev, false, now);
+      return;
+    }
+    dev->state = PROBE_PAGING;
+    prober->paging++;
+  }
+
+  sched->probes++;
+  z3_list_push (&prober->flight, &dev->queue);
+  uint64_t deadline = dev->state == PROBE_READING ? PROBE_READ_MS : PROBE_PAGE_MS;
+  z3_wheel_add (&prober->wheel, &dev->timer, now + deadline);
+}
+
+// Due probes and deadlines, then whatever waits and now fits
+static void probe_expire (
+    prober_t *prober, const daemon_config_t *config, scan_sched_t *sched, uint64_t now
+) {
+  Z3Timer *timer;
+  while ((timer = z3_wheel_expire (&prober->wheel, now))) {
+    device_probe_t *dev = z3_container_of (timer, device_probe_t, timer);
+    if (dev->state == PROBE_IDLE) {
+      probe_start (prober, config, sched, dev, now);
+    } else {
+      probe_done (prober, config, dev, false, now);
+    }
+  }
+
+  // each start either sends or moves the device to the other queue
+  while (prober->reading < PROBE_MAX_READS && !z3_list_empty (&prober->reads)) {
+    device_probe_t *dev = z3_container_of (prober->reads.next, device_probe_t, queue);
+    z3_list_remove (&dev->queue);
+    probe_start (prober, config, sched, dev, now);
+  }
+  while (!sched_inquiring (sched, config, now) && prober->paging < config->max_pages &&
+         !z3_list_empty (&prober->pages)) {
+    device_probe_t *dev = z3_container_of (prober->pages.next, device_probe_t, queue);
+    z3_list_remove (&dev->queue);
+    probe_start (prober, config, sched, dev, now);
+  }
+}
+
+// In flight probe a reply is for, NULL if someone else asked
+static device_probe_t *probe_find (
+    prober_t *prober, const daemon_config_t *config, uint8_t state, uint16_t handle,
+    const uint8_t *addr
+) {
+  for (Z3Link *link = prober->flight.next; link != &prober->flight; link = link->next) {
+    device_probe_t *dev = z3_container_of (link, device_probe_t, queue);
+    if (dev->state != state) continue;
+    if (state == PROBE_READING && dev->handle == handle) return dev;
+    if (state == PROBE_PAGING &&
+        memcmp (config->devices[dev - prober->devices].b, addr, 6) == 0) {
+      return dev;
+    }
+  }
+  return NULL;
+}
+
+// Replies to the probes
+static int read_probe (
+    prober_t *prober, const daemon_config_t *config, scan_sched_t *sched,
+    bt_presence_t *table
+) {
+  uint8_t pkt[HCI_MAX_EVENT_SIZE];
+  ssize_t n = read (prober->sock, pkt, sizeof (pkt));
+  if (n < 0) return errno == EINTR || errno == EAGAIN ? 0 : -1;
+
+  // packet type, event code, parameter length, parameters
+  if (n < 3 || pkt[0] != HCI_EVENT_PKT) return 0;
+  const uint8_t *param = pkt + 3;
+  size_t plen = n - 3;
+  uint64_t now = bt_presence_now_ms ();
+
+  if (pkt[1] == EVT_CMD_COMPLETE) {
+    // free command slots, opcode, then Read RSSI's status, handle, RSSI
+    if (plen < 7 || (param[1] | param[2] << 8) != BT_OPCODE (OGF_STATUS_PARAM, OCF_READ_RSSI)) {
+      return 0;
+    }
+    device_probe_t *dev = probe_find (
+        prober, config, PROBE_READING, param[4] | param[5] << 8, NULL
+    );
+    if (!dev) return 0;
+
+    const bdaddr_t *addr = &config->devices[dev - prober->devices];
+    if (param[3] == 0) bt_presence_record (table, addr, (int8_t)param[6], BT_SEEN_PROBE);
+    probe_done (prober, config, dev, param[3] == 0 || dev->paged, now);
+  } else if (pkt[1] == EVT_REMOTE_NAME_REQ_COMPLETE) {
+    // status, address, name
+    if (plen < 7) return 0;
+    device_probe_t *dev = probe_find (prober, config, PROBE_PAGING, 0, param + 1);
+    if (!dev) return 0;
+
+    if (param[0] != 0) {
+      probe_done (prober, config, dev, false, now);
+      return 0;
+    }
+
+    // answered, read its RSSI on the link the page left behind
+    z3_list_remove (&dev->queue);
+    z3_wheel_cancel (&prober->wheel, &dev->timer);
+    prober->paging--;
+    dev->paged = true;
+    probe_start (prober, config, sched, dev, now);
+  }
+  return 0;
+}
+
+static int run (
+    int hci_sock,
+    int dev_id,
+    int mon_sock,
+    bt_presence_t *table,
+    const daemon_config_t *config,
+    scan_sched_t *sched,
+    prober_t *prober
+) {
+  struct hci_filter filter = {.type_mask = 1u << HCI_EVENT_PKT};
+  bt_filter_set_event (&filter, EVT_INQUIRY_RESULT_WITH_RSSI);
+  bt_filter_set_event (&filter, EVT_EXTENDED_INQUIRY_RESULT);
+  bt_filter_set_event (&filter, EVT_INQUIRY_COMPLETE);
+  if (setsockopt (hci_sock, SOL_HCI, HCI_FILTER, &filter, sizeof (filter)) < 0) {
+    syslog (LOG_ERR, "Cannot set HCI filter: %m");
+    return -1;
+  }
+
+  int lid_fd = config->inquiry ? open_lid_switch () : -1;
+  struct pollfd pfds[4] = {
+      {.fd = hci_sock, .events = POLLIN},
+      {.fd = mon_sock, .events = POLLIN},  // ignored by poll when -1
+      {.fd = lid_fd, .events = POLLIN},
+      {.fd = prober ? prober->sock : -1, .events = POLLIN},
+  };
+
+  while (running) {
+    uint64_t now = bt_presence_now_ms ();
+
+    // lid opened, screen locked, or resumed from suspend
+    uint64_t drift = now - monotonic_ms ();
+    if (kicked || drift > sched->drift_ms + 1000) sched_wake (sched, config, now);
+    kicked = 0;
+    sched->drift_ms = drift;
+
+    if (config->inquiry && now >= sched->next_ms) sched_start (sched, config, hci_sock, now);
+
+    if (prober) probe_expire (prober, config, sched, now);
+
+    if (now >= sched->metrics_ms + METRICS_PERIOD_MS) sched_report (sched, now);
+
+    uint64_t due = config->inquiry ? sched->next_ms : UINT64_MAX;
+    if (prober && z3_wheel_next (&prober->wheel) < due) due = z3_wheel_next (&prober->wheel);
+
+    int timeout = -1;
+    if (due != UINT64_MAX) timeout = due > now ? (int)(due - now) : 0;
+
+    int ready = poll (pfds, 4, timeout);
+    sched->wakeups++;
+    if (ready < 0) {
+      if (errno == EINTR) continue;
+      syslog (LOG_ERR, "poll: %m");
+      break;
+    }
+
+    if (pfds[0].revents & POLLIN) {
+      int res = read_inquiry (hci_sock, dev_id, table);
+      if (res < 0) {
+        syslog (LOG_ERR, "Cannot read HCI events: %m");
+        break;
+      }
+      if (res == 1) sched_done (sched, config, hci_sock, table, bt_presence_now_ms ());
+    }
+
+    if ((pfds[1].revents & POLLIN) && read_monitor (mon_sock, table) < 0) {
+      syslog (LOG_ERR, "Cannot read monitor channel: %m");
+      break;
+    }
+
+    if ((pfds[2].revents & POLLIN) && read_lid (lid_fd)) kicked = 1;
+
+    if ((pfds[3].revents & POLLIN) && read_probe (prober, config, sched, table) < 0) {
+      syslog (LOG_ERR, "Cannot read probe replies: %m");
+      break;
+    }
+  }
+
+  if (lid_fd >= 0) close (lid_fd);
+  return running ? -1 : 0;
+}
+
+// Statistics the module recorded, read without locking out auths
+static int print_stats (void) {
+  static const char *const probes[BT_PROBE_KINDS] = {"table", "connected", "page"};
+
+  bt_stats_t stats;
+  if (bt_stats_open (&stats, BT_STATS_FILE, false) < 0) {
+    fprintf (stderr, "Cannot open %s: %m\n", BT_STATS_FILE);
+    return 1;
+  }
+
+  size_t it = 0;
+  bdaddr_t adapter, device;
+  bt_stats_summary_t sum;
+  while (bt_stats_next (&stats, &it, &adapter, &device, &sum)) {
+    char adapter_str[Z3_BDADDR_STRLEN + 1], device_str[Z3_BDADDR_STRLEN + 1];
+    z3_bdaddr_format (adapter.b, adapter_str);
+    z3_bdaddr_format (device.b, device_str);
+
+    printf (
+        "%s via %s, %llu RSSI samples", device_str, adapter_str,
+        (unsigned long long)sum.rssi_samples
+    );
+    if (sum.rssi_samples) {
+      printf (": p10 %d, p50 %d, p90 %d dBm", sum.rssi_p10, sum.rssi_p50, sum.rssi_p90);
+    }
+    printf ("\n");
+
+    for (int k = 0; k < BT_PROBE_KINDS; k++) {
+      if (!sum.attempts[k]) continue;
+      printf (
+          "  %-10s %llu/%llu found, p50 %.1f ms, p99 %.1f ms\n", probes[k],
+          (unsigned long long)sum.found[k], (unsigned long long)sum.attempts[k],
+          sum.latency_p50_us[k] / 1e3, sum.latency_p99_us[k] / 1e3
+      );
+    }
+
+    if (sum.shadow_runs) {
+      printf (
+          "  shadow     %llu/%llu agreed (%llu found only by the candidate, %llu out of time),"
+          " %+.1f ms on average\n",
+          (unsigned long long)sum.shadow_agreed, (unsigned long long)sum.shadow_runs,
+          (unsigned long long)sum.shadow_candidate_only, (unsigned long long)sum.shadow_expired,
+          sum.shadow_delta_mean_us / 1e3
+      );
+      printf (
+          "             real p50 %.1f ms, p99 %.1f ms; candidate p50 %.1f ms, p99 %.1f ms\n",
+          sum.shadow_p50_us[BT_SHADOW_REAL] / 1e3, sum.shadow_p99_us[BT_SHADOW_REAL] / 1e3,
+          sum.shadow_p50_us[BT_SHADOW_CANDIDATE] / 1e3,
+          sum.shadow_p99_us[BT_SHADOW_CANDIDATE] / 1e3
+      );
+    }
+    if (sum.shadow_skipped) {
+      printf (
+          "  shadow     %llu auths left out, the real probes paged\n",
+          (unsigned long long)sum.shadow_skipped
+      );
+    }
+  }
+
+  bt_stats_close (&stats);
+  return 0;
+}
+
+// Creates `dir` if needed, -1 with errno set unless root alone can write in it
+static int make_root_dir (const char *dir) {
+  if (mkdir (dir, 0755) < 0 && errno != EEXIST) return -1;
+
+  // lstat, a link to some other directory is refused too
+  struct stat st;
+  if (lstat (dir, &st) < 0) return -1;
+  if (!S_ISDIR (st.st_mode) || st.st_uid != 0 || (st.st_mode & (S_IWGRP | S_IWOTH))) {
+    errno = EPERM;
+    return -1;
+  }
+  return 0;
+}
+
+// Statistics file of the module, with room for `devices`: the module never creates,
+// migrates nor grows it from inside a PAM host, it drops what does not fit
+static int make_stats_file (size_t devices) {
+  size_t pairs = devices * STATS_PAIRS_PER_DEVICE;
+  if (make_root_dir (BT_STATS_DIR) < 0 || bt_stats_prepare (BT_STATS_FILE, pairs) < 0) {
+    syslog (LOG_WARNING, "Cannot create %s, auths record no statistics: %m", BT_STATS_FILE);
+    return -1;
+  }
+  return 0;
+}
+
+int main (int argc, char **argv) {
+  static daemon_config_t config = {
+      .length = 2,
+      .min_period = 4,
+      .max_period = 234,
+      .battery_min = 20,
+      .inquiry = true,
+      .max_pages = 1,
+  };
+
+  int opt;
+  long value;
+  bool stats_only = false;
+  while ((opt = getopt (argc, argv, "pna:l:m:M:b:r:c:sih")) != -1) {
+    switch (opt) {
+      case 'p': config.monitor = true; break;
+      case 'n': config.inquiry = false; break;
+      case 'a': config.adapter = optarg; break;
+      // controller limit on the length, periods in the 16 bits of their fields
+      case 'l':
+        if (!option_value (opt, optarg, 1, 0x30, &value)) return 2;
+        config.length = value;
+        break;
+      case 'm':
+        if (!option_value (opt, optarg, 1, UINT16_MAX, &value)) return 2;
+        config.min_period = value;
+        break;
+      case 'M':
+        if (!option_value (opt, optarg, 1, UINT16_MAX, &value)) return 2;
+        config.max_period = value;
+        break;
+      case 'b':
+        if (!option_value (opt, optarg, 0, 100, &value)) return 2;
+        config.battery_min = value;
+        break;
+      case 'r':
+        if (!option_value (opt, optarg, 0, 86400, &value)) return 2;
+        config.probe_period = value;
+        break;
+      case 'c':
+        if (!option_value (opt, optarg, 1, 16, &value)) return 2;
+        config.max_pages = value;
+        break;
+      case 's': return print_stats ();
+      case 'i': stats_only = true; break;
+      default: usage (argv[0]); return opt == 'h' ? 0 : 2;
+    }
+  }
+
+  // an inquiry at most every other period
+  if (config.min_period < config.length || config.max_period < config.min_period) {
+    fprintf (stderr, "Inquiry periods must satisfy max >= min >= length\n");
+    return 2;
+  }
+
+  if (!config.inquiry && !config.monitor && !config.probe_period) {
+    fprintf (stderr, "Nothing to listen to: -n needs -p or -r\n");
+    return 2;
+  }
+
+  openlog ("pam_bluetoothd", LOG_PID | LOG_PERROR, LOG_AUTHPRIV);
+
+  if (optind == argc) {
+    if (!read_module_config (CONFIG_FILE, &config) && !stats_only) return 1;
+  }
+  for (int i = optind; i < argc; i++) {
+    if (!read_module_config (argv[i], &config) && !stats_only) return 1;
+  }
+  // a config that cannot be read yet still gets a file, of BT_STATS_SLOTS
+  if (stats_only) return make_stats_file (config.device_count) < 0;
+
+  if (config.device_count == 0) {
+    syslog (LOG_ERR, "No device to track");
+    return 1;
+  }
+
+  int dev_id = config.adapter ? bt_devid (config.adapter) : bt_get_route ();
+  if (dev_id < 0) {
+    syslog (LOG_ERR, "No Bluetooth adapter found");
+    return 1;
+  }
+
+  int hci_sock = bt_open_dev (dev_id);
+  if (hci_sock < 0) {
+    syslog (LOG_ERR, "Cannot open HCI socket: %m");
+    return 1;
+  }
+
+  // RSSI in the results, plain inquiry results carry none
+  if (config.inquiry && bt_write_inquiry_mode (hci_sock, BT_INQUIRY_EXTENDED, 1000) < 0 &&
+      bt_write_inquiry_mode (hci_sock, BT_INQUIRY_RSSI, 1000) < 0) {
+    syslog (LOG_ERR, "Controller cannot report inquiry RSSI: %m");
+    return 1;
+  }
+
+  int mon_sock = -1;
+  if (config.monitor) {
+    mon_sock = bt_open_monitor ();
+    if (mon_sock < 0) {
+      syslog (LOG_ERR, "Cannot open monitor channel: %m");
+      return 1;
+    }
+    conn_seed (hci_sock, dev_id);
+  }
+
+  // a missing statistics file only costs the module its history
+  make_stats_file (config.device_count);
+
+  if (make_root_dir (BT_PRESENCE_DIR) < 0) {
+    syslog (LOG_ERR, "Refusing to publish in %s: %m", BT_PRESENCE_DIR);
+    return 1;
+  }
+
+  bt_presence_t table;
+  if (bt_presence_create (&table, BT_PRESENCE_FILE, config.devices, config.device_count) < 0) {
+    syslog (LOG_ERR, "Cannot create %s: %m", BT_PRESENCE_FILE);
+    return 1;
+  }
+
+  struct sigaction sa = {.sa_handler = stop};
+  sigaction (SIGTERM, &sa, NULL);
+  sigaction (SIGINT, &sa, NULL);
+  sa.sa_handler = kick;
+  sigaction (SIGUSR1, &sa, NULL);
+
+  if (config.inquiry) {
+    syslog (
+        LOG_INFO, "Tracking %zu devices on hci%d, inquiry every %.1f to %.1f s",
+        config.device_count, dev_id, config.min_period * 1.28, config.max_period * 1.28
+    );
+  }
+  if (config.monitor) {
+    syslog (LOG_INFO, "Tracking %zu devices from the monitor channel", config.device_count);
+  }
+
+  static prober_t prober;
+  if (config.probe_period) {
+    int probe_sock = bt_open_dev (dev_id);
+    struct hci_filter filter = {.type_mask = 1u << HCI_EVENT_PKT};
+    bt_filter_set_event (&filter, EVT_CMD_COMPLETE);
+    bt_filter_set_event (&filter, EVT_REMOTE_NAME_REQ_COMPLETE);
+    if (probe_sock < 0 ||
+        setsockopt (probe_sock, SOL_HCI, HCI_FILTER, &filter, sizeof (filter)) < 0) {
+      syslog (LOG_ERR, "Cannot open HCI socket for probes: %m");
+      return 1;
+    }
+
+    probe_init (&prober, &config, probe_sock, bt_presence_now_ms ());
+    syslog (
+        LOG_INFO, "Probing %zu devices every %d s, %d pages at once", config.device_count,
+        config.probe_period, config.max_pages
+    );
+  }
+
+  // start right away, as after a wake up
+  static scan_sched_t sched;
+  uint64_t now = bt_presence_now_ms ();
+  sched = (scan_sched_t){.drift_ms = now - monotonic_ms (), .metrics_ms = now};
+  sched_wake (&sched, &config, now);
+
+  int res = run (
+      hci_sock, dev_id, mon_sock, &table, &config, &sched,
+      config.probe_period ? &prober : NULL
+  );
+
+  if (sched.programmed_ms) bt_exit_periodic_inquiry (hci_sock, 1000);
+  sched_report (&sched, bt_presence_now_ms ());
+  close (hci_sock);
+  if (mon_sock >= 0) close (mon_sock);
+  if (config.probe_period) close (prober.sock);
+
+  // without the daemon the sightings would only grow stale
+  unlink (BT_PRESENCE_FILE);
+  bt_presence_close (&table);
+
+  return res < 0 ? 1 : 0;
+}
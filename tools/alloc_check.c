@@ -0,0 +1,112 @@
+// Heap allocations of an auth, run by `make check`
+//
+// Loads the module with dlopen and runs auths against the stand-in radio of
+// standin_radio.h, with malloc, calloc, realloc and free replaced by
+// counting wrappers around the ones of glibc. An auth must not touch the
+// heap, whether it succeeds or fails: any call made by the module while an
+// auth runs fails the check. The first auth of each scenario is not counted,
+// the C library may set itself up lazily then.
+//
+// libpam's logging is left out of the check: pam_syslog formats every
+// message with vasprintf, whatever its priority. The stand-in does the same,
+// and those calls are shown apart, as the share of an auth the module
+// cannot avoid short of logging less.
+//
+// Usage: alloc_check <module.so> [rounds]
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+
+#include "standin_radio.h"
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+static const scenario_t scenarios[] = {STANDIN_SCENARIOS};
+
+// Only the thread running the auth counts, the radio threads allocate freely
+static _Thread_local bool counting;
+static size_t allocs, frees, log_calls;
+
+static void tally (size_t *calls) {
+  if (!counting || standin_busy) return;
+  if (standin_logging) {
+    log_calls++;
+  } else {
+    (*calls)++;
+  }
+}
+
+void *malloc (size_t size) {
+  tally (&allocs);
+  return __libc_malloc (size);
+}
+
+void *calloc (size_t count, size_t size) {
+  tally (&allocs);
+  return __libc_calloc (count, size);
+}
+
+void *realloc (void *ptr, size_t size) {
+  tally (&allocs);
+  return __libc_realloc (ptr, size);
+}
+
+void free (void *ptr) {
+  if (ptr) tally (&frees);
+  __libc_free (ptr);
+}
+
+int main (int argc, char **argv) {
+  if (argc < 2) {
+    fprintf (stderr, "Usage: %s <module.so> [rounds]\n", argv[0]);
+    return 2;
+  }
+
+  int rounds = argc > 2 ? atoi (argv[2]) : 100;
+  if (rounds < 1) rounds = 1;
+
+  pam_auth_fn authenticate = standin_load (argv[1]);
+  if (!authenticate) return 2;
+
+  char stats_dir[32], stats_arg[48];
+  if (!stats_start (stats_dir, stats_arg, 1)) return 2;
+
+  int failed = 0;
+  printf ("%-26s %10s %10s %12s\n", "scenario", "allocs", "frees", "libpam log");
+
+  for (size_t s = 0; s < sizeof (scenarios) / sizeof (*scenarios); s++) {
+    const scenario_t *current = &scenarios[s];
+    radio_start (&current->radio);
+
+    char config_arg[40];
+    if (!standin_config_arg (config_arg, current->config)) return 2;
+    const char *args[] = {config_arg, stats_arg};
+
+    allocs = frees = log_calls = 0;
+    for (int i = 0; i <= rounds; i++) {
+      counting = i > 0;
+      int result = authenticate (NULL, 0, 2, args);
+      counting = false;
+
+      if (result != current->expect) {
+        fprintf (stderr, "%s: got %d, expected %d\n", current->name, result, current->expect);
+        failed = 1;
+        break;
+      }
+    }
+    standin_config_remove (config_arg);
+
+    printf ("%-26s %10zu %10zu %12zu\n", current->name, allocs, frees, log_calls);
+    if (allocs || frees) failed = 1;
+  }
+
+  if (!stats_finish (stats_dir, stats_arg)) failed = 1;
+  if (failed) {
+    fprintf (stderr, "alloc_check: an auth touched the heap, failed or recorded nothing\n");
+  }
+  return failed;
+}
@@ -0,0 +1,164 @@
+// End to end auths against scripted radios, see `make bench`
+//
+// Loads the module with dlopen and runs auths against the stand-in radio of
+// standin_radio.h. First one auth at a time, for each script: a steady link,
+// a phone walking away and back, a link that comes and goes, slow paging,
+// paging past the page timeout, a busy controller and a crowd of peers. Then
+// the same steady link with auths on many threads at once, each for a peer
+// of its own and all sharing one statistics file, for the cost of contention.
+//
+// Usage: auth_bench <module.so> [rounds]
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+
+#include "standin_radio.h"
+#include "timing.h"
+
+typedef struct {
+  const char *name;
+  const char *config;
+  radio_t radio;
+} script_t;
+
+#define PAGE_20MS "page_timeout = 20\n"
+
+// Connected, in range, sniff, then the script
+static const script_t scripts[] = {
+    {"steady link", DEVICE_CONFIG, {true, true, .rssi = -50}},
+    {"steady link, fresh", DEVICE_CONFIG FRESH_RSSI, {true, true, .rssi = -50}},
+    {"walking away and back",
+     DEVICE_CONFIG,
+     {true, true, .rssi = -50, .rssi_low = -100, .swing_ms = 5}},
+    {"link churn", DEVICE_CONFIG, {true, true, .rssi = -50, .up_ms = 5, .down_ms = 5}},
+    {"weak link, paging first",
+     DEVICE_CONFIG PAGE_FIRST,
+     {true, true, .rssi = -95, .page_ms = 5}},
+    {"slow paging", DEVICE_CONFIG, {false, true, .rssi = -60, .page_ms = 5}},
+    {"paging past timeout", DEVICE_CONFIG PAGE_20MS, {false, true, .page_ms = 40}},
+    {"busy controller", DEVICE_CONFIG, {true, true, .rssi = -50, .busy_every = 3}},
+    {"crowd of 200 peers", DEVICE_CONFIG, {true, true, .rssi = -50, .peers = 200}},
+};
+
+// Steady links for the contention runs, one peer per thread
+static const radio_t crowd = {true, true, .rssi = -50, .peers = 64};
+static const int thread_counts[] = {1, 2, 4, 8, 16, 32, 64};
+
+// Shared by every auth, see `stats_start`
+static char stats_dir[32], stats_arg[48];
+
+typedef struct {
+  pam_auth_fn authenticate;
+  int peer;
+  int rounds;
+  int64_t *samples;
+  int granted;
+} worker_t;
+
+// Auths of one thread, for the device at peer `w->peer`
+static void *run_worker (void *arg) {
+  worker_t *w = arg;
+
+  bdaddr_t addr = radio_peer_addr (w->peer);
+  char config[128];
+  snprintf (
+      config, sizeof (config),
+      "device = %02X:%02X:%02X:%02X:%02X:%02X\ncheck_trusted = 0\nmin_strength = -80\n",
+      addr.b[5], addr.b[4], addr.b[3], addr.b[2], addr.b[1], addr.b[0]
+  );
+
+  char config_arg[40];
+  if (!standin_config_arg (config_arg, config)) return NULL;
+  const char *args[] = {config_arg, stats_arg};
+
+  for (int i = 0; i < w->rounds; i++) {
+    int64_t start = now_ns ();
+    if (w->authenticate (NULL, 0, 2, args) == PAM_SUCCESS) w->granted++;
+    w->samples[i] = now_ns () - start;
+  }
+
+  standin_config_remove (config_arg);
+  return NULL;
+}
+
+int main (int argc, char **argv) {
+  if (argc < 2) {
+    fprintf (stderr, "Usage: %s <module.so> [rounds]\n", argv[0]);
+    return 2;
+  }
+
+  int rounds = argc > 2 ? atoi (argv[2]) : 200;
+  if (rounds < 1) rounds = 1;
+
+  pam_auth_fn authenticate = standin_load (argv[1]);
+  if (!authenticate) return 2;
+
+  // a pair per thread, sized as pam_bluetoothd would for as many devices
+  int max_threads = thread_counts[sizeof (thread_counts) / sizeof (*thread_counts) - 1];
+  if (!stats_start (stats_dir, stats_arg, max_threads)) return 2;
+
+  int64_t *samples = malloc ((size_t)max_threads * rounds * sizeof (*samples));
+  worker_t *workers = malloc (max_threads * sizeof (*workers));
+  pthread_t *threads = malloc (max_threads * sizeof (*threads));
+  if (!samples || !workers || !threads) return 2;
+
+  printf ("%-24s %10s %10s %10s\n", "script", "granted", "p50 us", "p99 us");
+  for (size_t s = 0; s < sizeof (scripts) / sizeof (*scripts); s++) {
+    const script_t *script = &scripts[s];
+    radio_start (&script->radio);
+
+    char config_arg[40];
+    if (!standin_config_arg (config_arg, script->config)) return 2;
+    const char *args[] = {config_arg, stats_arg};
+
+    int granted = 0;
+    for (int i = 0; i < rounds; i++) {
+      int64_t start = now_ns ();
+      if (authenticate (NULL, 0, 2, args) == PAM_SUCCESS) granted++;
+      samples[i] = now_ns () - start;
+    }
+    standin_config_remove (config_arg);
+
+    qsort (samples, rounds, sizeof (*samples), cmp_i64);
+    printf (
+        "%-24s %9.1f%% %10.1f %10.1f\n", script->name, 100.0 * granted / rounds,
+        samples[rounds / 2] / 1e3, samples[rounds * 99 / 100] / 1e3
+    );
+  }
+
+  printf ("\n%-24s %10s %10s %10s\n", "concurrent auths", "auths/s", "p50 us", "p99 us");
+  radio_start (&crowd);
+  for (size_t c = 0; c < sizeof (thread_counts) / sizeof (*thread_counts); c++) {
+    int n = thread_counts[c];
+
+    int64_t start = now_ns ();
+    for (int t = 0; t < n; t++) {
+      workers[t] = (worker_t){authenticate, t, rounds, samples + (size_t)t * rounds, 0};
+      if (pthread_create (&threads[t], NULL, run_worker, &workers[t]) != 0) return 2;
+    }
+    int granted = 0;
+    for (int t = 0; t < n; t++) {
+      pthread_join (threads[t], NULL);
+      granted += workers[t].granted;
+    }
+    double seconds = (now_ns () - start) / 1e9;
+
+    size_t total = (size_t)n * rounds;
+    if (granted != (int)total) {
+      fprintf (stderr, "%d threads: %zu auths denied\n", n, total - granted);
+    }
+
+    qsort (samples, total, sizeof (*samples), cmp_i64);
+    printf (
+        "%-24d %10.0f %10.1f %10.1f\n", n, total / seconds, samples[total / 2] / 1e3,
+        samples[total * 99 / 100] / 1e3
+    );
+  }
+
+  bool recorded = stats_finish (stats_dir, stats_arg);
+  free (threads);
+  free (workers);
+  free (samples);
+  return recorded ? 0 : 1;
+}
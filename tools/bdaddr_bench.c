@@ -0,0 +1,179 @@
+// Cost of bdaddr parsing and formatting, see `make bench`
+//
+// z3_bdaddr_parse and z3_bdaddr_format, one address at a time and in
+// batches, against str2ba and ba2str as BlueZ writes them (bachk, strtol,
+// sprintf), copied below. When libbluetooth.so.3 loads, its own str2ba and
+// ba2str are timed as well. Every address is checked first: formatting must
+// give the same text as ba2str, and parsing must give the address back.
+//
+// Usage: bdaddr_bench [addresses]
+
+#define _DEFAULT_SOURCE
+
+#include <ctype.h>
+#include <dlfcn.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define Z3_TOYS_IMPL
+#include "../lib/z3_toys.h"
+#include "timing.h"
+
+#define BATCH 4096
+
+typedef struct {
+  uint8_t b[6];
+} bdaddr_t;
+
+// lib/bluetooth.c of BlueZ
+static int bluez_bachk (const char *str) {
+  if (!str) return -1;
+  if (strlen (str) != 17) return -1;
+
+  while (*str) {
+    if (!isxdigit (*str++)) return -1;
+    if (!isxdigit (*str++)) return -1;
+    if (*str == 0) break;
+    if (*str++ != ':') return -1;
+  }
+  return 0;
+}
+
+static int bluez_str2ba (const char *str, bdaddr_t *ba) {
+  if (bluez_bachk (str) < 0) {
+    memset (ba, 0, sizeof (*ba));
+    return -1;
+  }
+  for (int i = 5; i >= 0; i--, str += 3) ba->b[i] = strtol (str, NULL, 16);
+  return 0;
+}
+
+static int bluez_ba2str (const bdaddr_t *ba, char *str) {
+  return sprintf (
+      str, "%2.2X:%2.2X:%2.2X:%2.2X:%2.2X:%2.2X", ba->b[5], ba->b[4], ba->b[3], ba->b[2],
+      ba->b[1], ba->b[0]
+  );
+}
+
+typedef int (*str2ba_fn) (const char *, bdaddr_t *);
+typedef int (*ba2str_fn) (const bdaddr_t *, char *);
+
+static bdaddr_t addrs[BATCH];
+static char strs[BATCH][Z3_BDADDR_STRLEN + 1];
+static const char *str_ptrs[BATCH];
+static uint8_t parsed[BATCH][6];
+
+// Keeps the optimizer from dropping a result
+static volatile unsigned sink;
+
+static double ns_per_addr (int64_t start, long count) {
+  return (double)(now_ns () - start) / count;
+}
+
+static double bench_parse_one (long count) {
+  int64_t start = now_ns ();
+  for (long i = 0; i < count; i++) {
+    z3_bdaddr_parse (strs[i % BATCH], Z3_BDADDR_STRLEN, parsed[i % BATCH]);
+  }
+  sink += parsed[0][0];
+  return ns_per_addr (start, count);
+}
+
+static double bench_format_one (long count) {
+  int64_t start = now_ns ();
+  for (long i = 0; i < count; i++) z3_bdaddr_format (addrs[i % BATCH].b, strs[i % BATCH]);
+  sink += strs[0][0];
+  return ns_per_addr (start, count);
+}
+
+static double bench_parse_batch (long count) {
+  int64_t start = now_ns ();
+  for (long i = 0; i < count; i += BATCH) sink += z3_bdaddr_parse_n (str_ptrs, BATCH, parsed);
+  return ns_per_addr (start, (count + BATCH - 1) / BATCH * BATCH);
+}
+
+static double bench_format_batch (long count) {
+  int64_t start = now_ns ();
+  for (long i = 0; i < count; i += BATCH) {
+    z3_bdaddr_format_n ((const uint8_t (*)[6])addrs, BATCH, strs);
+    sink += strs[0][0];
+  }
+  return ns_per_addr (start, (count + BATCH - 1) / BATCH * BATCH);
+}
+
+static double bench_str2ba (str2ba_fn str2ba, long count) {
+  int64_t start = now_ns ();
+  for (long i = 0; i < count; i++) str2ba (strs[i % BATCH], (bdaddr_t *)parsed[i % BATCH]);
+  sink += parsed[0][0];
+  return ns_per_addr (start, count);
+}
+
+static double bench_ba2str (ba2str_fn ba2str, long count) {
+  int64_t start = now_ns ();
+  for (long i = 0; i < count; i++) ba2str (&addrs[i % BATCH], strs[i % BATCH]);
+  sink += strs[0][0];
+  return ns_per_addr (start, count);
+}
+
+// Same text as ba2str, and the same address back from both parsers
+static bool check (void) {
+  for (int i = 0; i < BATCH; i++) {
+    char ours[Z3_BDADDR_STRLEN + 1], theirs[Z3_BDADDR_STRLEN + 1];
+    z3_bdaddr_format (addrs[i].b, ours);
+    bluez_ba2str (&addrs[i], theirs);
+    if (strcmp (ours, theirs) != 0) return false;
+
+    bdaddr_t back;
+    if (!z3_bdaddr_parse (ours, Z3_BDADDR_STRLEN, back.b)) return false;
+    if (memcmp (&back, &addrs[i], 6) != 0) return false;
+    if (bluez_str2ba (ours, &back) < 0 || memcmp (&back, &addrs[i], 6) != 0) return false;
+  }
+
+  // what bachk lets through but a strict parser must not
+  static const char *const bad[] = {
+      "AA:BB:CC:DD:EE:F", "AA:BB:CC:DD:EE:FFF", "AA-BB-CC-DD-EE-FF", "AA:BB:CC:DD:EE:GG",
+      " A:BB:CC:DD:EE:FF",
+  };
+  for (size_t i = 0; i < sizeof (bad) / sizeof (*bad); i++) {
+    uint8_t addr[6];
+    if (z3_bdaddr_parse (bad[i], strlen (bad[i]), addr)) return false;
+  }
+  return true;
+}
+
+int main (int argc, char **argv) {
+  long count = argc > 1 ? atol (argv[1]) : 10000000;
+  if (count < BATCH) count = BATCH;
+
+  for (int i = 0; i < BATCH; i++) {
+    uint64_t r = z3_mix64 (i);
+    memcpy (addrs[i].b, &r, 6);
+    bluez_ba2str (&addrs[i], strs[i]);
+    str_ptrs[i] = strs[i];
+  }
+
+  if (!check ()) {
+    fprintf (stderr, "bdaddr_bench: z3 results differ from the BlueZ ones\n");
+    return 1;
+  }
+
+  printf ("%-28s %10s %10s\n", "ns per address", "parse", "format");
+  printf ("%-28s %10.1f %10.1f\n", "z3, one at a time", bench_parse_one (count),
+          bench_format_one (count));
+  printf ("%-28s %10.1f %10.1f\n", "z3, batches of 4096", bench_parse_batch (count),
+          bench_format_batch (count));
+  printf ("%-28s %10.1f %10.1f\n", "BlueZ code, copied", bench_str2ba (bluez_str2ba, count),
+          bench_ba2str (bluez_ba2str, count));
+
+  void *lib = dlopen ("libbluetooth.so.3", RTLD_NOW | RTLD_LOCAL);
+  str2ba_fn str2ba = lib ? (str2ba_fn)dlsym (lib, "str2ba") : NULL;
+  ba2str_fn ba2str = lib ? (ba2str_fn)dlsym (lib, "ba2str") : NULL;
+  if (str2ba && ba2str) {
+    printf ("%-28s %10.1f %10.1f\n", "libbluetooth.so.3", bench_str2ba (str2ba, count),
+            bench_ba2str (ba2str, count));
+  } else {
+    printf ("%-28s %10s %10s\n", "libbluetooth.so.3", "-", "-");
+  }
+  if (lib) dlclose (lib);
+  return 0;
+}
@@ -0,0 +1,355 @@
+// Differential fuzz and throughput of z3_escape and z3_unescape, see `make bench`
+//
+// The reference versions below handle one byte at a time, as the library did
+// before it copied plain runs a word at a time. Random inputs, heavy in the
+// bytes that matter (backslashes, quotes, `x`, hex digits, control and high
+// bytes, NUL), must give byte-identical output from both, and escaping then
+// unescaping must give the input back up to its first NUL. Every input sits
+// in a buffer of its exact length, so a sanitizer build catches overreads.
+// Then the throughput of both on plain text, a device name and binary data.
+//
+// z3_unescape no longer matches the baseline on malformed escapes: the
+// baseline read past `len` on a trailing backslash or `\x`, swallowed the
+// byte after an invalid `\x`, and took a single hex digit as the high nibble.
+// `ref_unescape` follows the current rules; `base_unescape` is the baseline
+// verbatim, compared on the inputs whose escapes are all well formed, given a
+// NUL after them since it ignored `len` past an escape.
+//
+// Usage: escape_bench [cases]
+
+#define _DEFAULT_SOURCE
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define Z3_STRING_IMPL
+#define Z3_TOYS_IMPL
+#include "../lib/z3_string.h"
+#include "timing.h"
+
+static String ref_escape (const char *input, size_t len) {
+  static const char hex_digits[] = "0123456789abcdef";
+  String s = z3_str (32);
+
+  for (size_t l = 0; l < len && input[l]; l++) {
+    unsigned char c = input[l];
+    switch (c) {
+      case '\a': z3_pushl (&s, "\\a", 2); break;
+      case '\b': z3_pushl (&s, "\\b", 2); break;
+      case '\f': z3_pushl (&s, "\\f", 2); break;
+      case '\n': z3_pushl (&s, "\\n", 2); break;
+      case '\r': z3_pushl (&s, "\\r", 2); break;
+      case '\t': z3_pushl (&s, "\\t", 2); break;
+      case '\v': z3_pushl (&s, "\\v", 2); break;
+      case '\\': z3_pushl (&s, "\\\\", 2); break;
+      case '\"': z3_pushl (&s, "\\\"", 2); break;
+      case '\'': z3_pushl (&s, "\\\'", 2); break;
+      default:
+        if (c < 0x20 || c > 0x7E) {
+          z3_pushc (&s, '\\');
+          z3_pushc (&s, 'x');
+          z3_pushc (&s, hex_digits[c >> 4]);
+          z3_pushc (&s, hex_digits[c & 0xF]);
+        } else {
+          z3_pushc (&s, c);
+        }
+        break;
+    }
+  }
+  z3_ensure0 (&s);
+  return s;
+}
+
+static int hex_value (char c) {
+  if (c >= '0' && c <= '9') return c - '0';
+  if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+  return c - 'A' + 10;
+}
+
+// z3_unescape before the word at a time copy, as it was
+static String base_unescape (const char *input, size_t len) {
+  String s = z3_str (32);
+  size_t l = 0;
+
+  // loop until `\0`, or until length
+  while (l < len && *input) {
+    if (*input == '\\') {
+      input++;  // Skip the backslash
+
+      switch (*input) {
+        case 'a':
+          z3_pushc (&s, '\a');
+          break;
+        case 'b':
+          z3_pushc (&s, '\b');
+          break;
+        case 'f':
+          z3_pushc (&s, '\f');
+          break;
+        case 'n':
+          z3_pushc (&s, '\n');
+          break;
+        case 'r':
+          z3_pushc (&s, '\r');
+          break;
+        case 't':
+          z3_pushc (&s, '\t');
+          break;
+        case 'v':
+          z3_pushc (&s, '\v');
+          break;
+        case '\\':
+          z3_pushc (&s, '\\');
+          break;
+        case '\"':
+          z3_pushc (&s, '\"');
+          break;
+        case '\'':
+          z3_pushc (&s, '\'');
+          break;
+
+        case 'x': {
+          input++;  // Skip 'x'
+          if (!isxdigit (*input)) {
+            z3_pushl (&s, "\\x", 2);
+            z3_pushc (&s, *input++);
+            break;
+          }
+          l++;
+          unsigned char byte_value = 0;
+          char c = *input++;
+
+          if (c >= '0' && c <= '9')
+            byte_value |= (c - '0');
+          else if (c >= 'a' && c <= 'f')
+            byte_value |= (c - 'a' + 10);
+          else if (c >= 'A' && c <= 'F')
+            byte_value |= (c - 'A' + 10);
+
+          c = *input;
+          byte_value <<= 4;
+
+          if (c >= '0' && c <= '9')
+            byte_value |= (c - '0');
+          else if (c >= 'a' && c <= 'f')
+            byte_value |= (c - 'a' + 10);
+          else if (c >= 'A' && c <= 'F')
+            byte_value |= (c - 'A' + 10);
+          z3_pushc (&s, byte_value);
+
+          break;
+        }
+
+        // In case of invalid escape, just add the backslash
+        default:
+          z3_pushc (&s, '\\');
+          z3_pushc (&s, *input);
+          break;
+      }
+    } else {
+      z3_pushc (&s, *input);
+    }
+    input++;
+    l++;
+  }
+  z3_ensure0 (&s);
+  return s;
+}
+
+// Every backslash followed by a byte and every `\x` by two hex digits, within `len`
+static bool well_formed (const char *input, size_t len) {
+  for (size_t l = 0; l < len && input[l]; l++) {
+    if (input[l] != '\\') continue;
+    if (l + 1 >= len || !input[l + 1]) return false;
+    if (input[++l] != 'x') continue;
+    if (l + 2 >= len || !isxdigit ((unsigned char)input[l + 1]) ||
+        !isxdigit ((unsigned char)input[l + 2])) {
+      return false;
+    }
+    l += 2;
+  }
+  return true;
+}
+
+// Current rules of z3_unescape, one byte at a time
+static String ref_unescape (const char *input, size_t len) {
+  String s = z3_str (32);
+
+  size_t l = 0;
+  while (l < len && input[l]) {
+    // a backslash ending the input is kept
+    if (input[l] != '\\' || l + 1 >= len || !input[l + 1]) {
+      z3_pushc (&s, input[l++]);
+      continue;
+    }
+
+    char c = input[l + 1];
+    l += 2;
+    switch (c) {
+      case 'a': z3_pushc (&s, '\a'); break;
+      case 'b': z3_pushc (&s, '\b'); break;
+      case 'f': z3_pushc (&s, '\f'); break;
+      case 'n': z3_pushc (&s, '\n'); break;
+      case 'r': z3_pushc (&s, '\r'); break;
+      case 't': z3_pushc (&s, '\t'); break;
+      case 'v': z3_pushc (&s, '\v'); break;
+      case '\\': z3_pushc (&s, '\\'); break;
+      case '\"': z3_pushc (&s, '\"'); break;
+      case '\'': z3_pushc (&s, '\''); break;
+
+      case 'x': {
+        // one or two hex digits, `\x` alone is kept
+        if (l >= len || !isxdigit ((unsigned char)input[l])) {
+          z3_pushl (&s, "\\x", 2);
+          break;
+        }
+        int byte = hex_value (input[l++]);
+        if (l < len && isxdigit ((unsigned char)input[l])) {
+          byte = byte << 4 | hex_value (input[l++]);
+        }
+        z3_pushc (&s, (char)byte);
+        break;
+      }
+
+      default:
+        z3_pushc (&s, '\\');
+        z3_pushc (&s, c);
+        break;
+    }
+  }
+  z3_ensure0 (&s);
+  return s;
+}
+
+static bool same (const String *a, const String *b) {
+  return a->len == b->len && memcmp (z3_chr (a), z3_chr (b), a->len) == 0;
+}
+
+static void dump (const char *what, const char *input, size_t len) {
+  fprintf (stderr, "escape_bench: %s differs for input of %zu bytes:", what, len);
+  for (size_t i = 0; i < len; i++) fprintf (stderr, " %02x", (unsigned char)input[i]);
+  fprintf (stderr, "\n");
+}
+
+// Bytes the escape code branches on, then any byte
+static char fuzz_byte (uint64_t *seed) {
+  static const char interesting[] = "\\\\\\\"'xxX0aF9g\n\t\a\x7f\x80\xff\x01";
+  uint64_t r = z3_mix64 ((*seed)++);
+  if (r % 64 == 0) return '\0';
+  if (r % 2) return interesting[(r >> 8) % (sizeof (interesting) - 1)];
+  return (char)(r >> 16);
+}
+
+// Inputs also compared with `base_unescape`
+static long well_formed_cases;
+
+static bool fuzz (long cases) {
+  uint64_t seed = 1;
+  for (long i = 0; i < cases; i++) {
+    size_t len = z3_mix64 (seed++) % 80;
+    char *input = malloc (len ? len : 1);
+    if (!input) return false;
+    for (size_t j = 0; j < len; j++) input[j] = fuzz_byte (&seed);
+
+    String escaped = z3_escape (input, len), ref = ref_escape (input, len);
+    bool ok = same (&escaped, &ref);
+    if (!ok) dump ("z3_escape", input, len);
+    z3_drops (&ref);
+
+    String unescaped = z3_unescape (input, len);
+    ref = ref_unescape (input, len);
+    if (!same (&unescaped, &ref)) {
+      dump ("z3_unescape", input, len);
+      ok = false;
+    }
+    z3_drops (&ref);
+
+    if (well_formed (input, len)) {
+      char *terminated = malloc (len + 1);
+      if (!terminated) return false;
+      memcpy (terminated, input, len);
+      terminated[len] = '\0';
+      ref = base_unescape (terminated, len);
+      if (!same (&unescaped, &ref)) {
+        dump ("z3_unescape against the baseline", input, len);
+        ok = false;
+      }
+      z3_drops (&ref);
+      free (terminated);
+      well_formed_cases++;
+    }
+    z3_drops (&unescaped);
+
+    // the escaped copy must come back as the input, up to its first NUL
+    String back = z3_unescape (z3_chr (&escaped), escaped.len);
+    size_t plain = strnlen (input, len);
+    if (back.len != plain || memcmp (z3_chr (&back), input, plain) != 0) {
+      dump ("round trip", input, len);
+      ok = false;
+    }
+    z3_drops (&back);
+    z3_drops (&escaped);
+    free (input);
+
+    if (!ok) return false;
+  }
+  return true;
+}
+
+// Keeps the optimizer from dropping a result
+static volatile size_t sink;
+
+// MB/s of `fn` over `len` bytes of `input`, repeated up to about 64 MB
+static double throughput (String (*fn) (const char *, size_t), const char *input, size_t len) {
+  long reps = (64 << 20) / len;
+  int64_t start = now_ns ();
+  for (long i = 0; i < reps; i++) {
+    String out = fn (input, len);
+    sink += out.len;
+    z3_drops (&out);
+  }
+  return (double)reps * len / ((now_ns () - start) / 1e9) / 1e6;
+}
+
+int main (int argc, char **argv) {
+  long cases = argc > 1 ? atol (argv[1]) : 1000000;
+
+  if (!fuzz (cases)) return 1;
+  printf ("%ld random inputs, output identical to the byte at a time versions\n", cases);
+  printf ("%ld of them well formed, identical to the baseline z3_unescape\n\n", well_formed_cases);
+
+  // plain text, a device name with a tab, and bytes of every value
+  static char text[4096], binary[4096];
+  static const char name[] = "Pixel 7 of Alice\t(work phone)";
+  for (size_t i = 0; i < sizeof (text); i++) text[i] = "Lorem ipsum dolor sit amet, "[i % 28];
+  for (size_t i = 0; i < sizeof (binary); i++) binary[i] = (char)(i * 7 % 255 + 1);
+
+  static const struct {
+    const char *name;
+    const char *data;
+    size_t len;
+  } inputs[] = {
+      {"plain text, 4 KiB", text, sizeof (text)},
+      {"device name", name, sizeof (name) - 1},
+      {"binary, 4 KiB", binary, sizeof (binary)},
+  };
+
+  printf (
+      "%-20s %14s %14s %14s %14s\n", "MB/s", "escape", "byte at a time", "unescape",
+      "byte at a time"
+  );
+  for (size_t i = 0; i < sizeof (inputs) / sizeof (*inputs); i++) {
+    // unescaping runs on the escaped form
+    String escaped = z3_escape (inputs[i].data, inputs[i].len);
+    printf (
+        "%-20s %14.0f %14.0f %14.0f %14.0f\n", inputs[i].name,
+        throughput (z3_escape, inputs[i].data, inputs[i].len),
+        throughput (ref_escape, inputs[i].data, inputs[i].len),
+        throughput (z3_unescape, z3_chr (&escaped), escaped.len),
+        throughput (ref_unescape, z3_chr (&escaped), escaped.len)
+    );
+    z3_drops (&escaped);
+  }
+  return 0;
+}
@@ -0,0 +1,158 @@
+// Cost of recording into and reading the z3 histogram, see `make bench`
+//
+// Values are latencies in ns, log-uniform from 1 us to 1 s, in a histogram
+// of precision 7 over 40 bits. First the percentiles are checked against the
+// exact ones of the sorted values, within the relative error of the shape.
+// Then the cost of a record from one thread, and from many threads into one
+// shared copy against a copy per thread merged at the end. Last the cost of
+// a percentile query, of encoding with the encoded size, and of decoding.
+//
+// Usage: hist_bench [records]
+
+#define _DEFAULT_SOURCE
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define Z3_TOYS_IMPL
+#include "../lib/z3_toys.h"
+#include "timing.h"
+
+#define PRECISION 7
+#define MAX_BITS  40
+#define HIST_SIZE Z3_HIST_BYTES (PRECISION, MAX_BITS)
+#define VALUES    65536
+#define THREADS   8
+
+static uint64_t values[VALUES];
+
+typedef struct {
+  Z3Hist *hist;
+  long count;
+  int offset;
+} recorder_t;
+
+static int cmp_u64 (const void *a, const void *b) {
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return (x > y) - (x < y);
+}
+
+// Keeps the optimizer from dropping a result
+static volatile uint64_t sink;
+
+static Z3Hist *new_hist (void) {
+  void *mem = aligned_alloc (8, HIST_SIZE);
+  return mem ? z3_hist_init (mem, HIST_SIZE, PRECISION, MAX_BITS) : NULL;
+}
+
+static void *record (void *arg) {
+  recorder_t *r = arg;
+  for (long i = 0; i < r->count; i++) {
+    z3_hist_record (r->hist, values[(i + r->offset) % VALUES]);
+  }
+  return NULL;
+}
+
+// Percentiles of every value recorded once, against the sorted values
+static bool check (Z3Hist *hist) {
+  static uint64_t sorted[VALUES];
+  z3_hist_reset (hist);
+  for (int i = 0; i < VALUES; i++) z3_hist_record (hist, values[i]);
+  memcpy (sorted, values, sizeof (sorted));
+  qsort (sorted, VALUES, sizeof (*sorted), cmp_u64);
+
+  static const double percentiles[] = {0, 1, 10, 50, 90, 99, 99.9, 100};
+  for (size_t i = 0; i < sizeof (percentiles) / sizeof (*percentiles); i++) {
+    size_t rank = (size_t)(percentiles[i] / 100.0 * VALUES + 0.5);
+    uint64_t exact = sorted[rank ? rank - 1 : 0];
+    uint64_t got = z3_hist_percentile (hist, percentiles[i]);
+    if (fabs ((double)got - (double)exact) > (double)exact / (1 << PRECISION)) {
+      fprintf (
+          stderr, "hist_bench: p%g is %llu, exactly %llu\n", percentiles[i],
+          (unsigned long long)got, (unsigned long long)exact
+      );
+      return false;
+    }
+  }
+  return true;
+}
+
+// ns per record with `threads` recorders, into one copy or one copy each
+static double bench_record (Z3Hist **hists, int threads, long count, bool shared) {
+  pthread_t ids[THREADS];
+  recorder_t recorders[THREADS];
+
+  for (int t = 0; t < threads; t++) z3_hist_reset (hists[t]);
+  int64_t start = now_ns ();
+  for (int t = 0; t < threads; t++) {
+    recorders[t] = (recorder_t){shared ? hists[0] : hists[t], count / threads, t * 4099};
+    pthread_create (&ids[t], NULL, record, &recorders[t]);
+  }
+  for (int t = 0; t < threads; t++) pthread_join (ids[t], NULL);
+  if (!shared) {
+    for (int t = 1; t < threads; t++) z3_hist_merge (hists[0], hists[t]);
+  }
+  return (double)(now_ns () - start) / (count / threads * threads);
+}
+
+int main (int argc, char **argv) {
+  long count = argc > 1 ? atol (argv[1]) : 50000000;
+  if (count < THREADS) count = THREADS;
+
+  // log-uniform from 1 us to 1 s
+  for (int i = 0; i < VALUES; i++) {
+    double u = (double)(z3_mix64 (i) >> 11) / (double)(1ULL << 53);
+    values[i] = (uint64_t)(1e3 * pow (1e6, u));
+  }
+
+  Z3Hist *hists[THREADS];
+  for (int t = 0; t < THREADS; t++) {
+    if (!(hists[t] = new_hist ())) return 2;
+  }
+  if (!check (hists[0])) return 1;
+
+  printf ("%-28s %12s %12s\n", "ns per record", "shared", "per thread");
+  for (int threads = 1; threads <= THREADS; threads *= 2) {
+    char name[32];
+    snprintf (name, sizeof (name), "%d thread%s", threads, threads > 1 ? "s" : "");
+    double shared = bench_record (hists, threads, count, true);
+    double own = bench_record (hists, threads, count, false);
+    printf ("%-28s %12.2f %12.2f\n", name, shared, own);
+  }
+
+  // a histogram of every value, then the costs of reading it
+  z3_hist_reset (hists[0]);
+  for (int i = 0; i < VALUES; i++) z3_hist_record (hists[0], values[i]);
+
+  long reps = 10000;
+  int64_t start = now_ns ();
+  for (long i = 0; i < reps; i++) sink += z3_hist_percentile (hists[0], 99);
+  double percentile_ns = (double)(now_ns () - start) / reps;
+
+  static uint8_t buf[Z3_HIST_ENCODED_BYTES (PRECISION, MAX_BITS)];
+  size_t encoded = 0;
+  start = now_ns ();
+  for (long i = 0; i < reps; i++) encoded = z3_hist_encode (hists[0], buf, sizeof (buf));
+  double encode_ns = (double)(now_ns () - start) / reps;
+
+  start = now_ns ();
+  for (long i = 0; i < reps; i++) {
+    z3_hist_reset (hists[1]);
+    if (!z3_hist_decode (hists[1], buf, encoded)) return 1;
+  }
+  double decode_ns = (double)(now_ns () - start) / reps;
+  if (z3_hist_percentile (hists[1], 99) != z3_hist_percentile (hists[0], 99)) return 1;
+
+  printf (
+      "\n%zu bytes in memory, %zu encoded for %d values, %zu at worst\n", (size_t)HIST_SIZE,
+      encoded, VALUES, sizeof (buf)
+  );
+  printf ("%-28s %12.0f\n", "ns per p99 query", percentile_ns);
+  printf ("%-28s %12.0f\n", "ns per encode", encode_ns);
+  printf ("%-28s %12.0f\n", "ns per reset and decode", decode_ns);
+
+  for (int t = 0; t < THREADS; t++) free (hists[t]);
+  return 0;
+}
@@ -0,0 +1,208 @@
+// Cost of loading a shared library, see `make bench`
+//
+// For each library given: the relocations listed in its dynamic section
+// (relative ones, which need no symbol lookup, apart from the others) and
+// the libraries it needs, then what dlopen costs a process. Each sample is
+// a fresh fork that times dlopen with RTLD_NOW, as PAM loads modules, and
+// reads its resident memory before and after, so nothing is cached from an
+// earlier sample. The libraries needed are loaded and counted as well.
+// `make bench` passes the module and, when installed, libbluetooth.so.3,
+// which the module linked before it had an HCI layer of its own.
+//
+// Usage: load_bench [-n samples] <library.so>...
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <link.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "timing.h"
+
+// ELF class of this machine, the libraries loaded must match it
+#define ELF_CLASS (sizeof (void *) == 8 ? ELFCLASS64 : ELFCLASS32)
+
+typedef struct {
+  size_t relative;  // base address added, no lookup
+  size_t symbolic;  // looked up by name at load time
+  size_t plt;       // functions, looked up at load time under RTLD_NOW
+  size_t needed;    // DT_NEEDED entries
+} relocs_t;
+
+typedef struct {
+  int64_t ns;
+  long rss_kib;
+  bool ok;
+} sample_t;
+
+// Relocation counts from the dynamic section of the file at `path`
+static bool count_relocs (const char *path, relocs_t *out) {
+  int fd = open (path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+
+  struct stat st;
+  if (fstat (fd, &st) != 0 || (size_t)st.st_size < sizeof (ElfW (Ehdr))) {
+    close (fd);
+    return false;
+  }
+  const unsigned char *file = mmap (NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close (fd);
+  if (file == MAP_FAILED) return false;
+
+  bool ok = false;
+  const ElfW (Ehdr) *eh = (const ElfW (Ehdr) *)file;
+  if (memcmp (eh->e_ident, ELFMAG, SELFMAG) != 0 || eh->e_ident[EI_CLASS] != ELF_CLASS ||
+      eh->e_phoff + (size_t)eh->e_phnum * sizeof (ElfW (Phdr)) > (size_t)st.st_size) {
+    goto done;
+  }
+
+  const ElfW (Phdr) *ph = (const ElfW (Phdr) *)(file + eh->e_phoff);
+  for (int i = 0; i < eh->e_phnum; i++) {
+    if (ph[i].p_type != PT_DYNAMIC) continue;
+    if (ph[i].p_offset + ph[i].p_filesz > (size_t)st.st_size) goto done;
+
+    size_t rel_size = 0, rel_ent = 0, rel_relative = 0, plt_size = 0, plt_ent = 0;
+    *out = (relocs_t){0};
+    const ElfW (Dyn) *dyn = (const ElfW (Dyn) *)(file + ph[i].p_offset);
+    size_t count = ph[i].p_filesz / sizeof (*dyn);
+    for (size_t d = 0; d < count && dyn[d].d_tag != DT_NULL; d++) {
+      switch (dyn[d].d_tag) {
+        case DT_RELA:
+        case DT_REL: break;
+        case DT_RELASZ:
+        case DT_RELSZ: rel_size += dyn[d].d_un.d_val; break;
+        case DT_RELAENT:
+        case DT_RELENT: rel_ent = dyn[d].d_un.d_val; break;
+        case DT_RELACOUNT:
+        case DT_RELCOUNT: rel_relative = dyn[d].d_un.d_val; break;
+        case DT_PLTRELSZ: plt_size = dyn[d].d_un.d_val; break;
+        case DT_PLTREL:
+          plt_ent = dyn[d].d_un.d_val == DT_RELA ? sizeof (ElfW (Rela)) : sizeof (ElfW (Rel));
+          break;
+        case DT_NEEDED: out->needed++; break;
+        default: break;
+      }
+    }
+
+    size_t rel = rel_ent ? rel_size / rel_ent : 0;
+    out->relative = rel_relative;
+    out->symbolic = rel > rel_relative ? rel - rel_relative : 0;
+    out->plt = plt_ent ? plt_size / plt_ent : 0;
+    ok = true;
+    break;
+  }
+
+done:
+  munmap ((void *)file, st.st_size);
+  return ok;
+}
+
+// Resident memory of this process in KiB
+static long rss_kib (void) {
+  long size, resident;
+  FILE *f = fopen ("/proc/self/statm", "r");
+  if (!f) return 0;
+  bool ok = fscanf (f, "%ld %ld", &size, &resident) == 2;
+  fclose (f);
+  return ok ? resident * (sysconf (_SC_PAGESIZE) / 1024) : 0;
+}
+
+// One dlopen of `path` in a fresh child, false if the child could not run
+static bool sample (const char *path, sample_t *out) {
+  int fds[2];
+  if (pipe (fds) != 0) return false;
+
+  pid_t pid = fork ();
+  if (pid < 0) {
+    close (fds[0]);
+    close (fds[1]);
+    return false;
+  }
+  if (pid == 0) {
+    close (fds[0]);
+    sample_t s = {0, 0, false};
+    long before = rss_kib ();
+    int64_t start = now_ns ();
+    void *lib = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+    s.ns = now_ns () - start;
+    s.rss_kib = rss_kib () - before;
+    s.ok = lib != NULL;
+    if (!lib) fprintf (stderr, "dlopen: %s\n", dlerror ());
+    _exit (write (fds[1], &s, sizeof (s)) == sizeof (s) ? 0 : 1);
+  }
+
+  close (fds[1]);
+  bool ok = read (fds[0], out, sizeof (*out)) == sizeof (*out);
+  close (fds[0]);
+  int status;
+  return waitpid (pid, &status, 0) == pid && ok && WIFEXITED (status) && !WEXITSTATUS (status);
+}
+
+int main (int argc, char **argv) {
+  int samples = 50;
+  int first = 1;
+  if (argc > 2 && strcmp (argv[1], "-n") == 0) {
+    samples = atoi (argv[2]);
+    first = 3;
+  }
+  if (samples < 1 || first >= argc) {
+    fprintf (stderr, "Usage: %s [-n samples] <library.so>...\n", argv[0]);
+    return 2;
+  }
+
+  int64_t *ns = malloc (samples * sizeof (*ns));
+  int64_t *rss = malloc (samples * sizeof (*rss));
+  if (!ns || !rss) return 2;
+
+  printf (
+      "%-28s %8s %8s %8s %6s %10s %10s %8s\n", "library", "relative", "symbolic", "plt",
+      "needed", "p50 us", "min us", "rss KiB"
+  );
+
+  int failed = 0;
+  for (int a = first; a < argc; a++) {
+    const char *path = argv[a];
+    const char *name = strrchr (path, '/') ? strrchr (path, '/') + 1 : path;
+
+    relocs_t relocs;
+    if (!count_relocs (path, &relocs)) {
+      fprintf (stderr, "%s: no dynamic section readable for this machine\n", path);
+      failed = 1;
+      continue;
+    }
+
+    int taken = 0;
+    for (int i = 0; i < samples; i++) {
+      sample_t s;
+      if (!sample (path, &s) || !s.ok) break;
+      ns[taken] = s.ns;
+      rss[taken++] = s.rss_kib;
+    }
+    if (taken < samples) {
+      fprintf (stderr, "%s: dlopen failed\n", path);
+      failed = 1;
+      continue;
+    }
+
+    qsort (ns, samples, sizeof (*ns), cmp_i64);
+    qsort (rss, samples, sizeof (*rss), cmp_i64);
+    printf (
+        "%-28s %8zu %8zu %8zu %6zu %10.1f %10.1f %8lld\n", name, relocs.relative,
+        relocs.symbolic, relocs.plt, relocs.needed, ns[samples / 2] / 1e3, ns[0] / 1e3,
+        (long long)rss[samples / 2]
+    );
+  }
+
+  free (rss);
+  free (ns);
+  return failed;
+}
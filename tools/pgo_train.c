@@ -0,0 +1,80 @@
+// Training and timing driver for the release build, see `make release`
+//
+// Loads the module with dlopen and runs auths against the stand-in radio of
+// standin_radio.h, no adapter needed.
+//
+// Usage: pgo_train <module.so> [rounds]
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+
+#include "standin_radio.h"
+#include "timing.h"
+
+#define SHORT_PAGING "page_timeout = 1280\n"
+
+// Config parsing, connected path, paging path, shadow runs and failure paths
+static const scenario_t scenarios[] = {
+    STANDIN_SCENARIOS,
+    {"connected, cached", DEVICE_CONFIG, {true, true, .rssi = -50}, PAM_SUCCESS},
+    {"paging, short timeout",
+     DEVICE_CONFIG SHORT_PAGING,
+     {false, true, .rssi = -60},
+     PAM_SUCCESS},
+};
+
+int main (int argc, char **argv) {
+  if (argc < 2) {
+    fprintf (stderr, "Usage: %s <module.so> [rounds]\n", argv[0]);
+    return 2;
+  }
+
+  int rounds = argc > 2 ? atoi (argv[2]) : 1000;
+  if (rounds < 1) rounds = 1;
+
+  pam_auth_fn authenticate = standin_load (argv[1]);
+  if (!authenticate) return 2;
+
+  int64_t *samples = malloc (rounds * sizeof (*samples));
+  if (!samples) return 2;
+
+  // statistics recorded as usual, away from the system
+  char stats_dir[32], stats_arg[48];
+  if (!stats_start (stats_dir, stats_arg, 1)) return 2;
+
+  int failed = 0;
+  printf ("%-26s %10s %10s\n", "scenario", "p50 us", "p99 us");
+
+  for (size_t s = 0; s < sizeof (scenarios) / sizeof (*scenarios); s++) {
+    const scenario_t *current = &scenarios[s];
+    radio_start (&current->radio);
+
+    char config_arg[40];
+    if (!standin_config_arg (config_arg, current->config)) return 2;
+    const char *args[] = {config_arg, stats_arg};
+
+    for (int i = 0; i < rounds; i++) {
+      int64_t start = now_ns ();
+      int result = authenticate (NULL, 0, 2, args);
+      samples[i] = now_ns () - start;
+
+      if (result != current->expect) {
+        fprintf (stderr, "%s: got %d, expected %d\n", current->name, result, current->expect);
+        failed = 1;
+        break;
+      }
+    }
+    standin_config_remove (config_arg);
+
+    qsort (samples, rounds, sizeof (*samples), cmp_i64);
+    printf (
+        "%-26s %10.1f %10.1f\n", current->name, samples[rounds / 2] / 1e3,
+        samples[rounds * 99 / 100] / 1e3
+    );
+  }
+
+  if (!stats_finish (stats_dir, stats_arg)) failed = 1;
+  free (samples);
+  return failed;
+}
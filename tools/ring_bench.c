@@ -0,0 +1,223 @@
+// Throughput and latency of the z3 SPSC ring, see `make bench`
+//
+// A producer pushes a running count of 64-bit values and a consumer pops
+// them, checking that every value arrives once and in order. First between
+// two threads, for a few capacities, then between two processes sharing the
+// ring through an anonymous shared mapping made before fork, as a daemon and
+// its helpers would. A pipe between the same two processes is the baseline.
+// Latency is half the round trip of one value sent back over a second ring.
+//
+// Usage: ring_bench [values]
+
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define Z3_TOYS_IMPL
+#include "../lib/z3_toys.h"
+#include "timing.h"
+
+#define PINGS 100000
+
+typedef struct {
+  Z3Ring *ring;
+  Z3Ring *back;  // the pong ring of a latency run
+  long count;
+  bool ok;
+} side_t;
+
+// Spins while the other side is busy, then lets it run if both share a CPU
+static void wait_turn (int *spins) {
+  if (++*spins % 1024 == 0) sched_yield ();
+}
+
+static void push (Z3Ring *ring, uint64_t value) {
+  int spins = 0;
+  while (!z3_ring_push (ring, &value)) wait_turn (&spins);
+}
+
+static uint64_t pop (Z3Ring *ring) {
+  uint64_t value;
+  int spins = 0;
+  while (!z3_ring_pop (ring, &value)) wait_turn (&spins);
+  return value;
+}
+
+static void *produce (void *arg) {
+  side_t *side = arg;
+  for (long i = 0; i < side->count; i++) push (side->ring, i);
+  return NULL;
+}
+
+static void *consume (void *arg) {
+  side_t *side = arg;
+  side->ok = true;
+  for (long i = 0; i < side->count; i++) {
+    if (pop (side->ring) != (uint64_t)i) side->ok = false;
+  }
+  return NULL;
+}
+
+// Sends each value back as soon as it arrives
+static void *echo (void *arg) {
+  side_t *side = arg;
+  for (long i = 0; i < side->count; i++) push (side->back, pop (side->ring));
+  return NULL;
+}
+
+// ns per round trip of `pings` values sent over `ring` and echoed over `back`
+static double ping (Z3Ring *ring, Z3Ring *back, long pings) {
+  int64_t start = now_ns ();
+  for (long i = 0; i < pings; i++) {
+    push (ring, i);
+    if (pop (back) != (uint64_t)i) return -1;
+  }
+  return (double)(now_ns () - start) / pings;
+}
+
+// A ring of `cap` values in `mem`, which must hold two of the largest
+static Z3Ring *make_ring (void *mem, size_t cap) {
+  return z3_ring_init (mem, z3_ring_bytes (cap, sizeof (uint64_t)), cap, sizeof (uint64_t));
+}
+
+static bool bench_threads (void *mem, size_t half, long count) {
+  static const size_t caps[] = {64, 1024, 65536};
+
+  printf ("%-26s %12s %12s\n", "threads, capacity", "Mvalues/s", "latency ns");
+  for (size_t c = 0; c < sizeof (caps) / sizeof (*caps); c++) {
+    Z3Ring *ring = make_ring (mem, caps[c]);
+    Z3Ring *back = make_ring ((char *)mem + half, caps[c]);
+    if (!ring || !back) return false;
+
+    side_t producer = {ring, NULL, count, true}, consumer = {ring, NULL, count, false};
+    pthread_t threads[2];
+    int64_t start = now_ns ();
+    pthread_create (&threads[0], NULL, consume, &consumer);
+    pthread_create (&threads[1], NULL, produce, &producer);
+    pthread_join (threads[1], NULL);
+    pthread_join (threads[0], NULL);
+    double rate = count / ((now_ns () - start) / 1e3);
+    if (!consumer.ok) return false;
+
+    side_t echoer = {ring, back, PINGS, true};
+    pthread_create (&threads[0], NULL, echo, &echoer);
+    double rtt = ping (ring, back, PINGS);
+    pthread_join (threads[0], NULL);
+    if (rtt < 0) return false;
+
+    printf ("%-26zu %12.1f %12.1f\n", caps[c], rate, rtt / 2);
+  }
+  return true;
+}
+
+// The child attaches to the rings made by the parent, consumes, then echoes
+static bool bench_processes (void *mem, size_t half, long count) {
+  size_t cap = 1024;
+  if (!make_ring (mem, cap) || !make_ring ((char *)mem + half, cap)) return false;
+
+  pid_t pid = fork ();
+  if (pid < 0) return false;
+  if (pid == 0) {
+    side_t side = {
+        z3_ring_attach (mem, half), z3_ring_attach ((char *)mem + half, half), count, false
+    };
+    if (!side.ring || !side.back) _exit (1);
+    consume (&side);
+    side.count = PINGS;
+    echo (&side);
+    _exit (side.ok ? 0 : 1);
+  }
+
+  Z3Ring *ring = mem, *back = (Z3Ring *)((char *)mem + half);
+  int64_t start = now_ns ();
+  for (long i = 0; i < count; i++) push (ring, i);
+  // the consumer has the last value once the ring drains
+  for (int spins = 0; z3_ring_len (ring) > 0;) wait_turn (&spins);
+  double rate = count / ((now_ns () - start) / 1e3);
+  double rtt = ping (ring, back, PINGS);
+
+  int status;
+  if (waitpid (pid, &status, 0) != pid || !WIFEXITED (status) || WEXITSTATUS (status) != 0) {
+    return false;
+  }
+  if (rtt < 0) return false;
+  printf ("%-26s %12.1f %12.1f\n", "fork, shared ring", rate, rtt / 2);
+  return true;
+}
+
+// The same two runs over pipes, one value per write
+static bool bench_pipes (long count) {
+  int to[2], from[2];
+  if (pipe (to) != 0 || pipe (from) != 0) return false;
+
+  pid_t pid = fork ();
+  if (pid < 0) return false;
+  if (pid == 0) {
+    uint64_t value;
+    bool ok = true;
+    for (long i = 0; i < count; i++) {
+      if (read (to[0], &value, sizeof (value)) != sizeof (value) || value != (uint64_t)i) {
+        ok = false;
+      }
+    }
+    ok = ok && write (from[1], &value, sizeof (value)) == sizeof (value);
+    for (long i = 0; ok && i < PINGS; i++) {
+      ok = read (to[0], &value, sizeof (value)) == sizeof (value) &&
+           write (from[1], &value, sizeof (value)) == sizeof (value);
+    }
+    _exit (ok ? 0 : 1);
+  }
+
+  bool ok = true;
+  uint64_t value;
+  int64_t start = now_ns ();
+  for (uint64_t i = 0; ok && i < (uint64_t)count; i++) {
+    ok = write (to[1], &i, sizeof (i)) == sizeof (i);
+  }
+  // acknowledged once the child has read everything
+  ok = ok && read (from[0], &value, sizeof (value)) == sizeof (value);
+  double rate = count / ((now_ns () - start) / 1e3);
+
+  start = now_ns ();
+  for (uint64_t i = 0; ok && i < PINGS; i++) {
+    ok = write (to[1], &i, sizeof (i)) == sizeof (i) &&
+         read (from[0], &value, sizeof (value)) == sizeof (value) && value == i;
+  }
+  double rtt = (double)(now_ns () - start) / PINGS;
+
+  int status;
+  ok = waitpid (pid, &status, 0) == pid && ok;
+  ok = ok && WIFEXITED (status) && WEXITSTATUS (status) == 0;
+  close (to[0]), close (to[1]), close (from[0]), close (from[1]);
+  if (ok) printf ("%-26s %12.1f %12.1f\n", "fork, pipe", rate, rtt / 2);
+  return ok;
+}
+
+int main (int argc, char **argv) {
+  long count = argc > 1 ? atol (argv[1]) : 20000000;
+  if (count < 1) count = 1;
+
+  // two rings of the largest capacity, shared so the child of fork sees them
+  size_t half = z3_ring_bytes (65536, sizeof (uint64_t));
+  void *mem = mmap (NULL, 2 * half, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (mem == MAP_FAILED) {
+    perror ("mmap");
+    return 2;
+  }
+
+  bool ok = bench_threads (mem, half, count) && bench_processes (mem, half, count);
+  ok = ok && bench_pipes (count / 10);
+  munmap (mem, 2 * half);
+
+  if (!ok) {
+    fprintf (stderr, "ring_bench: values lost, repeated or out of order\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,524 @@
+// Stand-in radio for the tools that load the module, no adapter needed
+//
+// A tool includes this once and is linked with -rdynamic, so the socket
+// calls of a module loaded with dlopen bind to the definitions below:
+// Bluetooth sockets become socketpairs, each served by a thread that answers
+// HCI commands the way a controller would, and the HCI ioctls report one
+// adapter. Sleeps of the module return at once, the stand-in radio has
+// nothing to wait for.
+//
+// What the radio looks like is set with `radio_start`: any number of peers
+// following one script, with an RSSI swing, connection churn, slow paging
+// and a controller refusing some commands as busy. Every socket is served
+// on its own thread, so any number of auths can run at the same time.
+//
+// The auths record into a statistics file of their own, see `stats_start`;
+// `stats_finish` fails when nothing was recorded, since the auths would then
+// have skipped every statistics path of the module.
+
+#ifndef STANDIN_RADIO_H
+#define STANDIN_RADIO_H
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <security/pam_ext.h>
+#include <security/pam_modules.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../lib/bt_hci.h"
+
+#define Z3_TOYS_IMPL
+#define BT_STATS_IMPL
+#include "../lib/bt_stats.h"
+
+#define MAX_FDS 1024
+
+typedef int (*pam_auth_fn) (pam_handle_t *, int, int, const char **);
+
+// Controller Busy, as refused commands are answered
+#define RADIO_BUSY 0x3A
+// Unknown Connection Identifier, a link that went away
+#define RADIO_NO_LINK 0x02
+// Page Timeout
+#define RADIO_PAGE_TIMEOUT 0x04
+
+// What the radio looks like, read by the stand-in on every command. Every peer
+// follows the script, peer `i` running `i` ms ahead of peer 0; the fields after `rssi`
+// are off when zero.
+typedef struct {
+  bool connected; // listed by HCIGETCONNLIST
+  bool in_range;  // answers paging
+  bool sniff;     // connection in sniff mode
+  int8_t rssi;
+  int8_t rssi_low; // RSSI goes down to this over `swing_ms`, and back up as slowly
+  int swing_ms;
+  int up_ms;       // connected for `up_ms`, then gone for `down_ms`, over and over
+  int down_ms;
+  int page_ms;     // time to answer paging, a page fails past the page timeout
+  int busy_every;  // every n-th command is refused as busy
+  int peers;       // peers in the script, 1 when 0, at most 256
+} radio_t;
+
+// One auth: its config, what the radio looks like, and the PAM result it must give
+typedef struct {
+  const char *name;
+  const char *config;
+  radio_t radio;
+  int expect;
+} scenario_t;
+
+// Config pieces of the scenarios, a tool may add its own
+#define DEVICE_CONFIG "device = AA:BB:CC:DD:EE:FF\ncheck_trusted = 0\nmin_strength = -80\n"
+#define FRESH_RSSI    "request_update = 1\n"
+#define PAGE_FIRST    "probe_order = page\n"
+#define SHADOW        "shadow_min_strength = -70\nshadow_request_update = 1\nshadow_rate = 100\n"
+
+// Both outcomes of the connected and paging paths, a shadow run and a config error;
+// a tool lists them in its `scenario_t` table, next to its own
+#define STANDIN_SCENARIOS                                                                 \
+  {"connected, fresh", DEVICE_CONFIG FRESH_RSSI, {true, true, .rssi = -50}, PAM_SUCCESS}, \
+      {"connected, sniff",                                                                \
+       DEVICE_CONFIG FRESH_RSSI,                                                          \
+       {true, true, true, .rssi = -50},                                                   \
+       PAM_SUCCESS},                                                                      \
+      {"connected, weak signal", DEVICE_CONFIG, {true, true, .rssi = -95}, PAM_AUTH_ERR}, \
+      {"weak link, page first",                                                           \
+       DEVICE_CONFIG PAGE_FIRST,                                                          \
+       {true, true, .rssi = -95},                                                         \
+       PAM_AUTH_ERR},                                                                     \
+      {"paging, in range", DEVICE_CONFIG, {false, true, .rssi = -60}, PAM_SUCCESS},       \
+      {"paging, out of range", DEVICE_CONFIG, {false, false, .rssi = 0}, PAM_AUTH_ERR},   \
+      {"shadow, stricter candidate",                                                      \
+       DEVICE_CONFIG SHADOW,                                                              \
+       {true, true, .rssi = -75},                                                         \
+       PAM_SUCCESS},                                                                      \
+      {"config without device", "min_strength = 70\n", {false, false, .rssi = 0}, PAM_AUTH_ERR}
+
+static const bdaddr_t adapter_addr = {{0x01, 0x00, 0x00, 0xAD, 0x00, 0x00}};
+static const bdaddr_t device_addr = {{0xFF, 0xEE, 0xDD, 0xCC, 0xBB, 0xAA}};
+
+static const radio_t *radio;
+static int64_t radio_epoch_ms;
+static atomic_uint radio_commands;
+static atomic_uint radio_page_slots;
+static atomic_bool standin_fd[MAX_FDS];
+// 1 + the peer whose page was answered last on a module socket, 0 if none: the link
+// the page left stays up until the socket closes
+static atomic_int standin_paged[MAX_FDS];
+
+// Set while the stand-in runs on the thread of the module, what it allocates
+// then is not the module's
+static _Thread_local bool standin_busy;
+// Set while `pam_syslog` formats a message, what it allocates then is libpam's
+static _Thread_local bool standin_logging;
+
+// Formats every message on the heap, as libpam does before handing it to syslog(3),
+// then drops it
+void pam_syslog (const pam_handle_t *pamh, int priority, const char *fmt, ...) {
+  (void)pamh;
+  (void)priority;
+
+  int saved = errno;
+  standin_logging = true;
+  va_list args;
+  va_start (args, fmt);
+  char *message;
+  if (vasprintf (&message, fmt, args) >= 0) free (message);
+  va_end (args);
+  standin_logging = false;
+  errno = saved;
+}
+
+int pam_get_authtok (pam_handle_t *pamh, int item, const char **authtok, const char *prompt) {
+  (void)pamh;
+  (void)item;
+  (void)prompt;
+  *authtok = "";
+  return PAM_SUCCESS;
+}
+
+static int64_t radio_now_ms (void) {
+  struct timespec ts;
+  clock_gettime (CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// Sleeps of the radio itself, nanosleep is the module's and returns at once
+static void radio_sleep_ms (int ms) {
+  struct timespec ts = {.tv_sec = ms / 1000, .tv_nsec = ms % 1000 * 1000000L};
+  while (clock_nanosleep (CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR) continue;
+}
+
+// Run `script` from now on
+static void radio_start (const radio_t *script) {
+  radio = script;
+  radio_epoch_ms = radio_now_ms ();
+  atomic_store (&radio_commands, 0);
+  atomic_store (&radio_page_slots, 0x2000);  // 5.12 s
+}
+
+static int radio_peers (void) {
+  return radio->peers > 0 ? radio->peers : 1;
+}
+
+// Address of peer `i`, peer 0 is `device_addr`
+static bdaddr_t radio_peer_addr (int i) {
+  bdaddr_t addr = device_addr;
+  addr.b[0] -= i;
+  return addr;
+}
+
+// Peer of `addr`, -1 if none
+static int radio_peer_of (const uint8_t *addr) {
+  for (int i = 0; i < radio_peers (); i++) {
+    bdaddr_t peer = radio_peer_addr (i);
+    if (memcmp (peer.b, addr, 6) == 0) return i;
+  }
+  return -1;
+}
+
+// Time into the script of peer `i`
+static int64_t radio_clock (int i) {
+  return radio_now_ms () - radio_epoch_ms + i;
+}
+
+static bool radio_connected (int i) {
+  if (!radio->connected) return false;
+  if (radio->up_ms <= 0) return true;
+  return radio_clock (i) % (radio->up_ms + radio->down_ms) < radio->up_ms;
+}
+
+static int8_t radio_rssi (int i) {
+  if (radio->swing_ms <= 0) return radio->rssi;
+
+  // down then up, one `swing_ms` each way
+  int64_t t = radio_clock (i) % (2 * radio->swing_ms);
+  if (t > radio->swing_ms) t = 2 * radio->swing_ms - t;
+  return radio->rssi + (radio->rssi_low - radio->rssi) * t / radio->swing_ms;
+}
+
+static void send_event (int fd, uint8_t event, const void *param, uint8_t plen) {
+  uint8_t pkt[3 + 255] = {HCI_EVENT_PKT, event, plen};
+  memcpy (pkt + 3, param, plen);
+  if (write (fd, pkt, 3 + plen) < 0) perror ("stand-in radio");
+}
+
+// Peer `i` has a link the module on socket `fd` can use
+static bool radio_linked (int fd, int i) {
+  return i >= 0 && i < radio_peers () && (radio_connected (i) || standin_paged[fd] == i + 1);
+}
+
+// Controller side of one HCI socket, until the module closes it; `arg` packs the
+// controller end in the low 16 bits, the module end above
+static void *radio_serve (void *arg) {
+  int fd = (int)((intptr_t)arg & 0xFFFF), module_fd = (int)((intptr_t)arg >> 16);
+  uint8_t cmd[4 + 255];
+  ssize_t n;
+
+  while ((n = read (fd, cmd, sizeof (cmd))) > 0) {
+    if (n < 4 || cmd[0] != HCI_COMMAND_PKT) continue;
+    uint16_t opcode = cmd[1] | cmd[2] << 8;
+
+    // a controller may answer any command with a Command Status saying no
+    unsigned seq = atomic_fetch_add (&radio_commands, 1) + 1;
+    if (radio->busy_every > 0 && seq % radio->busy_every == 0) {
+      uint8_t status[] = {RADIO_BUSY, 1, cmd[1], cmd[2]};
+      send_event (fd, EVT_CMD_STATUS, status, sizeof (status));
+      continue;
+    }
+
+    if (opcode == BT_OPCODE (OGF_STATUS_PARAM, OCF_READ_RSSI)) {
+      // handles follow the peers, from 0x0040
+      uint16_t handle = cmd[4] | cmd[5] << 8;
+      int peer = handle - 0x0040;
+      bool linked = radio_linked (module_fd, peer);
+
+      // free command slots, opcode, status, handle, RSSI
+      uint8_t rp[] = {
+          1, cmd[1], cmd[2], linked ? 0 : RADIO_NO_LINK, cmd[4], cmd[5],
+          linked ? (uint8_t)radio_rssi (peer) : 0
+      };
+      send_event (fd, EVT_CMD_COMPLETE, rp, sizeof (rp));
+    } else if (opcode == BT_OPCODE (OGF_LINK_CTL, OCF_REMOTE_NAME_REQ)) {
+      uint8_t status[] = {0, 1, cmd[1], cmd[2]};
+      send_event (fd, EVT_CMD_STATUS, status, sizeof (status));
+
+      // slots are 0.625 ms, the answer comes by the page timeout at the latest
+      int timeout_ms = (int)(atomic_load (&radio_page_slots) * 5 / 8);
+      int peer = radio_peer_of (cmd + 4);
+      bool answers = radio->in_range && peer >= 0 && radio->page_ms <= timeout_ms;
+      standin_paged[module_fd] = answers ? peer + 1 : 0;
+      radio_sleep_ms (radio->page_ms < timeout_ms ? radio->page_ms : timeout_ms);
+
+      // status, address, name
+      uint8_t rp[1 + 6 + 248] = {answers ? 0x00 : RADIO_PAGE_TIMEOUT};
+      memcpy (rp + 1, cmd + 4, 6);
+      strcpy ((char *)rp + 7, "Stand-in phone");
+      send_event (fd, EVT_REMOTE_NAME_REQ_COMPLETE, rp, sizeof (rp));
+    } else if (opcode == BT_OPCODE (OGF_LINK_POLICY, OCF_EXIT_SNIFF_MODE)) {
+      // status (0x0C when already active), free command slots, opcode
+      uint8_t status[] = {radio->sniff ? 0x00 : HCI_COMMAND_DISALLOWED, 1, cmd[1], cmd[2]};
+      send_event (fd, EVT_CMD_STATUS, status, sizeof (status));
+
+      // status, handle, mode, interval
+      uint8_t change[] = {0, cmd[4], cmd[5], HCI_CM_ACTIVE, 0, 0};
+      if (radio->sniff) send_event (fd, EVT_MODE_CHANGE, change, sizeof (change));
+    } else if (opcode == BT_OPCODE (OGF_LINK_POLICY, OCF_SNIFF_MODE)) {
+      uint8_t status[] = {0, 1, cmd[1], cmd[2]};
+      send_event (fd, EVT_CMD_STATUS, status, sizeof (status));
+    } else if (opcode == BT_OPCODE (OGF_HOST_CTL, OCF_READ_PAGE_TIMEOUT)) {
+      unsigned slots = atomic_load (&radio_page_slots);
+      uint8_t rp[] = {1, cmd[1], cmd[2], 0, slots & 0xFF, slots >> 8};
+      send_event (fd, EVT_CMD_COMPLETE, rp, sizeof (rp));
+    } else if (opcode == BT_OPCODE (OGF_HOST_CTL, OCF_WRITE_PAGE_TIMEOUT)) {
+      atomic_store (&radio_page_slots, cmd[4] | cmd[5] << 8);
+      uint8_t rp[] = {1, cmd[1], cmd[2], 0};
+      send_event (fd, EVT_CMD_COMPLETE, rp, sizeof (rp));
+    } else {
+      uint8_t rp[] = {1, cmd[1], cmd[2], 0x01};  // unknown command
+      send_event (fd, EVT_CMD_COMPLETE, rp, sizeof (rp));
+    }
+  }
+
+  close (fd);
+  return NULL;
+}
+
+int socket (int domain, int type, int protocol) {
+  static int (*real_socket) (int, int, int);
+  if (!real_socket) real_socket = dlsym (RTLD_NEXT, "socket");
+  if (domain != AF_BLUETOOTH) return real_socket (domain, type, protocol);
+
+  int pair[2];
+  if (socketpair (AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, pair) < 0) return -1;
+  if (pair[0] >= MAX_FDS) {
+    close (pair[0]);
+    close (pair[1]);
+    errno = EMFILE;
+    return -1;
+  }
+
+  pthread_t thread;
+  standin_paged[pair[0]] = 0;
+  standin_busy = true;
+  intptr_t ends = pair[1] | (intptr_t)pair[0] << 16;
+  int err = pthread_create (&thread, NULL, radio_serve, (void *)ends);
+  if (err == 0) pthread_detach (thread);
+  standin_busy = false;
+  if (err != 0) {
+    close (pair[0]);
+    close (pair[1]);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  standin_fd[pair[0]] = true;
+  return pair[0];
+}
+
+int close (int fd) {
+  static int (*real_close) (int);
+  if (!real_close) real_close = dlsym (RTLD_NEXT, "close");
+  if (fd >= 0 && fd < MAX_FDS) standin_fd[fd] = false;
+  return real_close (fd);
+}
+
+static bool is_standin (int fd) {
+  return fd >= 0 && fd < MAX_FDS && standin_fd[fd];
+}
+
+int bind (int fd, const struct sockaddr *addr, socklen_t len) {
+  static int (*real_bind) (int, const struct sockaddr *, socklen_t);
+  if (!real_bind) real_bind = dlsym (RTLD_NEXT, "bind");
+  return is_standin (fd) ? 0 : real_bind (fd, addr, len);
+}
+
+int getsockopt (int fd, int level, int name, void *value, socklen_t *len) {
+  static int (*real_getsockopt) (int, int, int, void *, socklen_t *);
+  if (!real_getsockopt) real_getsockopt = dlsym (RTLD_NEXT, "getsockopt");
+  if (!is_standin (fd)) return real_getsockopt (fd, level, name, value, len);
+
+  memset (value, 0, *len);
+  return 0;
+}
+
+int setsockopt (int fd, int level, int name, const void *value, socklen_t len) {
+  static int (*real_setsockopt) (int, int, int, const void *, socklen_t);
+  if (!real_setsockopt) real_setsockopt = dlsym (RTLD_NEXT, "setsockopt");
+  return is_standin (fd) ? 0 : real_setsockopt (fd, level, name, value, len);
+}
+
+int ioctl (int fd, unsigned long request, ...) {
+  static int (*real_ioctl) (int, unsigned long, ...);
+  if (!real_ioctl) real_ioctl = dlsym (RTLD_NEXT, "ioctl");
+
+  va_list args;
+  va_start (args, request);
+  void *arg = va_arg (args, void *);
+  va_end (args);
+
+  if (!is_standin (fd)) return real_ioctl (fd, request, arg);
+
+  if (request == HCIGETDEVLIST) {
+    struct hci_dev_list_req *list = arg;
+    list->dev_num = 1;
+    list->dev_req[0] = (struct hci_dev_req){.dev_id = 0, .dev_opt = 1u << HCI_UP};
+  } else if (request == HCIGETDEVINFO) {
+    struct hci_dev_info *info = arg;
+    if (info->dev_id != 0) {
+      errno = ENODEV;
+      return -1;
+    }
+    *info = (struct hci_dev_info){
+        .name = "hci0", .bdaddr = adapter_addr, .flags = 1u << HCI_UP
+    };
+  } else if (request == HCIGETCONNLIST) {
+    struct hci_conn_list_req *list = arg;
+    int room = list->conn_num;
+    list->conn_num = 0;
+    for (int i = 0; i < radio_peers () && list->conn_num < room; i++) {
+      if (!radio_connected (i)) continue;
+      list->conn_info[list->conn_num++] = (struct hci_conn_info){
+          .handle = 0x0040 + i, .bdaddr = radio_peer_addr (i), .type = ACL_LINK
+      };
+    }
+  } else if (request == HCIGETCONNINFO) {
+    // ACL links only, the stand-in has no LE peers
+    struct hci_conn_info_req *req = arg;
+    int peer = radio_peer_of (req->bdaddr.b);
+    if (req->type != ACL_LINK || !radio_linked (fd, peer)) {
+      errno = ENOENT;
+      return -1;
+    }
+    req->conn_info[0] = (struct hci_conn_info){
+        .handle = 0x0040 + peer, .bdaddr = req->bdaddr, .type = ACL_LINK
+    };
+  } else {
+    errno = EINVAL;
+    return -1;
+  }
+
+  return 0;
+}
+
+int nanosleep (const struct timespec *duration, struct timespec *rem) {
+  (void)duration;
+  (void)rem;
+  return 0;
+}
+
+// `pam_sm_authenticate` of the module at `path`, loaded for the rest of the run;
+// NULL and reported if it cannot be loaded
+static pam_auth_fn standin_load (const char *path) {
+  void *module = dlopen (path, RTLD_NOW | RTLD_LOCAL);
+  if (!module) {
+    fprintf (stderr, "dlopen: %s\n", dlerror ());
+    return NULL;
+  }
+
+  pam_auth_fn authenticate = (pam_auth_fn)dlsym (module, "pam_sm_authenticate");
+  if (!authenticate) fprintf (stderr, "pam_sm_authenticate not exported by %s\n", path);
+  return authenticate;
+}
+
+// Writes `config` to a fresh file under /tmp, `arg` set to the `config=` argument of
+// the module naming it. Failures are reported; `standin_config_remove` once done.
+static bool standin_config_arg (char arg[40], const char *config) {
+  strcpy (arg, "config=/tmp/pam_bluetooth_tool.XXXXXX");
+  int fd = mkstemp (arg + 7);
+  if (fd < 0) {
+    perror ("config");
+    return false;
+  }
+
+  bool ok = write (fd, config, strlen (config)) == (ssize_t)strlen (config);
+  close (fd);
+  if (!ok) {
+    perror ("config");
+    unlink (arg + 7);
+  }
+  return ok;
+}
+
+static void standin_config_remove (const char arg[40]) {
+  unlink (arg + 7);
+}
+
+static bool write_file (const char *path, const char *text) {
+  int fd = open (path, O_WRONLY | O_CLOEXEC);
+  if (fd < 0) return false;
+  bool ok = write (fd, text, strlen (text)) == (ssize_t)strlen (text);
+  close (fd);
+  return ok;
+}
+
+// The module only maps a statistics file owned by root. Run by anyone else, the tool
+// becomes root of a user namespace of its own, where the files it creates are owned by
+// root. Needs a single thread, so before the first auth.
+static bool standin_root (void) {
+  uid_t uid = geteuid ();
+  gid_t gid = getegid ();
+  if (uid == 0) return true;
+  if (unshare (CLONE_NEWUSER) < 0) return false;
+
+  char map[32];
+  snprintf (map, sizeof (map), "0 %u 1", (unsigned)uid);
+  if (!write_file ("/proc/self/uid_map", map)) return false;
+  snprintf (map, sizeof (map), "0 %u 1", (unsigned)gid);
+  return write_file ("/proc/self/setgroups", "deny") && write_file ("/proc/self/gid_map", map);
+}
+
+// Fresh statistics file for `pairs` in a directory of its own under /tmp, made as
+// pam_bluetoothd does; `arg` is the `stats=` argument of the module. Failures are
+// reported.
+static bool stats_start (char dir[32], char arg[48], size_t pairs) {
+  if (!standin_root ()) {
+    perror ("user namespace (run as root instead)");
+    return false;
+  }
+
+  strcpy (dir, "/tmp/pam_bluetooth_tool.XXXXXX");
+  if (!mkdtemp (dir)) {
+    perror ("statistics directory");
+    return false;
+  }
+
+  snprintf (arg, 48, "stats=%s/stats", dir);
+  if (bt_stats_prepare (arg + 6, pairs) < 0) {
+    perror ("statistics file");
+    rmdir (dir);
+    return false;
+  }
+  return true;
+}
+
+// Removes the file of `stats_start`, false and reported if the auths recorded nothing
+static bool stats_finish (const char dir[32], const char arg[48]) {
+  uint64_t probes = 0;
+  bt_stats_t stats;
+  if (bt_stats_open (&stats, arg + 6, false) == 0) {
+    size_t it = 0;
+    bdaddr_t adapter, device;
+    bt_stats_summary_t sum;
+    while (bt_stats_next (&stats, &it, &adapter, &device, &sum)) {
+      for (int k = 0; k < BT_PROBE_KINDS; k++) probes += sum.attempts[k];
+    }
+    bt_stats_close (&stats);
+  }
+
+  unlink (arg + 6);
+  rmdir (dir);
+  if (probes == 0) fprintf (stderr, "%s: the auths recorded no statistics\n", arg + 6);
+  return probes > 0;
+}
+
+#endif  // STANDIN_RADIO_H
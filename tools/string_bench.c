@@ -0,0 +1,415 @@
+// Heap calls and time of the z3 String workloads of the module, see `make bench`
+//
+// malloc, calloc, realloc and free are replaced by counting wrappers around
+// the ones of glibc. Each section runs one workload many times and prints
+// the heap calls per run and the time per run.
+//
+// Allocators: the strings of one auth (info path, device name, its escaped
+// form, a log line and a template) from the heap, then from an arena on the
+// stack reset after each auth, as pam_sm_authenticate does.
+//
+// Short strings: a table of addresses and config values, kept inline, then
+// the same in 128-byte heap buffers as `z3_str (128)` gave before strings
+// had inline storage. Each run builds the table, reads it back and drops it.
+//
+// Formatted appends: a log line built in an empty string with snprintf into
+// a stack buffer then z3_pushl, with one z3_pushf, and with the printf-free
+// appends. All three must give the same text, z3_pushf in one allocation
+// and, for a line this short, one formatting through its stack buffer.
+// Then the time per value of each printf-free append against snprintf.
+//
+// Usage: string_bench [runs]
+
+#define _DEFAULT_SOURCE
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define Z3_STRING_IMPL
+#define Z3_TOYS_IMPL
+#include "../lib/z3_string.h"
+#include "timing.h"
+
+extern void *__libc_malloc (size_t size);
+extern void *__libc_calloc (size_t count, size_t size);
+extern void *__libc_realloc (void *ptr, size_t size);
+extern void __libc_free (void *ptr);
+
+typedef struct {
+  size_t mallocs;
+  size_t reallocs;
+  size_t frees;
+} heap_calls_t;
+
+static bool counting;
+static heap_calls_t calls;
+
+void *malloc (size_t size) {
+  if (counting) calls.mallocs++;
+  return __libc_malloc (size);
+}
+
+void *calloc (size_t count, size_t size) {
+  if (counting) calls.mallocs++;
+  return __libc_calloc (count, size);
+}
+
+void *realloc (void *ptr, size_t size) {
+  if (counting) calls.reallocs++;
+  return __libc_realloc (ptr, size);
+}
+
+void free (void *ptr) {
+  if (counting && ptr) calls.frees++;
+  __libc_free (ptr);
+}
+
+// Keeps the optimizer from dropping a result
+static volatile size_t sink;
+
+static void print_header (const char *section) {
+  printf ("%-24s %10s %10s %10s %10s\n", section, "malloc", "realloc", "free", "ns/run");
+}
+
+static void print_row (const char *name, int runs, int64_t ns) {
+  printf (
+      "%-24s %10.2f %10.2f %10.2f %10.1f\n", name, (double)calls.mallocs / runs,
+      (double)calls.reallocs / runs, (double)calls.frees / runs, (double)ns / runs
+  );
+}
+
+static bool fill_auth (String *out, void *ctx, char *id, size_t len) {
+  (void)ctx;
+  if (len == 4 && memcmp (id, "addr", 4) == 0) return z3_pushl (out, "AA:BB:CC:DD:EE:FF", 17);
+  if (len == 4 && memcmp (id, "rssi", 4) == 0) return z3_pushl (out, "-58", 3);
+  return false;
+}
+
+// The strings of one auth, every one released before returning
+static void auth_strings (const Z3Allocator *alloc) {
+  static const char mac[] = "AA:BB:CC:DD:EE:FF";
+  static const char name[] = "Pixel of Alice\t(work)\n";
+
+  String path = z3_concat (
+      alloc, Z3_SV ("/var/lib/bluetooth/"), Z3_SV (mac), Z3_SV ("/"), Z3_SV (mac),
+      Z3_SV ("/info")
+  );
+  String escaped = z3_escape_in (alloc, name, sizeof (name) - 1);
+
+  String line = z3_str_in (alloc, 16);
+  z3_pushl (&line, "Device ", 7);
+  z3_pushl (&line, mac, sizeof (mac) - 1);
+  z3_pushl (&line, " named ", 7);
+  z3_pushl (&line, z3_chr (&escaped), escaped.len);
+  z3_pushl (&line, " is trusted", 11);
+
+  String tmpl = z3_strcpy_in (alloc, "Device #{addr} found with RSSI: #{rssi} dBm");
+  String logged = z3_interp (&tmpl, fill_auth, NULL);
+
+  sink += path.len + line.len + logged.len;
+  z3_drops (&logged);
+  z3_drops (&tmpl);
+  z3_drops (&line);
+  z3_drops (&escaped);
+  z3_drops (&path);
+}
+
+static bool bench_allocators (int runs) {
+  print_header ("allocator");
+
+  sink = 0;
+  calls = (heap_calls_t){0};
+  counting = true;
+  int64_t start = now_ns ();
+  for (int i = 0; i < runs; i++) auth_strings (&z3_heap);
+  int64_t ns = now_ns () - start;
+  counting = false;
+  print_row ("heap", runs, ns);
+  size_t heap_chars = sink;
+
+  alignas (max_align_t) char buf[1024];
+  Z3Arena arena;
+  z3_arena_init (&arena, buf, sizeof (buf));
+
+  sink = 0;
+  calls = (heap_calls_t){0};
+  counting = true;
+  start = now_ns ();
+  for (int i = 0; i < runs; i++) {
+    auth_strings (&arena.alloc);
+    z3_arena_reset (&arena);
+  }
+  ns = now_ns () - start;
+  counting = false;
+  print_row ("arena, reset per auth", runs, ns);
+
+  // an arena too small would fail allocations and look fast
+  return sink == heap_chars;
+}
+
+// Typical short contents: addresses, adapter names and config values
+static const char *const short_values[] = {
+    "AA:BB:CC:DD:EE:FF", "hci0", "-70", "connected", "00:1A:7D:DA:71:13", "1280", "yes",
+};
+#define SHORT_TABLE 4096
+
+static String table[SHORT_TABLE];
+
+// Builds the table with `min` capacity per string, reads it and drops it
+static void short_strings (size_t min) {
+  size_t count = sizeof (short_values) / sizeof (*short_values);
+  for (size_t i = 0; i < SHORT_TABLE; i++) {
+    const char *value = short_values[i % count];
+    table[i] = z3_str (min);
+    z3_pushl (&table[i], value, strlen (value));
+  }
+
+  // the first and last characters, as a lookup comparing keys would
+  size_t sum = 0;
+  for (size_t i = 0; i < SHORT_TABLE; i++) {
+    const char *chr = z3_chr (&table[i]);
+    sum += chr[0] + chr[table[i].len - 1];
+  }
+  sink += sum;
+
+  for (size_t i = 0; i < SHORT_TABLE; i++) z3_drops (&table[i]);
+}
+
+static void bench_short (int runs) {
+  // a table holds thousands of strings, fewer runs keep the time the same
+  runs = runs / SHORT_TABLE > 0 ? runs / SHORT_TABLE : 1;
+  print_header ("per short string");
+
+  static const struct {
+    const char *name;
+    size_t min;
+  } layouts[] = {{"inline", 0}, {"heap, z3_str (128)", 128}};
+
+  for (size_t l = 0; l < sizeof (layouts) / sizeof (*layouts); l++) {
+    calls = (heap_calls_t){0};
+    counting = true;
+    int64_t start = now_ns ();
+    for (int i = 0; i < runs; i++) short_strings (layouts[l].min);
+    int64_t ns = now_ns () - start;
+    counting = false;
+    print_row (layouts[l].name, runs * SHORT_TABLE, ns);
+  }
+}
+
+// A bdaddr in BlueZ byte order, and its bytes as printed
+static const uint8_t line_addr[6] = {0xFF, 0xEE, 0xDD, 0xCC, 0xBB, 0xAA};
+#define LINE_ADDR 0xAA, 0xBB, 0xCC, 0xDD, 0xEE, 0xFF
+
+#define LINE_FMT  "Device %02X:%02X:%02X:%02X:%02X:%02X found with RSSI: %d dBm, handle 0x%04x"
+#define LINE_ARGS LINE_ADDR, -58, 0x2a
+
+static String line_snprintf (void) {
+  String s = z3_str (0);
+  char buf[128];
+  int n = snprintf (buf, sizeof (buf), LINE_FMT, LINE_ARGS);
+  z3_pushl (&s, buf, n);
+  return s;
+}
+
+static String line_pushf (void) {
+  String s = z3_str (0);
+  z3_pushf (&s, LINE_FMT, LINE_ARGS);
+  return s;
+}
+
+static String line_fast (void) {
+  String s = z3_str (0);
+  z3_pushl (&s, "Device ", 7);
+  z3_pushba (&s, line_addr);
+  z3_pushl (&s, " found with RSSI: ", 18);
+  z3_pushdbm (&s, -58);
+  z3_pushl (&s, ", handle 0x", 11);
+  z3_pushx (&s, 0x2a, 4);
+  return s;
+}
+
+static bool bench_pushf (int runs) {
+  print_header ("per log line");
+
+  static const struct {
+    const char *name;
+    String (*build) (void);
+  } builders[] = {
+      {"snprintf, z3_pushl", line_snprintf},
+      {"z3_pushf", line_pushf},
+      {"printf-free appends", line_fast},
+  };
+
+  String expected = line_snprintf ();
+  bool same = true;
+  for (size_t b = 0; b < sizeof (builders) / sizeof (*builders); b++) {
+    String line = builders[b].build ();
+    same = same && line.len == expected.len &&
+           memcmp (z3_chr (&line), z3_chr (&expected), line.len) == 0;
+    z3_drops (&line);
+
+    calls = (heap_calls_t){0};
+    counting = true;
+    int64_t start = now_ns ();
+    for (int i = 0; i < runs; i++) {
+      line = builders[b].build ();
+      sink += line.len;
+      z3_drops (&line);
+    }
+    int64_t ns = now_ns () - start;
+    counting = false;
+    print_row (builders[b].name, runs, ns);
+    if (builders[b].build == line_pushf && calls.mallocs + calls.reallocs > (size_t)runs) {
+      same = false;
+    }
+  }
+  z3_drops (&expected);
+  return same;
+}
+
+// One value in three ways: snprintf then z3_pushl, z3_pushf, printf-free
+static volatile int64_t value = -1234567890123;
+static volatile int rssi = -58;
+
+static void append_snprintf (String *s, const char *fmt, ...) {
+  char buf[32];
+  va_list args;
+  va_start (args, fmt);
+  int n = vsnprintf (buf, sizeof (buf), fmt, args);
+  va_end (args);
+  z3_pushl (s, buf, n);
+}
+
+static void u_snprintf (String *s) {
+  append_snprintf (s, "%llu", (unsigned long long)-value);
+}
+
+static void u_pushf (String *s) {
+  z3_pushf (s, "%llu", (unsigned long long)-value);
+}
+
+static void u_fast (String *s) {
+  z3_pushu (s, -value);
+}
+
+static void i_snprintf (String *s) {
+  append_snprintf (s, "%lld", (long long)value);
+}
+
+static void i_pushf (String *s) {
+  z3_pushf (s, "%lld", (long long)value);
+}
+
+static void i_fast (String *s) {
+  z3_pushi (s, value);
+}
+
+static void x_snprintf (String *s) {
+  append_snprintf (s, "%04x", (unsigned)rssi & 0xFF);
+}
+
+static void x_pushf (String *s) {
+  z3_pushf (s, "%04x", (unsigned)rssi & 0xFF);
+}
+
+static void x_fast (String *s) {
+  z3_pushx (s, (unsigned)rssi & 0xFF, 4);
+}
+
+static void dbm_snprintf (String *s) {
+  append_snprintf (s, "%d dBm", rssi);
+}
+
+static void dbm_pushf (String *s) {
+  z3_pushf (s, "%d dBm", rssi);
+}
+
+static void dbm_fast (String *s) {
+  z3_pushdbm (s, rssi);
+}
+
+static void ba_snprintf (String *s) {
+  append_snprintf (s, "%02X:%02X:%02X:%02X:%02X:%02X", LINE_ADDR);
+}
+
+static void ba_pushf (String *s) {
+  z3_pushf (s, "%02X:%02X:%02X:%02X:%02X:%02X", LINE_ADDR);
+}
+
+static void ba_fast (String *s) {
+  z3_pushba (s, line_addr);
+}
+
+// ns per value appended to a string with room for it, then emptied
+static double time_append (String *s, void (*append) (String *), int runs) {
+  int64_t start = now_ns ();
+  for (int i = 0; i < runs; i++) {
+    append (s);
+    sink += s->len;
+    s->len = 0;
+  }
+  return (double)(now_ns () - start) / runs;
+}
+
+static bool bench_values (int runs) {
+  static const struct {
+    const char *name;
+    void (*append[3]) (String *);
+  } rows[] = {
+      {"unsigned", {u_snprintf, u_pushf, u_fast}},
+      {"signed", {i_snprintf, i_pushf, i_fast}},
+      {"hex, width 4", {x_snprintf, x_pushf, x_fast}},
+      {"dBm", {dbm_snprintf, dbm_pushf, dbm_fast}},
+      {"bdaddr", {ba_snprintf, ba_pushf, ba_fast}},
+  };
+
+  printf ("%-24s %10s %10s %10s\n", "ns per value", "snprintf", "z3_pushf", "printf-free");
+  String s = z3_str (64), expected = z3_str (64);
+  bool same = true;
+
+  for (size_t r = 0; r < sizeof (rows) / sizeof (*rows); r++) {
+    expected.len = 0;
+    rows[r].append[0] (&expected);
+
+    double ns[3];
+    for (int a = 0; a < 3; a++) {
+      s.len = 0;
+      rows[r].append[a] (&s);
+      same = same && s.len == expected.len &&
+             memcmp (z3_chr (&s), z3_chr (&expected), s.len) == 0;
+      ns[a] = time_append (&s, rows[r].append[a], runs);
+    }
+    printf ("%-24s %10.1f %10.1f %10.1f\n", rows[r].name, ns[0], ns[1], ns[2]);
+  }
+
+  z3_drops (&expected);
+  z3_drops (&s);
+  return same;
+}
+
+int main (int argc, char **argv) {
+  int runs = argc > 1 ? atoi (argv[1]) : 1000000;
+  if (runs < 1) runs = 1;
+
+  if (!bench_allocators (runs)) {
+    fprintf (stderr, "string_bench: arena results differ from the heap ones\n");
+    return 1;
+  }
+
+  printf ("\n");
+  bench_short (runs);
+
+  printf ("\n");
+  if (!bench_pushf (runs)) {
+    fprintf (stderr, "string_bench: log lines differ, or z3_pushf allocated more than once\n");
+    return 1;
+  }
+
+  printf ("\n");
+  if (!bench_values (runs)) {
+    fprintf (stderr, "string_bench: printf-free appends differ from snprintf\n");
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,209 @@
+// Cost of the probe schedule of pam_bluetoothd, see `make bench`
+//
+// Arms one periodic timer per device in a Z3Wheel and advances it one 1 ms
+// tick at a time, re-arming every timer it expires with the same jitter as
+// the daemon. Periods grow with the device count, so every run expires about
+// one timer per tick and the per-tick cost shows the overhead of the wheel
+// alone. For comparison, the same ticks with deadlines in a plain array,
+// scanned on every tick.
+//
+// Every expired timer must be due at the tick it comes out, and as many must
+// come out as were scheduled, else the run fails. Before timing, timers far
+// past the last level and cancelled ones are checked the same way.
+//
+// Usage: wheel_bench [ticks]
+
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define Z3_TOYS_IMPL
+#include "../lib/z3_toys.h"
+#include "timing.h"
+
+// Probe intervals vary by up to 1/JITTER either way, as in the daemon
+#define JITTER 8
+// Ticks of the array scan, it gets slow
+#define SCAN_TICKS 1000
+
+typedef struct {
+  Z3Timer timer;
+  uint64_t period;
+  uint64_t due;  // tick it was armed for, 0 once cancelled
+} device_t;
+
+static uint64_t jitter (uint64_t *seed, uint64_t period) {
+  uint64_t spread = period / JITTER;
+  return period - spread + z3_mix64 ((*seed)++) % (2 * spread + 1);
+}
+
+// Offsets from the start of `check_wheel`: each level boundary, the 2^24 ticks the
+// levels cover, and far beyond, where timers go round the last level more than once
+static const uint64_t far_offsets[] = {
+    1,
+    2,
+    63,
+    64,
+    65,
+    4095,
+    4096,
+    4097,
+    262143,
+    262144,
+    262145,
+    (1 << 24) - 1,
+    1 << 24,
+    (1 << 24) + 1,
+    (1 << 25) + 3,
+    3 * (1 << 24) + 7,
+    (1ULL << 30) + 12345,
+    (1ULL << 36) + 1,
+};
+#define FAR_TIMERS (sizeof (far_offsets) / sizeof (*far_offsets))
+
+// Whether timers far ahead expire at their tick and cancelled ones never do. Every
+// fourth one from the second is cancelled once armed, every fourth from the fourth
+// when the one before it expires, while it still waits in an upper level.
+static bool check_wheel (void) {
+  static Z3Wheel wheel;
+  device_t devices[FAR_TIMERS] = {};
+  // not on a slot boundary of any level
+  uint64_t start = 1000003, last = start;
+  size_t expected = 0, fired = 0;
+
+  z3_wheel_init (&wheel, start);
+  for (size_t i = 0; i < FAR_TIMERS; i++) {
+    devices[i].due = start + far_offsets[i];
+    z3_wheel_add (&wheel, &devices[i].timer, devices[i].due);
+    if (i % 4 == 1) {
+      z3_wheel_cancel (&wheel, &devices[i].timer);
+      devices[i].due = 0;
+    } else if (i % 4 != 3) {
+      expected++;
+    }
+  }
+
+  // straight to the next tick a timer may be due at, there are 2^36 of them
+  while (wheel.count) {
+    uint64_t now = z3_wheel_next (&wheel);
+    if (now < last) {
+      fprintf (
+          stderr, "check_wheel: went back from tick %llu to %llu\n", (unsigned long long)last,
+          (unsigned long long)now
+      );
+      return false;
+    }
+    last = now;
+
+    Z3Timer *timer;
+    while ((timer = z3_wheel_expire (&wheel, now))) {
+      device_t *dev = z3_container_of (timer, device_t, timer);
+      size_t i = dev - devices;
+      if (dev->due != now || timer->expires != now) {
+        fprintf (
+            stderr, "check_wheel: timer %zu due at %llu expired at %llu\n", i,
+            (unsigned long long)dev->due, (unsigned long long)now
+        );
+        return false;
+      }
+      if (i % 4 == 2) {
+        z3_wheel_cancel (&wheel, &devices[i + 1].timer);
+        devices[i + 1].due = 0;
+      }
+      fired++;
+    }
+  }
+
+  if (fired != expected) {
+    fprintf (stderr, "check_wheel: %zu timers expired, %zu expected\n", fired, expected);
+    return false;
+  }
+  return true;
+}
+
+// ns per tick of the wheel, `fired` set to the timers it expired, -1 if one expired
+// at another tick than its own or any scheduled before `ticks` did not
+static double bench_wheel (device_t *devices, size_t n, uint64_t ticks, uint64_t *fired) {
+  static Z3Wheel wheel;
+  uint64_t seed = 1, expected = 0;
+  z3_wheel_init (&wheel, 0);
+  for (size_t i = 0; i < n; i++) {
+    devices[i] = (device_t){.period = n, .due = 1 + z3_mix64 (seed++) % n};
+    z3_wheel_add (&wheel, &devices[i].timer, devices[i].due);
+    if (devices[i].due <= ticks) expected++;
+  }
+
+  *fired = 0;
+  uint64_t wrong = 0;
+  int64_t start = now_ns ();
+  for (uint64_t now = 1; now <= ticks; now++) {
+    Z3Timer *timer;
+    while ((timer = z3_wheel_expire (&wheel, now))) {
+      device_t *dev = z3_container_of (timer, device_t, timer);
+      // counted rather than reported, the loop is timed
+      wrong += dev->due != now || timer->expires != now;
+      dev->due = now + jitter (&seed, dev->period);
+      z3_wheel_add (&wheel, timer, dev->due);
+      if (dev->due <= ticks) expected++;
+      (*fired)++;
+    }
+  }
+  double ns = (double)(now_ns () - start) / ticks;
+
+  if (wrong || *fired != expected) {
+    fprintf (
+        stderr, "bench_wheel: %zu devices, %llu of %llu timers off their tick, %llu expected\n",
+        n, (unsigned long long)wrong, (unsigned long long)*fired, (unsigned long long)expected
+    );
+    return -1;
+  }
+  return ns;
+}
+
+// ns per tick of a linear scan over every deadline
+static double bench_scan (uint64_t *deadlines, size_t n) {
+  uint64_t seed = 1;
+  for (size_t i = 0; i < n; i++) deadlines[i] = z3_mix64 (seed++) % n;
+
+  int64_t start = now_ns ();
+  for (uint64_t now = 1; now <= SCAN_TICKS; now++) {
+    for (size_t i = 0; i < n; i++) {
+      if (deadlines[i] <= now) deadlines[i] = now + jitter (&seed, n);
+    }
+  }
+  return (double)(now_ns () - start) / SCAN_TICKS;
+}
+
+int main (int argc, char **argv) {
+  uint64_t ticks = argc > 1 ? strtoull (argv[1], NULL, 10) : 1000000;
+  if (ticks < 1) ticks = 1;
+
+  static const size_t counts[] = {1000, 10000, 100000, 1000000};
+  size_t max = counts[sizeof (counts) / sizeof (*counts) - 1];
+
+  if (!check_wheel ()) return 1;
+
+  device_t *devices = malloc (max * sizeof (*devices));
+  uint64_t *deadlines = malloc (max * sizeof (*deadlines));
+  if (!devices || !deadlines) return 2;
+
+  printf (
+      "%10s %12s %12s %12s %14s\n", "devices", "ns/tick", "fired/tick", "ns/fired",
+      "scan ns/tick"
+  );
+  for (size_t c = 0; c < sizeof (counts) / sizeof (*counts); c++) {
+    uint64_t fired;
+    double wheel_ns = bench_wheel (devices, counts[c], ticks, &fired);
+    if (wheel_ns < 0) return 1;
+    double scan_ns = bench_scan (deadlines, counts[c]);
+    printf (
+        "%10zu %12.1f %12.2f %12.1f %14.1f\n", counts[c], wheel_ns, (double)fired / ticks,
+        fired ? wheel_ns * ticks / fired : 0, scan_ns
+    );
+  }
+
+  free (devices);
+  free (deadlines);
+  return 0;
+}